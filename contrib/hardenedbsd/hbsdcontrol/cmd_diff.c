@@ -0,0 +1,300 @@
+/*-
+ * Copyright (c) 2015-2018 Oliver Pinter <oliver.pinter@HardenedBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <vis.h>
+
+#include "cmd_diff.h"
+#include "hbsdcontrol.h"
+#include "libhbsdcontrol.h"
+
+#define	DIFF_EXIT_SAME		0
+#define	DIFF_EXIT_DIFFER	1
+#define	DIFF_EXIT_ERROR		2
+
+struct diff_counters {
+	unsigned long	added;
+	unsigned long	removed;
+	unsigned long	changed;
+};
+
+static const char *diff_prefix = NULL;
+static bool diff_summary = false;
+/* A file could not be read, so the result is incomplete. */
+static bool diff_failed = false;
+
+static void
+diff_getopt(int *argc, char ***argv, void (*usage_fn)(bool))
+{
+	int ch;
+
+	/* The command name takes the place of argv[0]. */
+	optreset = 1;
+	optind = 1;
+	while ((ch = getopt(*argc + 1, *argv - 1, "p:s")) != -1) {
+		switch (ch) {
+		case 'p':
+			diff_prefix = optarg;
+			break;
+		case 's':
+			diff_summary = true;
+			break;
+		default:
+			usage_fn(true);
+		}
+	}
+
+	*argc -= optind - 1;
+	*argv += optind - 1;
+}
+
+static int
+diff_next(struct hbsdcontrol_snapshot *snap, const char *name,
+    struct hbsdcontrol_snapshot_entry *entry)
+{
+	int ret;
+
+	/* Skip the unreadable files, they can not be compared. */
+	while ((ret = hbsdcontrol_snapshot_next(snap, entry)) > 0 && entry->error) {
+		warnc(entry->error, "%s: %s", name, entry->path);
+		diff_failed = true;
+	}
+
+	if (ret < 0)
+		err(DIFF_EXIT_ERROR, "%s", name);
+
+	return (ret);
+}
+
+/*
+ * The paths are printed encoded with strvis(3), as in the snapshots, so
+ * a file name with a newline can not forge a line.
+ */
+static const char *
+diff_vis(const char *path, char *vpath, size_t size)
+{
+
+	strnvis(vpath, size, path, VIS_WHITE | VIS_CSTYLE | VIS_OCTAL);
+
+	return (vpath);
+}
+
+static void
+diff_file(char op, const struct hbsdcontrol_snapshot_entry *entry,
+    struct diff_counters *counters, bool added)
+{
+	char vpath[MAXPATHLEN * 4 + 1];
+
+	if (!diff_summary)
+		printf("%c %s\n", op, diff_vis(entry->path, vpath, sizeof(vpath)));
+
+	for (int feature = 0; feature < HBSDCONTROL_NFEATURES; feature++) {
+		if (entry->states[feature] == sysdef)
+			continue;
+		if (added)
+			counters[feature].added++;
+		else
+			counters[feature].removed++;
+	}
+}
+
+static bool
+diff_states(const struct hbsdcontrol_snapshot_entry *a,
+    const struct hbsdcontrol_snapshot_entry *b, struct diff_counters *counters)
+{
+	char vpath[MAXPATHLEN * 4 + 1];
+	bool changed;
+
+	changed = false;
+	for (int feature = 0; feature < HBSDCONTROL_NFEATURES; feature++) {
+		if (a->states[feature] == b->states[feature])
+			continue;
+
+		if (!diff_summary)
+			printf("~ %s %s: %s -> %s\n",
+			    diff_vis(a->path, vpath, sizeof(vpath)),
+			    pax_features[feature].feature,
+			    hbsdcontrol_state_to_string(a->states[feature]),
+			    hbsdcontrol_state_to_string(b->states[feature]));
+		counters[feature].changed++;
+		changed = true;
+	}
+
+	return (changed);
+}
+
+void
+snapshot_usage(bool terminate)
+{
+
+	fprintf(stderr, "\thbsdcontrol snapshot [-p prefix] directory\n");
+
+	if (terminate)
+		exit(-1);
+}
+
+int
+snapshot_cmd(int *argc, char ***argv)
+{
+	struct hbsdcontrol_snapshot_entry entry;
+	struct hbsdcontrol_snapshot *snap;
+	bool failed;
+	int error;
+	int ret;
+
+	diff_getopt(argc, argv, snapshot_usage);
+
+	if (*argc < 1)
+		snapshot_usage(true);
+
+	error = hbsdcontrol_snapshot_open((*argv)[0], diff_prefix, &snap);
+	if (error)
+		errc(1, error, "%s", (*argv)[0]);
+
+	failed = false;
+	hbsdcontrol_snapshot_write_header(stdout);
+	while ((ret = hbsdcontrol_snapshot_next(snap, &entry)) > 0) {
+		if (entry.error) {
+			warnc(entry.error, "%s", entry.path);
+			failed = true;
+			continue;
+		}
+		error = hbsdcontrol_snapshot_write(stdout, &entry);
+		if (error)
+			errc(1, error, "%s", entry.path);
+	}
+	if (ret < 0)
+		err(1, "%s", (*argv)[0]);
+
+	hbsdcontrol_snapshot_close(&snap);
+
+	if (fflush(stdout) != 0)
+		err(1, "stdout");
+
+	/* The snapshot is written, but it misses the unreadable files. */
+	if (failed)
+		exit(1);
+
+	return (0);
+}
+
+void
+diff_usage(bool terminate)
+{
+
+	fprintf(stderr, "\thbsdcontrol diff [-s] [-p prefix] snapshot|directory snapshot|directory\n");
+
+	if (terminate)
+		exit(-1);
+}
+
+/*
+ * Merge join of two snapshots in walk order, only the current entry of
+ * each side is kept in memory.
+ */
+int
+diff_cmd(int *argc, char ***argv)
+{
+	struct diff_counters counters[HBSDCONTROL_NFEATURES];
+	struct hbsdcontrol_snapshot_entry ea, eb;
+	struct hbsdcontrol_snapshot *a, *b;
+	const char *namea, *nameb;
+	bool differ;
+	int ra, rb;
+	int error;
+	int cmp;
+
+	diff_getopt(argc, argv, diff_usage);
+
+	if (*argc < 2)
+		diff_usage(true);
+
+	namea = (*argv)[0];
+	nameb = (*argv)[1];
+
+	error = hbsdcontrol_snapshot_open(namea, diff_prefix, &a);
+	if (error)
+		errc(DIFF_EXIT_ERROR, error, "%s", namea);
+	error = hbsdcontrol_snapshot_open(nameb, diff_prefix, &b);
+	if (error)
+		errc(DIFF_EXIT_ERROR, error, "%s", nameb);
+
+	memset(counters, 0, sizeof(counters));
+	differ = false;
+
+	ra = diff_next(a, namea, &ea);
+	rb = diff_next(b, nameb, &eb);
+	while (ra > 0 || rb > 0) {
+		if (ra == 0)
+			cmp = 1;
+		else if (rb == 0)
+			cmp = -1;
+		else
+			cmp = hbsdcontrol_path_cmp(ea.path, eb.path, NULL);
+
+		if (cmp < 0) {
+			diff_file('-', &ea, counters, false);
+			differ = true;
+			ra = diff_next(a, namea, &ea);
+		} else if (cmp > 0) {
+			diff_file('+', &eb, counters, true);
+			differ = true;
+			rb = diff_next(b, nameb, &eb);
+		} else {
+			differ |= diff_states(&ea, &eb, counters);
+			ra = diff_next(a, namea, &ea);
+			rb = diff_next(b, nameb, &eb);
+		}
+	}
+
+	hbsdcontrol_snapshot_close(&a);
+	hbsdcontrol_snapshot_close(&b);
+
+	if (diff_summary) {
+		printf("feature\tadded\tremoved\tchanged\n");
+		for (int feature = 0; feature < HBSDCONTROL_NFEATURES; feature++)
+			printf("%s\t%lu\t%lu\t%lu\n", pax_features[feature].feature,
+			    counters[feature].added, counters[feature].removed,
+			    counters[feature].changed);
+	}
+
+	fflush(stdout);
+
+	if (diff_failed)
+		exit(DIFF_EXIT_ERROR);
+
+	exit(differ ? DIFF_EXIT_DIFFER : DIFF_EXIT_SAME);
+}
@@ -26,14 +26,17 @@
  * $FreeBSD$
  */
 
-#include <sys/types.h>
+#include <sys/param.h>
 #include <sys/sbuf.h>
 #include <sys/stat.h>
 
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <unistd.h>
 #include <err.h>
 #include <errno.h>
 
@@ -41,22 +44,46 @@
 #include "hbsdcontrol.h"
 #include "libhbsdcontrol.h"
 
+/* The exit status of the status action. */
+#define	PAX_STATUS_ENABLED	0
+#define	PAX_STATUS_DISABLED	1
+#define	PAX_STATUS_SYSDEF	2
+#define	PAX_STATUS_CONFLICT	3
+#define	PAX_STATUS_ERROR	4
+
 static int pax_enable_cb(int *argc, char ***argv);
 static int pax_disable_cb(int *argc, char ***argv);
+static int pax_status_cb(int *argc, char ***argv);
 static int pax_reset_cb(int *argc, char ***argv);
+static int pax_reset_all_cb(int *argc, char ***argv);
+static int pax_migrate_cb(int *argc, char ***argv);
 static int pax_list_cb(int *argc, char ***argv);
+static int pax_stats_cb(int *argc, char ***argv);
+static int pax_apply_profile_cb(int *argc, char ***argv);
+static int pax_clone_cb(int *argc, char ***argv);
+static int pax_digest_cb(int *argc, char ***argv);
+static int pax_apply_rules_cb(int *argc, char ***argv);
+
+/* The action being run, for the error messages. */
+static const char *pax_action;
 
 static int dummy_cb(int *argc __unused, char ***argv __unused) __unused;
 
 static const struct hbsdcontrol_action_entry hbsdcontrol_pax_actions[] = {
-	{"enable",	3,	pax_enable_cb},
-	{"disable",	3,	pax_disable_cb},
-//	{"status",	3,	dummy_cb},
-	{"reset",	3,	pax_reset_cb},
-	{"sysdef",	3,	pax_reset_cb},
-//	{"reset-all",	2,	dummy_cb},
-	{"list",	2,	pax_list_cb},
-	{NULL,		0,	NULL}
+	{"enable",	3,	pax_enable_cb,	"[-Rx] feature file ..."},
+	{"disable",	3,	pax_disable_cb,	"[-Rx] feature file ..."},
+	{"status",	3,	pax_status_cb,	"[-q] feature file"},
+	{"reset",	3,	pax_reset_cb,	"[-Rx] feature file ..."},
+	{"sysdef",	3,	pax_reset_cb,	"[-Rx] feature file ..."},
+	{"reset-all",	2,	pax_reset_all_cb, "[-Rx] file ..."},
+	{"migrate",	2,	pax_migrate_cb,	"[-Rux] file ..."},
+	{"list",	2,	pax_list_cb,	"[-Rx] file ..."},
+	{"stats",	2,	pax_stats_cb,	"[-Rdx] file ..."},
+	{"apply-profile", 3,	pax_apply_profile_cb, "[-Rx] [-p profiles] profile file ..."},
+	{"clone",	3,	pax_clone_cb,	"[-Rx] source file ..."},
+	{"digest",	2,	pax_digest_cb,	"[-Rx] [-c cache] file ..."},
+	{"apply-rules",	3,	pax_apply_rules_cb, "[-Rx] [-c cache] [-p profiles] rules file ..."},
+	{NULL,		0,	NULL,		NULL}
 };
 
 static int
@@ -66,59 +93,833 @@ dummy_cb(int *argc __unused, char ***argv __unused)
 	errx(-1, "dummy_cb");
 }
 
+struct pax_digest_arg {
+	struct hbsdcontrol_digest_cache	*cache;
+	struct hbsdcontrol_rules	*rules;
+};
+
+struct pax_set_arg {
+	const char		*feature;
+	pax_feature_state_t	 state;
+};
+
+/* The action specific flags, parsed by pax_flags(). */
+struct pax_opts {
+	bool		 perdir;	/* -d */
+	bool		 remove;	/* -u */
+	const char	*cache;		/* -c cache */
+	const char	*profiles;	/* -p profiles */
+};
+
+/*
+ * Parse the action's flags, which precede the action's arguments: -R
+ * and -x for every action, and the flags listed in extra for the
+ * actions taking them.  Returns the flags of the bulk run.
+ */
+static int
+pax_flags(int *argc, char ***argv, const char *extra, struct pax_opts *opts)
+{
+	const char *arg;
+	int flags;
+
+	flags = hbsdcontrol_bulk_defaults.flags;
+	if (opts != NULL) {
+		memset(opts, 0, sizeof(*opts));
+		opts->cache = HBSDCONTROL_DIGEST_CACHE_PATH;
+	}
+
+	for (; *argc > 1; (*argc)--, (*argv)++) {
+		arg = (*argv)[1];
+		if (arg[0] != '-' || arg[1] == '\0' || arg[2] != '\0')
+			break;
+
+		if (arg[1] == 'R') {
+			flags |= HBSDCONTROL_BULK_RECURSIVE;
+			continue;
+		} else if (arg[1] == 'x') {
+			flags |= HBSDCONTROL_BULK_XDEV;
+			continue;
+		}
+
+		if (opts == NULL || strchr(extra, arg[1]) == NULL)
+			break;
+
+		switch (arg[1]) {
+		case 'd':
+			opts->perdir = true;
+			continue;
+		case 'u':
+			opts->remove = true;
+			continue;
+		case 'c':
+		case 'p':
+			if (*argc < 3)
+				break;
+			if (arg[1] == 'c')
+				opts->cache = (*argv)[2];
+			else
+				opts->profiles = (*argv)[2];
+			(*argc)--;
+			(*argv)++;
+			continue;
+		}
+		break;
+	}
+
+	return (flags);
+}
+
+/*
+ * The file list consumes the rest of the arguments, leave argv on
+ * the last one, as the main loop skips the last consumed argument.
+ */
+static void
+pax_consume_files(int *argc, char ***argv)
+{
+
+	*argv += *argc - 1;
+	*argc = 1;
+}
+
+static void
+pax_entry_warn(const struct hbsdcontrol_bulk_entry *entry)
+{
+
+	if (entry->error == ENOENT)
+		fprintf(stderr, "missing file: %s\n", entry->path);
+	else if (entry->error)
+		warnc(entry->error, "%s", entry->path);
+}
+
+static int
+pax_set_fn(struct hbsdcontrol_bulk_entry *entries, size_t nentries, void *arg)
+{
+	struct pax_set_arg *pa;
+	int error;
+
+	pa = arg;
+
+	error = hbsdcontrol_bulk_set_feature_state(hbsdcontrol_journal,
+	    entries, nentries, pa->feature, pa->state);
+
+	for (size_t entry = 0; entry < nentries; entry++)
+		pax_entry_warn(&entries[entry]);
+
+	return (error);
+}
+
+static int
+pax_set(int *argc, char ***argv, const char *feature, pax_feature_state_t state, int flags)
+{
+	struct hbsdcontrol_bulk_args args;
+	struct pax_set_arg pa;
+	char **files;
+	int error;
+
+	if (hbsdcontrol_feature_index(feature) < 0)
+		errx(-1, "unknown feature: %s", feature);
+
+	files = &(*argv)[1];
+	pax_consume_files(argc, argv);
+
+	pa.feature = feature;
+	pa.state = state;
+
+	args = hbsdcontrol_bulk_defaults;
+	args.flags = flags;
+	args.fn = pax_set_fn;
+	args.arg = &pa;
+
+	error = hbsdcontrol_bulk_run(&args, files);
+	if (error != 0)
+		errc(1, error, "pax %s", pax_action);
+
+	return (0);
+}
+
 static int
 enable_disable(int *argc, char ***argv, int state)
 {
 	char *feature;
-	char *file;
-	struct stat st;
+	int flags;
+
+	flags = pax_flags(argc, argv, "", NULL);
 
 	if (*argc < 3)
 		pax_usage(true);
 
+	feature = (*argv)[1];
+
+	(*argc)--;
+	(*argv)++;
+
+	return (pax_set(argc, argv, feature, state, flags));
+}
+
+/*
+ * Query a single feature, for the scripts: the state is the exit
+ * status, and it is printed unless -q is given.
+ */
+static int
+pax_status(int *argc, char ***argv)
+{
+	pax_feature_state_t state;
+	const char *feature;
+	const char *file;
+	bool quiet;
+	int error;
+
+	quiet = false;
+	if (*argc > 1 && !strcmp((*argv)[1], "-q")) {
+		quiet = true;
+		(*argc)--;
+		(*argv)++;
+	}
+
+	if (*argc < 3)
+		pax_usage(true);
 
 	feature = (*argv)[1];
 	file = (*argv)[2];
 
-	*argc -= 2;
-	*argv += 2;
+	if (hbsdcontrol_feature_index(feature) < 0)
+		errx(PAX_STATUS_ERROR, "unknown feature: %s", feature);
 
-	if (lstat(file, &st)) {
-		fprintf(stderr, "missing file: %s\n", file);
-		return (1);
+	error = hbsdcontrol_get_feature_state(file, feature, &state);
+	if (error == ENOENT)
+		errx(PAX_STATUS_ERROR, "missing file: %s", file);
+	else if (error)
+		errc(PAX_STATUS_ERROR, error, "%s", file);
+
+	if (!quiet)
+		printf("%s:\t%s\n", feature, hbsdcontrol_state_to_string(state));
+
+	switch (state) {
+	case enable:
+		exit(PAX_STATUS_ENABLED);
+	case disable:
+		exit(PAX_STATUS_DISABLED);
+	case sysdef:
+		exit(PAX_STATUS_SYSDEF);
+	case conflict:
+		exit(PAX_STATUS_CONFLICT);
 	}
 
-	hbsdcontrol_set_feature_state(file, feature, state);
+	exit(PAX_STATUS_ERROR);
+}
+
+static int
+pax_reset_all_fn(struct hbsdcontrol_bulk_entry *entries, size_t nentries, void *arg __unused)
+{
+	int error;
+
+	error = hbsdcontrol_bulk_reset_all(hbsdcontrol_journal, entries, nentries);
+
+	for (size_t entry = 0; entry < nentries; entry++)
+		pax_entry_warn(&entries[entry]);
+
+	return (error);
+}
+
+static int
+pax_reset_all(int *argc, char ***argv)
+{
+	struct hbsdcontrol_bulk_args args;
+	char **files;
+	int flags;
+	int error;
+
+	flags = pax_flags(argc, argv, "", NULL);
+
+	if (*argc < 2)
+		pax_usage(true);
+
+	files = &(*argv)[1];
+	pax_consume_files(argc, argv);
+
+	args = hbsdcontrol_bulk_defaults;
+	args.flags = flags;
+	args.fn = pax_reset_all_fn;
+
+	error = hbsdcontrol_bulk_run(&args, files);
+	if (error != 0)
+		errc(1, error, "pax %s", pax_action);
 
 	return (0);
 }
 
 static int
-pax_list(int *argc, char ***argv)
+pax_migrate_fn(struct hbsdcontrol_bulk_entry *entries, size_t nentries, void *arg)
+{
+	int error;
+
+	error = hbsdcontrol_bulk_migrate_flags(entries, nentries, *(bool *)arg);
+
+	for (size_t entry = 0; entry < nentries; entry++)
+		pax_entry_warn(&entries[entry]);
+
+	return (error);
+}
+
+static int
+pax_migrate(int *argc, char ***argv)
+{
+	struct hbsdcontrol_bulk_args args;
+	struct pax_opts opts;
+	char **files;
+	int flags;
+	int error;
+
+	flags = pax_flags(argc, argv, "u", &opts);
+
+	if (*argc < 2)
+		pax_usage(true);
+
+	files = &(*argv)[1];
+	pax_consume_files(argc, argv);
+
+	args = hbsdcontrol_bulk_defaults;
+	args.flags = flags;
+	args.fn = pax_migrate_fn;
+	args.arg = &opts.remove;
+
+	error = hbsdcontrol_bulk_run(&args, files);
+	if (error != 0)
+		errc(1, error, "pax %s", pax_action);
+
+	return (0);
+}
+
+static int
+pax_list_fn(struct hbsdcontrol_bulk_entry *entries, size_t nentries, void *arg __unused)
 {
-	char *file;
 	char *features;
-	struct stat st;
+	int error;
+
+	error = 0;
+
+	for (size_t entry = 0; entry < nentries; entry++) {
+		if (entries[entry].error) {
+			error = entries[entry].error;
+			continue;
+		}
+
+		features = NULL;
+		if (hbsdcontrol_list_features(entries[entry].path, &features) != 0) {
+			entries[entry].error = EIO;
+			error = EIO;
+			continue;
+		}
+		entries[entry].data = features;
+	}
+
+	return (error);
+}
+
+static void
+pax_list_emit(struct hbsdcontrol_bulk_entry *entries, size_t nentries, void *arg)
+{
+	bool *headers;
+
+	headers = arg;
+
+	for (size_t entry = 0; entry < nentries; entry++) {
+		if (entries[entry].error == EIO)
+			warnx("%s: unable to list the features", entries[entry].path);
+		else if (entries[entry].error)
+			pax_entry_warn(&entries[entry]);
+		if (entries[entry].data == NULL)
+			continue;
+
+		if (*headers)
+			printf("%s:\n", entries[entry].path);
+		printf("%s", (char *)entries[entry].data);
+
+		hbsdcontrol_free_features((char **)&entries[entry].data);
+	}
+}
+
+static int
+pax_list(int *argc, char ***argv)
+{
+	struct hbsdcontrol_bulk_args args;
+	char **files;
+	bool headers;
+	int flags;
+	int error;
+
+	flags = pax_flags(argc, argv, "", NULL);
+
+	if (*argc < 2)
+		pax_usage(true);
+
+	files = &(*argv)[1];
+	pax_consume_files(argc, argv);
+
+	/* A single file is listed without the file name, as before. */
+	headers = (flags & HBSDCONTROL_BULK_RECURSIVE) || files[1] != NULL;
+
+	args = hbsdcontrol_bulk_defaults;
+	args.flags = flags;
+	args.fn = pax_list_fn;
+	args.emit = pax_list_emit;
+	args.arg = &headers;
+
+	error = hbsdcontrol_bulk_run(&args, files);
+	if (error != 0)
+		errc(1, error, "pax %s", pax_action);
+
+	return (0);
+}
+
+static int
+pax_stats_fn(struct hbsdcontrol_bulk_entry *entries, size_t nentries, void *arg)
+{
+	struct hbsdcontrol_state_column *col;
+	pax_state_word_t *words;
+	int error;
+
+	col = arg;
+	error = 0;
+
+	words = calloc(nentries, sizeof(*words));
+	if (words == NULL)
+		return (ENOMEM);
+
+	for (size_t entry = 0; entry < nentries; entry++) {
+		if (entries[entry].error == 0)
+			entries[entry].error = hbsdcontrol_get_state_word(entries[entry].path,
+			    &words[entry]);
+
+		if (entries[entry].error) {
+			pax_entry_warn(&entries[entry]);
+			error = entries[entry].error;
+		}
+	}
+
+	if (hbsdcontrol_state_column_add(col, entries, words, nentries) != 0)
+		error = ENOMEM;
+
+	free(words);
+
+	return (error);
+}
+
+static void
+pax_stats_print(const struct hbsdcontrol_state_histogram *hist)
+{
+
+	printf("%-20s %10s %10s %10s %10s\n", "feature", "enabled", "disabled",
+	    "conflict", "sysdef");
+	for (int feature = 0; feature < HBSDCONTROL_NFEATURES; feature++)
+		printf("%-20s %10ju %10ju %10ju %10ju\n", pax_features[feature].feature,
+		    (uintmax_t)hist->counts[feature][HBSDCONTROL_STATE_INDEX(enable)],
+		    (uintmax_t)hist->counts[feature][HBSDCONTROL_STATE_INDEX(disable)],
+		    (uintmax_t)hist->counts[feature][HBSDCONTROL_STATE_INDEX(conflict)],
+		    (uintmax_t)hist->counts[feature][HBSDCONTROL_STATE_INDEX(sysdef)]);
+}
+
+static const char * const *pax_stats_dirs;
+
+static int
+pax_stats_dir_cmp(const void *a, const void *b)
+{
+
+	return (strcmp(pax_stats_dirs[*(const size_t *)a],
+	    pax_stats_dirs[*(const size_t *)b]));
+}
+
+static int
+pax_stats(int *argc, char ***argv)
+{
+	struct hbsdcontrol_bulk_args args;
+	struct hbsdcontrol_state_column *col;
+	struct hbsdcontrol_state_histogram hist;
+	struct hbsdcontrol_state_histogram *hists;
+	size_t *order;
+	size_t ndirs;
+	struct pax_opts opts;
+	char **files;
+	int flags;
+	int error;
+
+	flags = pax_flags(argc, argv, "d", &opts);
 
 	if (*argc < 2)
-		err(-1, "bar");
+		pax_usage(true);
+
+	files = &(*argv)[1];
+	pax_consume_files(argc, argv);
 
+	if (hbsdcontrol_state_column_new(&col) != 0)
+		err(1, "hbsdcontrol_state_column_new");
 
-	file = (*argv)[1];
+	args = hbsdcontrol_bulk_defaults;
+	args.flags = flags;
+	args.fn = pax_stats_fn;
+	args.arg = col;
 
-	features = NULL;
+	error = hbsdcontrol_bulk_run(&args, files);
+
+	if (opts.perdir) {
+		if (hbsdcontrol_state_column_dir_histograms(col, &hists,
+		    &pax_stats_dirs, &ndirs) != 0)
+			err(1, "hbsdcontrol_state_column_dir_histograms");
+
+		order = calloc(MAX(ndirs, 1), sizeof(*order));
+		if (order == NULL)
+			err(1, "calloc");
+		for (size_t dir = 0; dir < ndirs; dir++)
+			order[dir] = dir;
+		qsort(order, ndirs, sizeof(*order), pax_stats_dir_cmp);
+
+		for (size_t dir = 0; dir < ndirs; dir++) {
+			printf("%s:\n", pax_stats_dirs[order[dir]]);
+			pax_stats_print(&hists[order[dir]]);
+			printf("\n");
+		}
+
+		free(order);
+		free(hists);
+	}
+
+	hbsdcontrol_state_column_histogram(col, &hist);
+	pax_stats_print(&hist);
+
+	hbsdcontrol_state_column_free(&col);
+
+	if (error != 0)
+		errc(1, error, "pax %s", pax_action);
+
+	return (0);
+}
+
+static int
+pax_apply_profile_fn(struct hbsdcontrol_bulk_entry *entries, size_t nentries, void *arg)
+{
+	int error;
+
+	error = hbsdcontrol_bulk_apply_profile(hbsdcontrol_journal,
+	    entries, nentries, arg);
+
+	for (size_t entry = 0; entry < nentries; entry++)
+		pax_entry_warn(&entries[entry]);
+
+	return (error);
+}
+
+static int
+pax_apply_profile(int *argc, char ***argv)
+{
+	struct hbsdcontrol_bulk_args args;
+	struct hbsdcontrol_profile profile;
+	struct pax_opts opts;
+	char **files;
+	int flags;
+	int error;
+
+	flags = pax_flags(argc, argv, "p", &opts);
+
+	if (*argc < 3)
+		pax_usage(true);
+
+	if (opts.profiles != NULL && access(opts.profiles, R_OK) == -1)
+		err(-1, "%s", opts.profiles);
+
+	error = hbsdcontrol_profile_lookup(opts.profiles, (*argv)[1], &profile);
+	if (error == ENOENT)
+		errx(-1, "unknown profile: %s", (*argv)[1]);
+	else if (error)
+		errc(-1, error, "profile %s", (*argv)[1]);
 
 	(*argc)--;
-	(*argv)--;
+	(*argv)++;
 
-	if (lstat(file, &st)) {
-		fprintf(stderr, "missing file: %s\n", file);
-		return (1);
+	files = &(*argv)[1];
+	pax_consume_files(argc, argv);
+
+	args = hbsdcontrol_bulk_defaults;
+	args.flags = flags;
+	args.fn = pax_apply_profile_fn;
+	args.arg = &profile;
+
+	error = hbsdcontrol_bulk_run(&args, files);
+	if (error != 0)
+		errc(1, error, "pax %s", pax_action);
+
+	return (0);
+}
+
+static int
+pax_clone(int *argc, char ***argv)
+{
+	struct hbsdcontrol_bulk_args args;
+	struct hbsdcontrol_profile profile;
+	char **files;
+	int flags;
+	int error;
+
+	flags = pax_flags(argc, argv, "", NULL);
+
+	if (*argc < 3)
+		pax_usage(true);
+
+	error = hbsdcontrol_profile_from_file((*argv)[1], &profile);
+	if (error == EFTYPE)
+		errx(-1, "%s: invalid attribute value", (*argv)[1]);
+	else if (error)
+		errc(-1, error, "%s", (*argv)[1]);
+
+	(*argc)--;
+	(*argv)++;
+
+	files = &(*argv)[1];
+	pax_consume_files(argc, argv);
+
+	args = hbsdcontrol_bulk_defaults;
+	args.flags = flags;
+	args.fn = pax_apply_profile_fn;
+	args.arg = &profile;
+
+	error = hbsdcontrol_bulk_run(&args, files);
+	if (error != 0)
+		errc(1, error, "pax %s", pax_action);
+
+	return (0);
+}
+
+static int
+pax_digest_fn(struct hbsdcontrol_bulk_entry *entries, size_t nentries, void *arg)
+{
+	struct pax_digest_arg *da;
+	uint8_t digest[HBSDCONTROL_DIGEST_LEN];
+	char *hex;
+	int error;
+
+	da = arg;
+	error = 0;
+
+	for (size_t entry = 0; entry < nentries; entry++) {
+		if (entries[entry].error == 0)
+			entries[entry].error = hbsdcontrol_digest_file(da->cache,
+			    entries[entry].path, &entries[entry].st, digest);
+		if (entries[entry].error == 0) {
+			hex = hbsdcontrol_bulk_alloc(&entries[entry],
+			    HBSDCONTROL_DIGEST_LEN * 2 + 1);
+			if (hex == NULL)
+				entries[entry].error = ENOMEM;
+			else
+				hbsdcontrol_digest_format(digest, hex);
+			entries[entry].data = hex;
+		}
+		if (entries[entry].error)
+			error = entries[entry].error;
+	}
+
+	return (error);
+}
+
+static void
+pax_digest_emit(struct hbsdcontrol_bulk_entry *entries, size_t nentries, void *arg __unused)
+{
+
+	for (size_t entry = 0; entry < nentries; entry++) {
+		pax_entry_warn(&entries[entry]);
+		if (entries[entry].data == NULL)
+			continue;
+
+		printf("%s %s\n", (char *)entries[entry].data, entries[entry].path);
 	}
+}
+
+static int
+pax_digest(int *argc, char ***argv)
+{
+	struct hbsdcontrol_bulk_args args;
+	struct pax_digest_arg da;
+	struct pax_opts opts;
+	char **files;
+	int flags;
+	int error;
+
+	flags = pax_flags(argc, argv, "c", &opts);
+
+	if (*argc < 2)
+		pax_usage(true);
+
+	files = &(*argv)[1];
+	pax_consume_files(argc, argv);
+
+	memset(&da, 0, sizeof(da));
+	error = hbsdcontrol_digest_cache_open(opts.cache, &da.cache);
+	if (error)
+		errc(-1, error, "%s", opts.cache);
+
+	args = hbsdcontrol_bulk_defaults;
+	args.flags = flags;
+	args.fn = pax_digest_fn;
+	args.emit = pax_digest_emit;
+	args.arg = &da;
 
-	hbsdcontrol_list_features(file, &features);
-	printf("%s", features);
-	hbsdcontrol_free_features(&features);
+	error = hbsdcontrol_bulk_run(&args, files);
+
+	if (hbsdcontrol_digest_cache_close(&da.cache) != 0)
+		warn("%s", opts.cache);
+
+	if (error != 0)
+		errc(1, error, "pax %s", pax_action);
+
+	return (0);
+}
+
+/*
+ * Hash the files, and apply the profile of the matching rules, with
+ * one hbsdcontrol_bulk_write_state() call for the files of the batch
+ * sharing a profile.  The profile is written through the descriptor
+ * which was hashed, so the file cannot be replaced in between.
+ */
+static int
+pax_apply_rules_fn(struct hbsdcontrol_bulk_entry *entries, size_t nentries, void *arg)
+{
+	const struct hbsdcontrol_profile **matched;
+	const struct hbsdcontrol_profile *profile;
+	struct hbsdcontrol_bulk_entry *group;
+	struct pax_digest_arg *da;
+	uint8_t digest[HBSDCONTROL_DIGEST_LEN];
+	size_t *index;
+	size_t ngroup;
+	int *groupfds;
+	int *fds;
+	int error;
+
+	da = arg;
+	error = 0;
+
+	matched = calloc(nentries, sizeof(*matched));
+	group = calloc(nentries, sizeof(*group));
+	index = calloc(nentries, sizeof(*index));
+	fds = calloc(nentries, sizeof(*fds));
+	groupfds = calloc(nentries, sizeof(*groupfds));
+	if (matched == NULL || group == NULL || index == NULL || fds == NULL ||
+	    groupfds == NULL) {
+		free(matched);
+		free(group);
+		free(index);
+		free(fds);
+		free(groupfds);
+		return (ENOMEM);
+	}
+
+	for (size_t entry = 0; entry < nentries; entry++) {
+		fds[entry] = -1;
+		/* Only the symlinks named on the command line are followed. */
+		if (entries[entry].error || (!S_ISREG(entries[entry].st.st_mode) &&
+		    !S_ISLNK(entries[entry].st.st_mode)))
+			continue;
+
+		fds[entry] = open(entries[entry].path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		if (fds[entry] == -1)
+			entries[entry].error = errno;
+		else
+			entries[entry].error = hbsdcontrol_digest_fd(da->cache,
+			    fds[entry], digest);
+		if (entries[entry].error == EFTYPE)
+			entries[entry].error = 0;
+		else if (entries[entry].error == 0)
+			matched[entry] = hbsdcontrol_rules_match(da->rules, digest);
+	}
+
+	for (size_t first = 0; first < nentries; first++) {
+		if (matched[first] == NULL)
+			continue;
+
+		profile = matched[first];
+		ngroup = 0;
+		for (size_t entry = first; entry < nentries; entry++) {
+			if (matched[entry] != profile)
+				continue;
+			group[ngroup] = entries[entry];
+			groupfds[ngroup] = fds[entry];
+			index[ngroup++] = entry;
+			matched[entry] = NULL;
+		}
+
+		error = hbsdcontrol_bulk_write_state(hbsdcontrol_journal, group,
+		    groupfds, ngroup, profile->mask, profile->word);
+
+		for (size_t entry = 0; entry < ngroup; entry++) {
+			if (group[entry].error == 0)
+				group[entry].error = error;
+			entries[index[entry]].error = group[entry].error;
+		}
+	}
+
+	for (size_t entry = 0; entry < nentries; entry++) {
+		if (fds[entry] != -1)
+			close(fds[entry]);
+		if (entries[entry].error) {
+			pax_entry_warn(&entries[entry]);
+			error = entries[entry].error;
+		}
+	}
+
+	free(matched);
+	free(group);
+	free(index);
+	free(fds);
+	free(groupfds);
+
+	return (error);
+}
+
+static int
+pax_apply_rules(int *argc, char ***argv)
+{
+	struct hbsdcontrol_bulk_args args;
+	struct pax_digest_arg da;
+	struct pax_opts opts;
+	char **files;
+	int flags;
+	int error;
+
+	flags = pax_flags(argc, argv, "cp", &opts);
+
+	if (*argc < 3)
+		pax_usage(true);
+
+	if (opts.profiles != NULL && access(opts.profiles, R_OK) == -1)
+		err(-1, "%s", opts.profiles);
+
+	memset(&da, 0, sizeof(da));
+	error = hbsdcontrol_rules_load((*argv)[1], opts.profiles, &da.rules);
+	if (error == EFTYPE)
+		errx(-1, "%s: invalid rule", (*argv)[1]);
+	else if (error)
+		errc(-1, error, "%s", (*argv)[1]);
+
+	(*argc)--;
+	(*argv)++;
+
+	files = &(*argv)[1];
+	pax_consume_files(argc, argv);
+
+	error = hbsdcontrol_digest_cache_open(opts.cache, &da.cache);
+	if (error)
+		errc(-1, error, "%s", opts.cache);
+
+	args = hbsdcontrol_bulk_defaults;
+	args.flags = flags;
+	args.fn = pax_apply_rules_fn;
+	args.arg = &da;
+
+	error = hbsdcontrol_bulk_run(&args, files);
+
+	if (hbsdcontrol_digest_cache_close(&da.cache) != 0)
+		warn("%s", opts.cache);
+	hbsdcontrol_rules_free(&da.rules);
+
+	if (error != 0)
+		errc(1, error, "pax %s", pax_action);
 
 	return (0);
 }
@@ -141,18 +942,26 @@ static int
 pax_rm_fsea(int *argc, char ***argv)
 {
 	char *feature;
-	char *file;
+	int flags;
+
+	flags = pax_flags(argc, argv, "", NULL);
 
 	if (*argc < 3)
 		pax_usage(true);
 
 	feature = (*argv)[1];
-	file = (*argv)[2];
 
-	(*argc) -= 2;
-	*argv += 2;
+	(*argc)--;
+	(*argv)++;
 
-	return (hbsdcontrol_rm_feature_state(file, feature));
+	return (pax_set(argc, argv, feature, sysdef, flags));
+}
+
+static int
+pax_status_cb(int *argc, char ***argv)
+{
+
+	return (pax_status(argc, argv));
 }
 
 static int
@@ -162,6 +971,20 @@ pax_reset_cb(int *argc, char ***argv)
 	return (pax_rm_fsea(argc, argv));
 }
 
+static int
+pax_reset_all_cb(int *argc, char ***argv)
+{
+
+	return (pax_reset_all(argc, argv));
+}
+
+static int
+pax_migrate_cb(int *argc, char ***argv)
+{
+
+	return (pax_migrate(argc, argv));
+}
+
 static int
 pax_list_cb(int *argc, char ***argv)
 {
@@ -169,6 +992,41 @@ pax_list_cb(int *argc, char ***argv)
 	return (pax_list(argc, argv));
 }
 
+static int
+pax_stats_cb(int *argc, char ***argv)
+{
+
+	return (pax_stats(argc, argv));
+}
+
+static int
+pax_apply_profile_cb(int *argc, char ***argv)
+{
+
+	return (pax_apply_profile(argc, argv));
+}
+
+static int
+pax_clone_cb(int *argc, char ***argv)
+{
+
+	return (pax_clone(argc, argv));
+}
+
+static int
+pax_digest_cb(int *argc, char ***argv)
+{
+
+	return (pax_digest(argc, argv));
+}
+
+static int
+pax_apply_rules_cb(int *argc, char ***argv)
+{
+
+	return (pax_apply_rules(argc, argv));
+}
+
 
 void
 pax_usage(bool terminate)
@@ -176,14 +1034,10 @@ pax_usage(bool terminate)
 	int i;
 
 	fprintf(stderr, "usage:\n");
-	for (i = 0; hbsdcontrol_pax_actions[i].action != NULL; i++) {
-		if (hbsdcontrol_pax_actions[i].min_argc == 2)
-			fprintf(stderr, "\thbsdcontrol pax %s file\n",
-			    hbsdcontrol_pax_actions[i].action);
-		else
-			fprintf(stderr, "\thbsdcontrol pax %s feature file\n",
-			    hbsdcontrol_pax_actions[i].action);
-	}
+	for (i = 0; hbsdcontrol_pax_actions[i].action != NULL; i++)
+		fprintf(stderr, "\thbsdcontrol pax %s %s\n",
+		    hbsdcontrol_pax_actions[i].action,
+		    hbsdcontrol_pax_actions[i].args);
 
 	if (terminate)
 		exit(-1);
@@ -202,6 +1056,8 @@ pax_cmd(int *argc, char ***argv)
 			if (*argc < hbsdcontrol_pax_actions[i].min_argc)
 				pax_usage(true);
 
+			pax_action = hbsdcontrol_pax_actions[i].action;
+
 			return (hbsdcontrol_pax_actions[i].fn(argc, argv));
 		}
 	}
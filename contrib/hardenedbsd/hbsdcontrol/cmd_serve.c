@@ -0,0 +1,549 @@
+/*-
+ * Copyright (c) 2015-2018 Oliver Pinter <oliver.pinter@HardenedBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/ucred.h>
+#include <sys/un.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <poll.h>
+#include <signal.h>
+
+#include "cmd_serve.h"
+#include "hbsdcontrol.h"
+#include "libhbsdcontrol.h"
+
+#define	SERVE_MAXCONN		64
+#define	SERVE_OUTBUF_HIWAT	(64 * 1024)
+#define	SERVE_INBUF_SIZE	(sizeof(struct hbsdcontrol_msg_hdr) + HBSDCONTROL_MSG_MAX)
+
+struct serve_conn {
+	int	 fd;
+	uid_t	 uid;
+	size_t	 inlen;
+	char	 in[SERVE_INBUF_SIZE];
+	char	*out;
+	size_t	 outoff;
+	size_t	 outlen;
+	size_t	 outcap;
+	/* The client shut down its side, it is closed once answered. */
+	bool	 eof;
+};
+
+static const char *serve_path = HBSDCONTROL_SOCKET_PATH;
+static gid_t serve_gid = (gid_t)-1;
+static volatile sig_atomic_t serve_terminate;
+
+static struct serve_conn *serve_conns[SERVE_MAXCONN];
+
+static void
+serve_sighandler(int sig __unused)
+{
+
+	serve_terminate = 1;
+}
+
+static int
+serve_listen(void)
+{
+	struct sockaddr_un sun;
+	struct stat st;
+	mode_t omask;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, serve_path, sizeof(sun.sun_path)) >= sizeof(sun.sun_path))
+		errx(-1, "socket path too long: %s", serve_path);
+
+	fd = socket(PF_LOCAL, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		err(-1, "socket");
+
+	/* Only replace a stale socket, never a file given by mistake. */
+	if (lstat(serve_path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode))
+			errx(-1, "%s: not a socket", serve_path);
+		if (unlink(serve_path) == -1)
+			err(-1, "unlink: %s", serve_path);
+	} else if (errno != ENOENT)
+		err(-1, "%s", serve_path);
+
+	omask = umask(0177);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(-1, "bind: %s", serve_path);
+	umask(omask);
+
+	if (serve_gid != (gid_t)-1) {
+		if (chown(serve_path, 0, serve_gid) == -1)
+			err(-1, "chown: %s", serve_path);
+		if (chmod(serve_path, 0660) == -1)
+			err(-1, "chmod: %s", serve_path);
+	}
+
+	if (listen(fd, SOMAXCONN) == -1)
+		err(-1, "listen: %s", serve_path);
+
+	return (fd);
+}
+
+/*
+ * Root is always allowed, everybody else only when the peer is a member
+ * of the group specified with -g.  The peer's uid is returned in uid.
+ */
+static bool
+serve_peer_allowed(int fd, uid_t *uid)
+{
+	struct xucred xuc;
+	socklen_t len;
+
+	len = sizeof(xuc);
+	if (getsockopt(fd, SOL_LOCAL, LOCAL_PEERCRED, &xuc, &len) == -1)
+		return (false);
+
+	if (xuc.cr_version != XUCRED_VERSION)
+		return (false);
+
+	*uid = xuc.cr_uid;
+
+	if (xuc.cr_uid == 0)
+		return (true);
+
+	if (serve_gid == (gid_t)-1)
+		return (false);
+
+	for (int group = 0; group < xuc.cr_ngroups; group++) {
+		if (xuc.cr_groups[group] == serve_gid)
+			return (true);
+	}
+
+	return (false);
+}
+
+static void
+serve_accept(int lfd)
+{
+	uid_t uid;
+	int fd;
+	int slot;
+
+	fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd == -1)
+		return;
+
+	if (!serve_peer_allowed(fd, &uid)) {
+		close(fd);
+		return;
+	}
+
+	for (slot = 0; slot < SERVE_MAXCONN; slot++) {
+		if (serve_conns[slot] == NULL)
+			break;
+	}
+
+	if (slot == SERVE_MAXCONN) {
+		close(fd);
+		return;
+	}
+
+	serve_conns[slot] = calloc(1, sizeof(struct serve_conn));
+	if (serve_conns[slot] == NULL) {
+		close(fd);
+		return;
+	}
+
+	serve_conns[slot]->fd = fd;
+	serve_conns[slot]->uid = uid;
+}
+
+static void
+serve_close(int slot)
+{
+
+	close(serve_conns[slot]->fd);
+	free(serve_conns[slot]->out);
+	free(serve_conns[slot]);
+	serve_conns[slot] = NULL;
+}
+
+static int
+serve_append(struct serve_conn *conn, const void *data, size_t len)
+{
+	char *out;
+	size_t cap;
+
+	if (conn->outoff == conn->outlen)
+		conn->outoff = conn->outlen = 0;
+
+	if (conn->outlen + len > conn->outcap) {
+		cap = MAX(conn->outcap * 2, conn->outlen + len);
+		out = realloc(conn->out, cap);
+		if (out == NULL)
+			return (ENOMEM);
+		conn->out = out;
+		conn->outcap = cap;
+	}
+
+	memcpy(conn->out + conn->outlen, data, len);
+	conn->outlen += len;
+
+	return (0);
+}
+
+/*
+ * Only absolute paths are accepted, the clients do not share
+ * the working directory with the server.
+ */
+static int
+serve_file_valid(const char *file)
+{
+	struct stat st;
+
+	if (file == NULL || file[0] != '/')
+		return (EINVAL);
+
+	if (lstat(file, &st) == -1)
+		return (errno);
+
+	return (0);
+}
+
+/*
+ * Open a file to be changed, without following a symlink in its last
+ * component.  Only root, and the owner of the file may change it, the
+ * change is then done through the returned fd, so the checked file is
+ * the one which is changed.
+ */
+static int
+serve_file_open(const struct serve_conn *conn, const char *file, int *fdp)
+{
+	struct stat st;
+	int error;
+	int fd;
+
+	if (file == NULL || file[0] != '/')
+		return (EINVAL);
+
+	fd = open(file, O_RDONLY | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+		return (errno);
+
+	if (fstat(fd, &st) == -1)
+		error = errno;
+	else if (conn->uid != 0 && st.st_uid != conn->uid)
+		error = EPERM;
+	else
+		error = 0;
+
+	if (error) {
+		close(fd);
+		return (error);
+	}
+
+	*fdp = fd;
+
+	return (0);
+}
+
+static int
+serve_handle(struct serve_conn *conn, const struct hbsdcontrol_msg_hdr *req, char *payload)
+{
+	struct hbsdcontrol_msg_hdr resp;
+	const char *feature;
+	const char *file;
+	char *result;
+	int error;
+	int fd;
+
+	feature = NULL;
+	file = NULL;
+	result = NULL;
+	error = 0;
+
+	if (req->hm_len > 0) {
+		if (payload[req->hm_len - 1] != '\0') {
+			error = EINVAL;
+			goto reply;
+		}
+
+		file = payload;
+		if (strlen(file) + 1 < req->hm_len)
+			feature = file + strlen(file) + 1;
+
+		/* The file comes first, a feature without one is misread. */
+		if (*file == '\0') {
+			error = EINVAL;
+			goto reply;
+		}
+	}
+
+	switch (req->hm_op) {
+	case HBSDCONTROL_OP_PING:
+		result = strdup(hbsdcontrol_get_version());
+		break;
+	case HBSDCONTROL_OP_LIST:
+		error = serve_file_valid(file);
+		if (error)
+			break;
+		if (hbsdcontrol_list_features(file, &result) != 0)
+			error = EIO;
+		break;
+	case HBSDCONTROL_OP_SET:
+		if (hbsdcontrol_feature_index(feature) < 0 ||
+		    (req->hm_arg != enable && req->hm_arg != disable)) {
+			error = EINVAL;
+			break;
+		}
+		error = serve_file_open(conn, file, &fd);
+		if (error)
+			break;
+		error = hbsdcontrol_set_feature_state_fd(file, fd, feature, req->hm_arg);
+		close(fd);
+		break;
+	case HBSDCONTROL_OP_RESET:
+		if (hbsdcontrol_feature_index(feature) < 0) {
+			error = EINVAL;
+			break;
+		}
+		error = serve_file_open(conn, file, &fd);
+		if (error)
+			break;
+		error = hbsdcontrol_set_feature_state_fd(file, fd, feature, sysdef);
+		close(fd);
+		break;
+	default:
+		error = EOPNOTSUPP;
+		break;
+	}
+
+reply:
+	memset(&resp, 0, sizeof(resp));
+	resp.hm_len = result != NULL ? strlen(result) : 0;
+	resp.hm_seq = req->hm_seq;
+	resp.hm_op = req->hm_op;
+	resp.hm_arg = error;
+
+	error = serve_append(conn, &resp, sizeof(resp));
+	if (error == 0 && resp.hm_len > 0)
+		error = serve_append(conn, result, resp.hm_len);
+
+	free(result);
+
+	return (error);
+}
+
+static int
+serve_flush(struct serve_conn *conn)
+{
+	ssize_t n;
+
+	while (conn->outoff < conn->outlen) {
+		n = write(conn->fd, conn->out + conn->outoff, conn->outlen - conn->outoff);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			return (errno);
+		}
+		conn->outoff += n;
+	}
+
+	return (0);
+}
+
+/*
+ * Process every complete request in the input buffer before flushing,
+ * so a pipelined batch of requests is answered with a single write.
+ */
+static int
+serve_read(struct serve_conn *conn)
+{
+	struct hbsdcontrol_msg_hdr hdr;
+	size_t off;
+	ssize_t n;
+	int error;
+
+	n = read(conn->fd, conn->in + conn->inlen, sizeof(conn->in) - conn->inlen);
+	if (n == -1)
+		return ((errno == EAGAIN || errno == EINTR) ? 0 : errno);
+	/* The responses already queued are still sent. */
+	if (n == 0) {
+		conn->eof = true;
+		return (serve_flush(conn));
+	}
+	conn->inlen += n;
+
+	off = 0;
+	while (conn->inlen - off >= sizeof(hdr)) {
+		memcpy(&hdr, conn->in + off, sizeof(hdr));
+		if (hdr.hm_len > HBSDCONTROL_MSG_MAX)
+			return (EPROTO);
+		if (conn->inlen - off < sizeof(hdr) + hdr.hm_len)
+			break;
+
+		error = serve_handle(conn, &hdr, conn->in + off + sizeof(hdr));
+		if (error)
+			return (error);
+
+		off += sizeof(hdr) + hdr.hm_len;
+	}
+
+	if (off > 0) {
+		memmove(conn->in, conn->in + off, conn->inlen - off);
+		conn->inlen -= off;
+	}
+
+	return (serve_flush(conn));
+}
+
+static void
+serve_loop(int lfd)
+{
+	struct pollfd pfd[SERVE_MAXCONN + 1];
+	int slots[SERVE_MAXCONN + 1];
+	struct serve_conn *conn;
+	int error;
+	int n;
+
+	while (!serve_terminate) {
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		n = 1;
+
+		for (int slot = 0; slot < SERVE_MAXCONN; slot++) {
+			conn = serve_conns[slot];
+			if (conn == NULL)
+				continue;
+
+			pfd[n].fd = conn->fd;
+			pfd[n].events = 0;
+			/* Stop reading requests from clients which do not read the responses. */
+			if (!conn->eof && conn->outlen - conn->outoff < SERVE_OUTBUF_HIWAT)
+				pfd[n].events |= POLLIN;
+			if (conn->outoff < conn->outlen)
+				pfd[n].events |= POLLOUT;
+			slots[n] = slot;
+			n++;
+		}
+
+		if (poll(pfd, n, INFTIM) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(-1, "poll");
+		}
+
+		for (int i = 1; i < n; i++) {
+			conn = serve_conns[slots[i]];
+			error = 0;
+
+			if (!conn->eof && (pfd[i].revents & (POLLIN | POLLHUP)))
+				error = serve_read(conn);
+			else if (pfd[i].revents & (POLLOUT | POLLHUP))
+				error = serve_flush(conn);
+			else if (pfd[i].revents & (POLLERR | POLLNVAL))
+				error = EIO;
+
+			if (error || (conn->eof && conn->outoff == conn->outlen))
+				serve_close(slots[i]);
+		}
+
+		if (pfd[0].revents & POLLIN)
+			serve_accept(lfd);
+	}
+}
+
+void
+serve_usage(bool terminate)
+{
+
+	fprintf(stderr, "\thbsdcontrol serve [-g group] [-s socket]\n");
+
+	if (terminate)
+		exit(-1);
+}
+
+int
+serve_cmd(int *argc, char ***argv)
+{
+	struct sigaction sa;
+	struct group *grp;
+	int lfd;
+	int ch;
+
+	/* The command name takes the place of argv[0]. */
+	optreset = 1;
+	optind = 1;
+	while ((ch = getopt(*argc + 1, *argv - 1, "g:s:")) != -1) {
+		switch (ch) {
+		case 'g':
+			grp = getgrnam(optarg);
+			if (grp == NULL)
+				errx(-1, "unknown group: %s", optarg);
+			serve_gid = grp->gr_gid;
+			break;
+		case 's':
+			serve_path = optarg;
+			break;
+		default:
+			serve_usage(true);
+		}
+	}
+
+	*argc -= optind - 1;
+	*argv += optind - 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = serve_sighandler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	lfd = serve_listen();
+	serve_loop(lfd);
+
+	for (int slot = 0; slot < SERVE_MAXCONN; slot++) {
+		if (serve_conns[slot] != NULL)
+			serve_close(slot);
+	}
+	close(lfd);
+	unlink(serve_path);
+
+	return (0);
+}
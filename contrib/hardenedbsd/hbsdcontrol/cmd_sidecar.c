@@ -0,0 +1,85 @@
+/*-
+ * Copyright (c) 2015-2018 Oliver Pinter <oliver.pinter@HardenedBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <err.h>
+#include <errno.h>
+
+#include "cmd_sidecar.h"
+#include "hbsdcontrol.h"
+#include "libhbsdcontrol.h"
+
+void
+export_usage(bool terminate)
+{
+
+	fprintf(stderr, "\thbsdcontrol export database directory [destination]\n");
+
+	if (terminate)
+		exit(-1);
+}
+
+int
+export_cmd(int *argc, char ***argv)
+{
+	struct hbsdcontrol_sidecar *db;
+	const char *database;
+	const char *src, *dst;
+	int error;
+
+	if (*argc < 2)
+		export_usage(true);
+
+	database = (*argv)[0];
+	src = (*argv)[1];
+	dst = *argc > 2 ? (*argv)[2] : NULL;
+
+	if (hbsdcontrol_get_backend() != &hbsdcontrol_extattr_backend)
+		errx(1, "export writes the extended attributes, it cannot be used with --sidecar");
+
+	error = hbsdcontrol_sidecar_open(database, &db);
+	if (error)
+		errc(1, error, "%s", database);
+
+	error = hbsdcontrol_sidecar_export(db, hbsdcontrol_journal,
+	    &hbsdcontrol_bulk_defaults, src, dst);
+	if (error)
+		warnc(error, "export %s", src);
+
+	hbsdcontrol_sidecar_close(&db);
+
+	if (error)
+		exit(1);
+
+	return (0);
+}
@@ -33,6 +33,10 @@ struct hbsdcontrol_action_entry {
 	const char	*action;
 	const int	 min_argc;
 	int		(*fn)(int *, char ***);
+	const char	*args;
 };
 
+extern struct hbsdcontrol_bulk_args hbsdcontrol_bulk_defaults;
+extern struct hbsdcontrol_journal *hbsdcontrol_journal;
+
 #endif /* __HBSDCONTROL_H */
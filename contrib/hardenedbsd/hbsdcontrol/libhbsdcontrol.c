@@ -32,12 +32,15 @@
 #include <sys/extattr.h>
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <libgen.h>
 #include <libutil.h>
+#include <time.h>
 #include <unistd.h>
 #include <err.h>
 #include <errno.h>
@@ -50,8 +53,77 @@ static int hbsdcontrol_validate_state(struct pax_feature_state *feature_state);
 static const char * hbsdcontrol_get_state_string(const struct pax_feature_state *feature_state);
 static int hbsdcontrol_get_all_feature_state(const char *file, struct pax_feature_state **feature_states);
 static void hbsdcontrol_free_all_feature_state(struct pax_feature_state **feature_states);
+static void hbsdcontrol_ratelimit_enter(struct timespec *start);
+static void hbsdcontrol_ratelimit_exit(const struct timespec *start);
+static int hbsdcontrol_flags_read(const char *file, int fd, pax_state_word_t *word);
+static int hbsdcontrol_flags_write(const char *file, int fd, pax_state_word_t word);
 
 static int hbsdcontrol_debug_flag;
+static enum hbsdcontrol_flags_mode hbsdcontrol_flags_mode = HBSDCONTROL_FLAGS_LEGACY;
+
+static ssize_t hbsdcontrol_extattr_backend_list_file(void *ctx, const char *file, int attrnamespace, void *data, size_t nbytes);
+static ssize_t hbsdcontrol_extattr_backend_get_file(void *ctx, const char *file, int attrnamespace, const char *attr, void *data, size_t nbytes);
+static ssize_t hbsdcontrol_extattr_backend_set_file(void *ctx, const char *file, int attrnamespace, const char *attr, const void *data, size_t nbytes);
+static int hbsdcontrol_extattr_backend_delete_file(void *ctx, const char *file, int attrnamespace, const char *attr);
+static ssize_t hbsdcontrol_extattr_backend_list_fd(void *ctx, int fd, int attrnamespace, void *data, size_t nbytes);
+static ssize_t hbsdcontrol_extattr_backend_get_fd(void *ctx, int fd, int attrnamespace, const char *attr, void *data, size_t nbytes);
+static ssize_t hbsdcontrol_extattr_backend_set_fd(void *ctx, int fd, int attrnamespace, const char *attr, const void *data, size_t nbytes);
+static int hbsdcontrol_extattr_backend_delete_fd(void *ctx, int fd, int attrnamespace, const char *attr);
+
+static ssize_t hbsdcontrol_backend_list_file(const char *file, int attrnamespace, void *data, size_t nbytes);
+static ssize_t hbsdcontrol_backend_get_file(const char *file, int attrnamespace, const char *attr, void *data, size_t nbytes);
+static ssize_t hbsdcontrol_backend_set_file(const char *file, int attrnamespace, const char *attr, const void *data, size_t nbytes);
+static int hbsdcontrol_backend_delete_file(const char *file, int attrnamespace, const char *attr);
+static ssize_t hbsdcontrol_backend_list_fd(int fd, int attrnamespace, void *data, size_t nbytes);
+static ssize_t hbsdcontrol_backend_get_fd(int fd, int attrnamespace, const char *attr, void *data, size_t nbytes);
+static ssize_t hbsdcontrol_backend_set_fd(int fd, int attrnamespace, const char *attr, const void *data, size_t nbytes);
+static int hbsdcontrol_backend_delete_fd(int fd, int attrnamespace, const char *attr);
+
+/*
+ * The attribute storage, every attribute access of the library goes
+ * through it.  The default is extattr(2).
+ */
+const struct hbsdcontrol_backend hbsdcontrol_extattr_backend = {
+	.name = "extattr",
+	.list_file = hbsdcontrol_extattr_backend_list_file,
+	.get_file = hbsdcontrol_extattr_backend_get_file,
+	.set_file = hbsdcontrol_extattr_backend_set_file,
+	.delete_file = hbsdcontrol_extattr_backend_delete_file,
+	.list_fd = hbsdcontrol_extattr_backend_list_fd,
+	.get_fd = hbsdcontrol_extattr_backend_get_fd,
+	.set_fd = hbsdcontrol_extattr_backend_set_fd,
+	.delete_fd = hbsdcontrol_extattr_backend_delete_fd,
+};
+
+static const struct hbsdcontrol_backend *hbsdcontrol_backend = &hbsdcontrol_extattr_backend;
+static void *hbsdcontrol_backend_ctx;
+
+/*
+ * Token bucket, shared by every thread doing extattr syscalls.  In
+ * adaptive mode the rate is halved when the average syscall latency
+ * rises well above the lowest average seen, and is raised again
+ * linearly when the latency recovers.
+ */
+#define	HBSDCONTROL_RATELIMIT_MIN_RATE		10.0
+#define	HBSDCONTROL_RATELIMIT_ADAPTIVE_RATE	10000.0
+#define	HBSDCONTROL_RATELIMIT_WINDOW_NS		100000000LL
+
+static struct {
+	/* Also read without mtx, to skip the lock when disabled. */
+	atomic_bool	 enabled;
+	bool		 adaptive;
+	pthread_mutex_t	 mtx;
+	double		 max_rate;
+	double		 rate;
+	double		 burst;
+	double		 tokens;
+	struct timespec	 last;
+	double		 latency;
+	double		 baseline;
+	struct timespec	 adjusted;
+} hbsdcontrol_ratelimit = {
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+};
 
 const struct pax_feature_entry pax_features[] = {
 	{
@@ -100,6 +172,9 @@ const struct pax_feature_entry pax_features[] = {
 	{NULL, {0, 0}}
 };
 
+_Static_assert(nitems(pax_features) == HBSDCONTROL_NFEATURES + 1,
+    "HBSDCONTROL_NFEATURES does not match pax_features[]");
+
 
 const char *
 hbsdcontrol_get_version(void)
@@ -108,6 +183,237 @@ hbsdcontrol_get_version(void)
 	return hbsdcontrol_version;
 }
 
+int
+hbsdcontrol_feature_index(const char *feature)
+{
+
+	if (feature == NULL)
+		return (-1);
+
+	for (int i = 0; pax_features[i].feature != NULL; i++) {
+		if (!strcmp(pax_features[i].feature, feature))
+			return (i);
+	}
+
+	return (-1);
+}
+
+/*
+ * Switch the attribute storage, a NULL backend restores extattr(2).
+ * Not safe against the concurrent attribute accesses of the library.
+ */
+void
+hbsdcontrol_set_backend(const struct hbsdcontrol_backend *backend, void *ctx)
+{
+
+	if (backend == NULL) {
+		backend = &hbsdcontrol_extattr_backend;
+		ctx = NULL;
+	}
+
+	hbsdcontrol_backend = backend;
+	hbsdcontrol_backend_ctx = ctx;
+}
+
+const struct hbsdcontrol_backend *
+hbsdcontrol_get_backend(void)
+{
+
+	return (hbsdcontrol_backend);
+}
+
+/*
+ * Every backend call is counted, so the harnesses can check the number
+ * of attribute system calls of an operation, see hbsdcontrol(8)
+ * --op-stats.  The counters are only summed, the relaxed atomics cost
+ * nothing next to a system call.
+ */
+static struct {
+	_Atomic uint64_t	list;
+	_Atomic uint64_t	get;
+	_Atomic uint64_t	set;
+	_Atomic uint64_t	delete;
+	_Atomic uint64_t	lookup;
+} hbsdcontrol_op_stats;
+
+#define	HBSDCONTROL_OP_COUNT(counter)	\
+	atomic_fetch_add_explicit(&hbsdcontrol_op_stats.counter, 1, memory_order_relaxed)
+
+void
+hbsdcontrol_get_op_stats(struct hbsdcontrol_op_stats *stats)
+{
+
+	stats->list = atomic_load_explicit(&hbsdcontrol_op_stats.list, memory_order_relaxed);
+	stats->get = atomic_load_explicit(&hbsdcontrol_op_stats.get, memory_order_relaxed);
+	stats->set = atomic_load_explicit(&hbsdcontrol_op_stats.set, memory_order_relaxed);
+	stats->delete = atomic_load_explicit(&hbsdcontrol_op_stats.delete, memory_order_relaxed);
+	stats->lookup = atomic_load_explicit(&hbsdcontrol_op_stats.lookup, memory_order_relaxed);
+}
+
+void
+hbsdcontrol_reset_op_stats(void)
+{
+
+	atomic_store_explicit(&hbsdcontrol_op_stats.list, 0, memory_order_relaxed);
+	atomic_store_explicit(&hbsdcontrol_op_stats.get, 0, memory_order_relaxed);
+	atomic_store_explicit(&hbsdcontrol_op_stats.set, 0, memory_order_relaxed);
+	atomic_store_explicit(&hbsdcontrol_op_stats.delete, 0, memory_order_relaxed);
+	atomic_store_explicit(&hbsdcontrol_op_stats.lookup, 0, memory_order_relaxed);
+}
+
+static ssize_t
+hbsdcontrol_backend_list_file(const char *file, int attrnamespace, void *data, size_t nbytes)
+{
+
+	HBSDCONTROL_OP_COUNT(list);
+	HBSDCONTROL_OP_COUNT(lookup);
+
+	return (hbsdcontrol_backend->list_file(hbsdcontrol_backend_ctx, file,
+	    attrnamespace, data, nbytes));
+}
+
+static ssize_t
+hbsdcontrol_backend_get_file(const char *file, int attrnamespace, const char *attr,
+    void *data, size_t nbytes)
+{
+
+	HBSDCONTROL_OP_COUNT(get);
+	HBSDCONTROL_OP_COUNT(lookup);
+
+	return (hbsdcontrol_backend->get_file(hbsdcontrol_backend_ctx, file,
+	    attrnamespace, attr, data, nbytes));
+}
+
+static ssize_t
+hbsdcontrol_backend_set_file(const char *file, int attrnamespace, const char *attr,
+    const void *data, size_t nbytes)
+{
+
+	HBSDCONTROL_OP_COUNT(set);
+	HBSDCONTROL_OP_COUNT(lookup);
+
+	return (hbsdcontrol_backend->set_file(hbsdcontrol_backend_ctx, file,
+	    attrnamespace, attr, data, nbytes));
+}
+
+static int
+hbsdcontrol_backend_delete_file(const char *file, int attrnamespace, const char *attr)
+{
+
+	HBSDCONTROL_OP_COUNT(delete);
+	HBSDCONTROL_OP_COUNT(lookup);
+
+	return (hbsdcontrol_backend->delete_file(hbsdcontrol_backend_ctx, file,
+	    attrnamespace, attr));
+}
+
+static ssize_t
+hbsdcontrol_backend_list_fd(int fd, int attrnamespace, void *data, size_t nbytes)
+{
+
+	HBSDCONTROL_OP_COUNT(list);
+
+	return (hbsdcontrol_backend->list_fd(hbsdcontrol_backend_ctx, fd,
+	    attrnamespace, data, nbytes));
+}
+
+static ssize_t
+hbsdcontrol_backend_get_fd(int fd, int attrnamespace, const char *attr,
+    void *data, size_t nbytes)
+{
+
+	HBSDCONTROL_OP_COUNT(get);
+
+	return (hbsdcontrol_backend->get_fd(hbsdcontrol_backend_ctx, fd,
+	    attrnamespace, attr, data, nbytes));
+}
+
+static ssize_t
+hbsdcontrol_backend_set_fd(int fd, int attrnamespace, const char *attr,
+    const void *data, size_t nbytes)
+{
+
+	HBSDCONTROL_OP_COUNT(set);
+
+	return (hbsdcontrol_backend->set_fd(hbsdcontrol_backend_ctx, fd,
+	    attrnamespace, attr, data, nbytes));
+}
+
+static int
+hbsdcontrol_backend_delete_fd(int fd, int attrnamespace, const char *attr)
+{
+
+	HBSDCONTROL_OP_COUNT(delete);
+
+	return (hbsdcontrol_backend->delete_fd(hbsdcontrol_backend_ctx, fd,
+	    attrnamespace, attr));
+}
+
+static ssize_t
+hbsdcontrol_extattr_backend_list_file(void *ctx __unused, const char *file,
+    int attrnamespace, void *data, size_t nbytes)
+{
+
+	return (extattr_list_file(file, attrnamespace, data, nbytes));
+}
+
+static ssize_t
+hbsdcontrol_extattr_backend_get_file(void *ctx __unused, const char *file,
+    int attrnamespace, const char *attr, void *data, size_t nbytes)
+{
+
+	return (extattr_get_file(file, attrnamespace, attr, data, nbytes));
+}
+
+static ssize_t
+hbsdcontrol_extattr_backend_set_file(void *ctx __unused, const char *file,
+    int attrnamespace, const char *attr, const void *data, size_t nbytes)
+{
+
+	return (extattr_set_file(file, attrnamespace, attr, data, nbytes));
+}
+
+static int
+hbsdcontrol_extattr_backend_delete_file(void *ctx __unused, const char *file,
+    int attrnamespace, const char *attr)
+{
+
+	return (extattr_delete_file(file, attrnamespace, attr));
+}
+
+static ssize_t
+hbsdcontrol_extattr_backend_list_fd(void *ctx __unused, int fd,
+    int attrnamespace, void *data, size_t nbytes)
+{
+
+	return (extattr_list_fd(fd, attrnamespace, data, nbytes));
+}
+
+static ssize_t
+hbsdcontrol_extattr_backend_get_fd(void *ctx __unused, int fd,
+    int attrnamespace, const char *attr, void *data, size_t nbytes)
+{
+
+	return (extattr_get_fd(fd, attrnamespace, attr, data, nbytes));
+}
+
+static ssize_t
+hbsdcontrol_extattr_backend_set_fd(void *ctx __unused, int fd,
+    int attrnamespace, const char *attr, const void *data, size_t nbytes)
+{
+
+	return (extattr_set_fd(fd, attrnamespace, attr, data, nbytes));
+}
+
+static int
+hbsdcontrol_extattr_backend_delete_fd(void *ctx __unused, int fd,
+    int attrnamespace, const char *attr)
+{
+
+	return (extattr_delete_fd(fd, attrnamespace, attr));
+}
+
+
 int
 hbsdcontrol_extattr_set_attr(const char *file, const char *attr, const int val)
 {
@@ -115,6 +421,7 @@ hbsdcontrol_extattr_set_attr(const char *file, const char *attr, const int val)
 	int	len;
 	int	attrnamespace;
 	struct sbuf *attrval = NULL;
+	struct timespec start;
 
 	error = extattr_string_to_namespace("system", &attrnamespace);
 	if (error)
@@ -124,64 +431,53 @@ hbsdcontrol_extattr_set_attr(const char *file, const char *attr, const int val)
 	sbuf_printf(attrval, "%d", val);
 	sbuf_finish(attrval);
 
-	len = extattr_set_file(file, attrnamespace, attr,
-	    sbuf_data(attrval), sbuf_len(attrval));
+	hbsdcontrol_ratelimit_enter(&start);
+	len = hbsdcontrol_backend_set_file(file,
+	    attrnamespace, attr, sbuf_data(attrval), sbuf_len(attrval));
+	hbsdcontrol_ratelimit_exit(&start);
+	error = len == -1 ? errno : 0;
 	if (len >= 0 && hbsdcontrol_debug_flag)
 		warnx("%s: %s@%s = %s", file, "system", attr, sbuf_data(attrval));
 
 	sbuf_delete(attrval);
 
-	if (len == -1) {
-		perror(__func__);
-		errx(-1, "abort");
-	}
-
-	return (0);
+	return (error);
 }
 
 int
 hbsdcontrol_extattr_get_attr(const char *file, const char *attr, int *val)
 {
-	int	error;
-	int	len;
 	int	attrnamespace;
-	char	*attrval = NULL;
+	char	attrval[16];
+	ssize_t	len;
+	struct timespec start;
 
 	if (val == NULL)
 		err(-1, "%s", "val");
 
-	error = extattr_string_to_namespace("system", &attrnamespace);
-	if (error)
+	if (extattr_string_to_namespace("system", &attrnamespace))
 		err(-1, "%s", "system");
 
-	len = extattr_get_file(file, attrnamespace, attr, NULL, 0);
-	if (len < 0) {
-		perror(__func__);
-		errx(-1, "abort");
-	}
-
-#if 0
-	if (len >= 0 && hbsdcontrol_debug_flag)
-		warnx("%s: %s@%s = %s", file, "system", attr, sbuf_data(attrval));
-#endif
-
-	attrval = calloc(sizeof(char), len);
-	if (attrval == NULL) {
-		perror(__func__);
-		errx(-1, "abort");
-	}
-
-	len = extattr_get_file(file, attrnamespace, attr, attrval, len);
-	if (len == -1) {
-		perror(__func__);
-		errx(-1, "abort");
-	}
+	/*
+	 * ENOATTR is not an error for the callers, the attribute is just
+	 * absent.  Only the first character of the value is used, so it is
+	 * read with a single call into a small buffer.
+	 */
+	hbsdcontrol_ratelimit_enter(&start);
+	len = hbsdcontrol_backend_get_file(file,
+	    attrnamespace, attr, attrval, sizeof(attrval) - 1);
+	hbsdcontrol_ratelimit_exit(&start);
+	if (len < 0)
+		return (errno);
+	/* An empty value has no state to parse. */
+	if (len == 0)
+		return (EFTYPE);
+
+	attrval[len] = '\0';
 
 	// XXXOP: strtol?
 	*val = *attrval - '0';
 
-	free(attrval);
-
 	return (0);
 }
 
@@ -191,6 +487,7 @@ hbsdcontrol_extattr_rm_attr(const char *file, const char *attr)
 {
 	int error;
 	int attrnamespace;
+	struct timespec start;
 
 	error = extattr_string_to_namespace("system", &attrnamespace);
 	if (error)
@@ -199,27 +496,38 @@ hbsdcontrol_extattr_rm_attr(const char *file, const char *attr)
 	if (hbsdcontrol_debug_flag)
 		printf("reset attr: %s on file: %s\n", attr, file);
 
-	error = extattr_delete_file(file, attrnamespace, attr);
+	hbsdcontrol_ratelimit_enter(&start);
+	error = hbsdcontrol_backend_delete_file(file, attrnamespace, attr);
+	hbsdcontrol_ratelimit_exit(&start);
 
 	return (error);
 }
 
 
+/*
+ * The attrs array and the attribute names are a single allocation: the
+ * list is read behind the array, and its length prefixed names are
+ * turned into C strings in place.
+ */
 int
 hbsdcontrol_extattr_list_attrs(const char *file, char ***attrs)
 {
 	char *data;
+	char *name;
 	int error;
 	int attrnamespace;
 	ssize_t nbytes;
 	ssize_t pos;
 	uint8_t len;
 	unsigned int fpos;
+	size_t nattrs;
+	struct timespec start;
 
 	nbytes = 0;
 	data = NULL;
 	pos = 0;
 	fpos = 0;
+	nattrs = nitems(pax_features) * nitems(pax_features[0].extattr);
 
 	if (attrs == NULL)
 		err(-1, "%s", "attrs");
@@ -231,38 +539,46 @@ hbsdcontrol_extattr_list_attrs(const char *file, char ***attrs)
 	if (hbsdcontrol_debug_flag)
 		printf("list attrs on file: %s\n", file);
 
-	nbytes = extattr_list_file(file, attrnamespace, NULL, 0);
+	hbsdcontrol_ratelimit_enter(&start);
+	nbytes = hbsdcontrol_backend_list_file(file, attrnamespace, NULL, 0);
+	hbsdcontrol_ratelimit_exit(&start);
 	if (nbytes < 0) {
 		error = EFAULT;
 		goto out;
 	}
 
-	data = calloc(sizeof(char), nbytes);
-	if (data == NULL) {
-		error = ENOMEM;
-		goto out;
-	}
-
-	*attrs = (char **)calloc(sizeof(char *), nitems(pax_features) * nitems(pax_features[0].extattr));
+	*attrs = calloc(1, nattrs * sizeof(char *) + nbytes);
 	if (*attrs == NULL) {
 		error = ENOMEM;
 		goto out;
 	}
-
-	nbytes = extattr_list_file(file, attrnamespace, data, nbytes);
-	if (nbytes == -1) {
-		error = EFAULT;
-		goto out;
+	data = (char *)(*attrs + nattrs);
+
+	/* Most files have no system attributes, skip the second call. */
+	if (nbytes > 0) {
+		hbsdcontrol_ratelimit_enter(&start);
+		nbytes = hbsdcontrol_backend_list_file(file, attrnamespace, data, nbytes);
+		hbsdcontrol_ratelimit_exit(&start);
+		if (nbytes == -1) {
+			error = EFAULT;
+			goto out;
+		}
 	}
 
 	pos = 0;
 	while (pos < nbytes) {
 		size_t attr_len;
 
-		assert(fpos < nitems(pax_features) * nitems(pax_features[0].extattr));
+		assert(fpos < nattrs);
 
 		/* see EXTATTR(2) about the data structure */
-		len = data[pos++];
+		len = data[pos];
+		if (pos + 1 + len > nbytes)
+			break;
+		name = &data[pos];
+		memmove(name, name + 1, len);
+		name[len] = '\0';
+		pos++;
 
 		for (int feature = 0; pax_features[feature].feature != NULL; feature++) {
 			/* The value 2 comes from enum pax_attr_state's size */
@@ -273,11 +589,11 @@ hbsdcontrol_extattr_list_attrs(const char *file, char ***attrs)
 					continue;
 				}
 
-				if (!memcmp(pax_features[feature].extattr[state], &data[pos], attr_len)) {
+				if (!memcmp(pax_features[feature].extattr[state], name, attr_len)) {
 					if (hbsdcontrol_debug_flag)
 						printf("%s:\tfound attribute: %s\n",
 						    __func__, pax_features[feature].extattr[state]);
-					(*attrs)[fpos] = strdup(pax_features[feature].extattr[state]);
+					(*attrs)[fpos] = name;
 					fpos++;
 				}
 			}
@@ -290,7 +606,6 @@ hbsdcontrol_extattr_list_attrs(const char *file, char ***attrs)
 	(*attrs)[fpos] = NULL;
 
 out:
-	free(data);
 	if (error)
 		hbsdcontrol_free_attrs(attrs);
 
@@ -304,15 +619,236 @@ hbsdcontrol_free_attrs(char ***attrs)
 	if (*attrs == NULL)
 		return;
 
-	for (int attr = 0; (*attrs)[attr] != NULL; attr++) {
-		free((*attrs)[attr]);
-		(*attrs)[attr] = NULL;
-	}
 	free(*attrs);
 	*attrs = NULL;
 }
 
 
+/*
+ * The _fd variants work on an open file, so a caller doing several
+ * operations on a file resolves its path only once.  They return the
+ * errno value, ENOATTR when the attribute is absent.
+ */
+int
+hbsdcontrol_extattr_get_attr_fd(int fd, const char *attr, int *val)
+{
+	char attrval[16];
+	ssize_t len;
+	struct timespec start;
+
+	hbsdcontrol_ratelimit_enter(&start);
+	len = hbsdcontrol_backend_get_fd(fd,
+	    EXTATTR_NAMESPACE_SYSTEM, attr, attrval, sizeof(attrval) - 1);
+	hbsdcontrol_ratelimit_exit(&start);
+	if (len < 0)
+		return (errno);
+	if (len == 0)
+		return (EFTYPE);
+
+	attrval[len] = '\0';
+	*val = *attrval - '0';
+
+	return (0);
+}
+
+
+int
+hbsdcontrol_extattr_set_attr_fd(int fd, const char *attr, int val)
+{
+	char attrval[16];
+	ssize_t len;
+	struct timespec start;
+
+	snprintf(attrval, sizeof(attrval), "%d", val);
+
+	hbsdcontrol_ratelimit_enter(&start);
+	len = hbsdcontrol_backend_set_fd(fd,
+	    EXTATTR_NAMESPACE_SYSTEM, attr, attrval, strlen(attrval));
+	hbsdcontrol_ratelimit_exit(&start);
+	if (len == -1)
+		return (errno);
+
+	if (hbsdcontrol_debug_flag)
+		warnx("fd %d: %s@%s = %s", fd, "system", attr, attrval);
+
+	return (0);
+}
+
+
+int
+hbsdcontrol_extattr_rm_attr_fd(int fd, const char *attr)
+{
+	int error;
+	struct timespec start;
+
+	if (hbsdcontrol_debug_flag)
+		printf("reset attr: %s on fd: %d\n", attr, fd);
+
+	hbsdcontrol_ratelimit_enter(&start);
+	error = hbsdcontrol_backend_delete_fd(fd, EXTATTR_NAMESPACE_SYSTEM, attr);
+	hbsdcontrol_ratelimit_exit(&start);
+
+	return (error == -1 ? errno : 0);
+}
+
+
+/*
+ * Return the mask of the pax attributes present on an open file, with
+ * PAX_ATTR_INVALID in the place of each present attribute, and when
+ * flags is not NULL, whether the flags attribute is present.  The list
+ * is read into a stack buffer first, and only sized and read again
+ * when it fills the buffer.
+ */
+int
+hbsdcontrol_get_attr_mask_fd(int fd, pax_state_word_t *mask, bool *flags)
+{
+	char buf[512];
+	char *data;
+	ssize_t nbytes;
+	ssize_t pos;
+	size_t len;
+	int error;
+	struct timespec start;
+
+	*mask = 0;
+	if (flags != NULL)
+		*flags = false;
+	data = buf;
+
+	hbsdcontrol_ratelimit_enter(&start);
+	nbytes = hbsdcontrol_backend_list_fd(fd,
+	    EXTATTR_NAMESPACE_SYSTEM, buf, sizeof(buf));
+	hbsdcontrol_ratelimit_exit(&start);
+	if (nbytes < 0)
+		return (errno);
+
+	/* A full buffer may be truncated. */
+	if ((size_t)nbytes == sizeof(buf)) {
+		hbsdcontrol_ratelimit_enter(&start);
+		nbytes = hbsdcontrol_backend_list_fd(fd,
+		    EXTATTR_NAMESPACE_SYSTEM, NULL, 0);
+		hbsdcontrol_ratelimit_exit(&start);
+		if (nbytes < 0)
+			return (errno);
+
+		data = malloc(nbytes);
+		if (data == NULL)
+			return (ENOMEM);
+
+		hbsdcontrol_ratelimit_enter(&start);
+		nbytes = hbsdcontrol_backend_list_fd(fd,
+		    EXTATTR_NAMESPACE_SYSTEM, data, nbytes);
+		hbsdcontrol_ratelimit_exit(&start);
+		if (nbytes < 0) {
+			error = errno;
+			goto out;
+		}
+	}
+
+	error = 0;
+	for (pos = 0; pos < nbytes; pos += len) {
+		/* see EXTATTR(2) about the data structure */
+		len = (unsigned char)data[pos++];
+		if (len > (size_t)(nbytes - pos))
+			break;
+
+		if (flags != NULL && strlen(HBSDCONTROL_FLAGS_ATTR) == len &&
+		    !memcmp(HBSDCONTROL_FLAGS_ATTR, &data[pos], len))
+			*flags = true;
+
+		for (int feature = 0; pax_features[feature].feature != NULL; feature++) {
+			for (pax_feature_state_t attr = 0; attr < 2; attr++) {
+				if (strlen(pax_features[feature].extattr[attr]) != len ||
+				    memcmp(pax_features[feature].extattr[attr], &data[pos], len))
+					continue;
+
+				*mask |= (pax_state_word_t)PAX_ATTR_INVALID <<
+				    PAX_STATE_SHIFT(feature, attr);
+			}
+		}
+	}
+
+out:
+	if (data != buf)
+		free(data);
+
+	return (error);
+}
+
+/*
+ * Read the state word of an open file, from the flags attribute in the
+ * sync mode, or from the per-feature attributes.
+ */
+int
+hbsdcontrol_get_state_word_fd(int fd, pax_state_word_t *word)
+{
+	int error;
+
+	if (hbsdcontrol_flags_mode == HBSDCONTROL_FLAGS_SYNC) {
+		error = hbsdcontrol_get_flags_fd(fd, word);
+		if (error != ENOATTR && error != EFTYPE)
+			return (error);
+	}
+
+	return (hbsdcontrol_get_legacy_state_word_fd(fd, word));
+}
+
+/*
+ * Read the state word of an open file, with one list, and one get per
+ * pax attribute present.
+ */
+int
+hbsdcontrol_get_legacy_state_word_fd(int fd, pax_state_word_t *word)
+{
+	pax_state_word_t mask;
+	int error;
+
+	*word = 0;
+
+	error = hbsdcontrol_get_attr_mask_fd(fd, &mask, NULL);
+	if (error)
+		return (error);
+
+	return (hbsdcontrol_get_masked_state_word_fd(fd, mask, word));
+}
+
+/*
+ * Read the per-feature attributes of an open file selected by mask,
+ * usually returned by hbsdcontrol_get_attr_mask_fd(), with one get per
+ * attribute.
+ */
+int
+hbsdcontrol_get_masked_state_word_fd(int fd, pax_state_word_t mask,
+    pax_state_word_t *word)
+{
+	int error;
+	int val;
+
+	*word = 0;
+
+	for (int feature = 0; mask != 0 && feature < HBSDCONTROL_NFEATURES; feature++) {
+		for (pax_feature_state_t attr = 0; attr < 2; attr++) {
+			if (PAX_STATE_ATTR(mask, feature, attr) == PAX_ATTR_ABSENT)
+				continue;
+
+			error = hbsdcontrol_extattr_get_attr_fd(fd,
+			    pax_features[feature].extattr[attr], &val);
+			/* Removed since it was listed. */
+			if (error == ENOATTR)
+				continue;
+			if (error)
+				return (error);
+
+			*word |= (pax_state_word_t)(val == 0 ? PAX_ATTR_ZERO :
+			    val == 1 ? PAX_ATTR_ONE : PAX_ATTR_INVALID) <<
+			    PAX_STATE_SHIFT(feature, attr);
+		}
+	}
+
+	return (0);
+}
+
+
 int
 hbsdcontrol_set_feature_state(const char *file, const char *feature, pax_feature_state_t state)
 {
@@ -331,7 +867,10 @@ hbsdcontrol_set_feature_state(const char *file, const char *feature, pax_feature
 			}
 
 			error = hbsdcontrol_extattr_set_attr(file, pax_features[i].extattr[disable], !state);
-			error |= hbsdcontrol_extattr_set_attr(file, pax_features[i].extattr[enable], state);
+			if (error == 0)
+				error = hbsdcontrol_extattr_set_attr(file, pax_features[i].extattr[enable], state);
+			if (error == 0)
+				error = hbsdcontrol_flags_sync(file);
 
 			break;
 		}
@@ -355,8 +894,13 @@ hbsdcontrol_rm_feature_state(const char *file, const char *feature)
 				printf("%s:\treset %s on %s\n",
 				    __func__,
 				    pax_features[i].feature, file);
-			error = hbsdcontrol_extattr_rm_attr(file, pax_features[i].extattr[disable]);
-			error |= hbsdcontrol_extattr_rm_attr(file, pax_features[i].extattr[enable]);
+			for (pax_feature_state_t attr = 0; attr < 2 && error == 0; attr++) {
+				if (hbsdcontrol_extattr_rm_attr(file,
+				    pax_features[i].extattr[attr]) != 0 && errno != ENOATTR)
+					error = errno;
+			}
+			if (error == 0)
+				error = hbsdcontrol_flags_sync(file);
 
 			break;
 		}
@@ -384,24 +928,37 @@ hbsdcontrol_get_all_feature_state(const char *file, struct pax_feature_state **f
 	assert(*feature_states != NULL);
 
 	error = hbsdcontrol_extattr_list_attrs(file, &attrs);
-	if (attrs == NULL)
-		err(-1, "attrs == NULL");
+	if (error) {
+		free(*feature_states);
+		*feature_states = NULL;
+		return (error);
+	}
 
 	for (int feature = 0; pax_features[feature].feature != NULL; feature++) {
 		for (int attr = 0; attrs[attr] != NULL; attr++) {
 			for (pax_feature_state_t state = 0; state < 2; state++) {
 				if (!strcmp(pax_features[feature].extattr[state], attrs[attr])) {
-					hbsdcontrol_extattr_get_attr(file, attrs[attr], &val);
+					error = hbsdcontrol_extattr_get_attr(file, attrs[attr], &val);
+					/* Removed since it was listed. */
+					if (error == ENOATTR) {
+						error = 0;
+						continue;
+					}
+					if (error) {
+						hbsdcontrol_free_attrs(&attrs);
+						free(*feature_states);
+						*feature_states = NULL;
+						return (error);
+					}
 
 					if (hbsdcontrol_debug_flag)
 						printf("%s:\t%s (%s: %d)\n",
 						    __func__,
 						    pax_features[feature].feature, attrs[attr], val);
 
-					if ((*feature_states)[feature].feature == NULL)
-						(*feature_states)[feature].feature = strdup(pax_features[feature].feature);
+					(*feature_states)[feature].feature = pax_features[feature].feature;
 					(*feature_states)[feature].internal[state].state = val;
-					(*feature_states)[feature].internal[state].extattr = strdup(pax_features[feature].extattr[state]);
+					(*feature_states)[feature].internal[state].extattr = pax_features[feature].extattr[state];
 					found = true;
 				}
 			}
@@ -410,7 +967,7 @@ hbsdcontrol_get_all_feature_state(const char *file, struct pax_feature_state **f
 			(*feature_states)[feature].state = hbsdcontrol_validate_state(&(*feature_states)[feature]);
 			found = false;
 		} else {
-			(*feature_states)[feature].feature = strdup(pax_features[feature].feature);
+			(*feature_states)[feature].feature = pax_features[feature].feature;
 			(*feature_states)[feature].state = sysdef;
 		}
 	}
@@ -421,20 +978,32 @@ hbsdcontrol_get_all_feature_state(const char *file, struct pax_feature_state **f
 }
 
 
+/* The names point into pax_features[], only the array is allocated. */
 static void
 hbsdcontrol_free_all_feature_state(struct pax_feature_state **feature_states)
 {
-	if (*feature_states == NULL)
-		return;
 
-	for (unsigned int feature = 0; feature < nitems(pax_features); feature++) {
-		free((*feature_states)[feature].feature);
-		(*feature_states)[feature].feature = NULL;
-		for (pax_feature_state_t state = 0; state < 2; state++) {
-			free((*feature_states)[feature].internal[state].extattr);
-			(*feature_states)[feature].internal[state].extattr = NULL;
-		}
-	}
+	free(*feature_states);
+	*feature_states = NULL;
+}
+
+/*
+ * Store the state of each feature in states[], in the order of
+ * pax_features[].
+ */
+int
+hbsdcontrol_get_feature_states(const char *file, pax_feature_state_t *states)
+{
+	pax_state_word_t word;
+	int error;
+
+	error = hbsdcontrol_get_state_word(file, &word);
+	if (error)
+		return (error);
+
+	hbsdcontrol_state_word_decode(word, states);
+
+	return (0);
 }
 
 /*
@@ -465,6 +1034,7 @@ hbsdcontrol_list_features(const char *file, char **features)
 	}
 	sbuf_finish(list);
 	asprintf(features, "%s", sbuf_data(list));
+	sbuf_delete(list);
 
 	hbsdcontrol_free_all_feature_state(&feature_states);
 
@@ -508,7 +1078,14 @@ static const char *
 hbsdcontrol_get_state_string(const struct pax_feature_state *feature_state)
 {
 
-	switch (feature_state->state) {
+	return (hbsdcontrol_state_to_string(feature_state->state));
+}
+
+const char *
+hbsdcontrol_state_to_string(pax_feature_state_t state)
+{
+
+	switch (state) {
 	case enable:
 		return "enabled";
 	case disable:
@@ -530,3 +1107,323 @@ hbsdcontrol_set_debug(const int level)
 
 	return (hbsdcontrol_debug_flag);
 }
+
+int
+hbsdcontrol_get_debug(void)
+{
+
+	return (hbsdcontrol_debug_flag);
+}
+
+void
+hbsdcontrol_set_flags_mode(enum hbsdcontrol_flags_mode mode)
+{
+
+	hbsdcontrol_flags_mode = mode;
+}
+
+enum hbsdcontrol_flags_mode
+hbsdcontrol_get_flags_mode(void)
+{
+
+	return (hbsdcontrol_flags_mode);
+}
+
+/*
+ * Encode a state word into buf, which holds HBSDCONTROL_FLAGS_LEN
+ * characters and the terminating NUL.
+ */
+void
+hbsdcontrol_flags_encode(pax_state_word_t word, char *buf)
+{
+
+	snprintf(buf, HBSDCONTROL_FLAGS_LEN + 1, "%d:%06x",
+	    HBSDCONTROL_FLAGS_VERSION, word & PAX_STATE_MASK);
+}
+
+int
+hbsdcontrol_flags_decode(const char *buf, size_t len, pax_state_word_t *word)
+{
+	pax_state_word_t val;
+	int digit;
+
+	if (len != HBSDCONTROL_FLAGS_LEN || buf[0] != '0' + HBSDCONTROL_FLAGS_VERSION ||
+	    buf[1] != ':')
+		return (EFTYPE);
+
+	val = 0;
+	for (size_t i = 2; i < len; i++) {
+		if (buf[i] >= '0' && buf[i] <= '9')
+			digit = buf[i] - '0';
+		else if (buf[i] >= 'a' && buf[i] <= 'f')
+			digit = buf[i] - 'a' + 10;
+		else
+			return (EFTYPE);
+		val = val << 4 | digit;
+	}
+
+	if (val & ~PAX_STATE_MASK)
+		return (EFTYPE);
+
+	*word = val;
+
+	return (0);
+}
+
+static int
+hbsdcontrol_flags_read(const char *file, int fd, pax_state_word_t *word)
+{
+	char buf[HBSDCONTROL_FLAGS_LEN + 1];
+	ssize_t len;
+	struct timespec start;
+
+	hbsdcontrol_ratelimit_enter(&start);
+	if (file != NULL)
+		len = hbsdcontrol_backend_get_file(file,
+		    EXTATTR_NAMESPACE_SYSTEM, HBSDCONTROL_FLAGS_ATTR, buf, sizeof(buf));
+	else
+		len = hbsdcontrol_backend_get_fd(fd,
+		    EXTATTR_NAMESPACE_SYSTEM, HBSDCONTROL_FLAGS_ATTR, buf, sizeof(buf));
+	hbsdcontrol_ratelimit_exit(&start);
+	if (len < 0)
+		return (errno);
+
+	return (hbsdcontrol_flags_decode(buf, len, word));
+}
+
+/*
+ * A file without pax attributes has no flags attribute either.
+ */
+static int
+hbsdcontrol_flags_write(const char *file, int fd, pax_state_word_t word)
+{
+	char buf[HBSDCONTROL_FLAGS_LEN + 1];
+	ssize_t len;
+	struct timespec start;
+
+	hbsdcontrol_flags_encode(word, buf);
+
+	if (hbsdcontrol_debug_flag)
+		printf("%s:\t%s = %s\n", __func__, file != NULL ? file : "(fd)", buf);
+
+	hbsdcontrol_ratelimit_enter(&start);
+	if (word == 0 && file != NULL)
+		len = hbsdcontrol_backend_delete_file(file,
+		    EXTATTR_NAMESPACE_SYSTEM, HBSDCONTROL_FLAGS_ATTR);
+	else if (word == 0)
+		len = hbsdcontrol_backend_delete_fd(fd,
+		    EXTATTR_NAMESPACE_SYSTEM, HBSDCONTROL_FLAGS_ATTR);
+	else if (file != NULL)
+		len = hbsdcontrol_backend_set_file(file,
+		    EXTATTR_NAMESPACE_SYSTEM, HBSDCONTROL_FLAGS_ATTR, buf, HBSDCONTROL_FLAGS_LEN);
+	else
+		len = hbsdcontrol_backend_set_fd(fd,
+		    EXTATTR_NAMESPACE_SYSTEM, HBSDCONTROL_FLAGS_ATTR, buf, HBSDCONTROL_FLAGS_LEN);
+	hbsdcontrol_ratelimit_exit(&start);
+	if (len == -1 && (word != 0 || errno != ENOATTR))
+		return (errno);
+
+	return (0);
+}
+
+int
+hbsdcontrol_get_flags(const char *file, pax_state_word_t *word)
+{
+
+	return (hbsdcontrol_flags_read(file, -1, word));
+}
+
+int
+hbsdcontrol_get_flags_fd(int fd, pax_state_word_t *word)
+{
+
+	return (hbsdcontrol_flags_read(NULL, fd, word));
+}
+
+/*
+ * Store the word in the flags attribute, or remove the attribute when
+ * the word is 0.
+ */
+int
+hbsdcontrol_set_flags(const char *file, pax_state_word_t word)
+{
+
+	return (hbsdcontrol_flags_write(file, -1, word));
+}
+
+int
+hbsdcontrol_set_flags_fd(int fd, pax_state_word_t word)
+{
+
+	return (hbsdcontrol_flags_write(NULL, fd, word));
+}
+
+/*
+ * Refresh the flags attribute of the file after a change of its
+ * per-feature attributes: rewrite it in the HBSDCONTROL_FLAGS_SYNC
+ * mode, and remove it otherwise, so a later HBSDCONTROL_FLAGS_SYNC run
+ * never reads a stale one.
+ */
+int
+hbsdcontrol_flags_sync(const char *file)
+{
+	pax_state_word_t word;
+	int error;
+
+	if (hbsdcontrol_flags_mode != HBSDCONTROL_FLAGS_SYNC)
+		return (hbsdcontrol_set_flags(file, 0));
+
+	error = hbsdcontrol_get_legacy_state_word(file, &word);
+	if (error == 0)
+		error = hbsdcontrol_set_flags(file, word);
+
+	return (error);
+}
+
+/*
+ * Limit the extattr syscalls to max_rate per second, a zero max_rate
+ * removes the limit.  The adaptive mode backs off, when the syscalls
+ * get slower, and starts from HBSDCONTROL_RATELIMIT_ADAPTIVE_RATE when
+ * no max_rate is given.
+ */
+int
+hbsdcontrol_set_ratelimit(unsigned int max_rate, bool adaptive)
+{
+
+	pthread_mutex_lock(&hbsdcontrol_ratelimit.mtx);
+	hbsdcontrol_ratelimit.adaptive = adaptive;
+	hbsdcontrol_ratelimit.max_rate = max_rate;
+	if (adaptive && max_rate == 0)
+		hbsdcontrol_ratelimit.max_rate = HBSDCONTROL_RATELIMIT_ADAPTIVE_RATE;
+	hbsdcontrol_ratelimit.rate = hbsdcontrol_ratelimit.max_rate;
+	/* Allow bursts of a tenth of a second. */
+	hbsdcontrol_ratelimit.burst = MAX(hbsdcontrol_ratelimit.rate / 10, 1);
+	hbsdcontrol_ratelimit.tokens = hbsdcontrol_ratelimit.burst;
+	hbsdcontrol_ratelimit.latency = 0;
+	hbsdcontrol_ratelimit.baseline = 0;
+	clock_gettime(CLOCK_MONOTONIC, &hbsdcontrol_ratelimit.last);
+	hbsdcontrol_ratelimit.adjusted = hbsdcontrol_ratelimit.last;
+	atomic_store_explicit(&hbsdcontrol_ratelimit.enabled,
+	    hbsdcontrol_ratelimit.max_rate > 0, memory_order_relaxed);
+	pthread_mutex_unlock(&hbsdcontrol_ratelimit.mtx);
+
+	return (0);
+}
+
+static int64_t
+hbsdcontrol_timespec_ns(const struct timespec *a, const struct timespec *b)
+{
+
+	return ((int64_t)(a->tv_sec - b->tv_sec) * 1000000000LL + (a->tv_nsec - b->tv_nsec));
+}
+
+/*
+ * Take a token, or reserve the next one and sleep until it is due,
+ * so the waiting threads are served in order without retrying.
+ */
+static void
+hbsdcontrol_ratelimit_enter(struct timespec *start)
+{
+	struct timespec now, wait;
+	double delay;
+	bool adaptive;
+
+	/* A zero start tells hbsdcontrol_ratelimit_exit() to skip the call. */
+	start->tv_sec = 0;
+	start->tv_nsec = 0;
+
+	if (!atomic_load_explicit(&hbsdcontrol_ratelimit.enabled, memory_order_relaxed))
+		return;
+
+	pthread_mutex_lock(&hbsdcontrol_ratelimit.mtx);
+	if (!hbsdcontrol_ratelimit.enabled) {
+		pthread_mutex_unlock(&hbsdcontrol_ratelimit.mtx);
+		return;
+	}
+	adaptive = hbsdcontrol_ratelimit.adaptive;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	hbsdcontrol_ratelimit.tokens += hbsdcontrol_timespec_ns(&now, &hbsdcontrol_ratelimit.last) *
+	    hbsdcontrol_ratelimit.rate / 1e9;
+	hbsdcontrol_ratelimit.tokens = MIN(hbsdcontrol_ratelimit.tokens, hbsdcontrol_ratelimit.burst);
+	hbsdcontrol_ratelimit.last = now;
+	hbsdcontrol_ratelimit.tokens -= 1;
+	delay = hbsdcontrol_ratelimit.tokens < 0 ?
+	    -hbsdcontrol_ratelimit.tokens / hbsdcontrol_ratelimit.rate : 0;
+	pthread_mutex_unlock(&hbsdcontrol_ratelimit.mtx);
+
+	if (delay > 0) {
+		wait.tv_sec = (time_t)delay;
+		wait.tv_nsec = (long)((delay - wait.tv_sec) * 1e9);
+		while (nanosleep(&wait, &wait) == -1 && errno == EINTR)
+			;
+	}
+
+	if (adaptive)
+		clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+/*
+ * Feed the latency of a timed call to the adaptive mode.
+ */
+static void
+hbsdcontrol_ratelimit_adjust(const struct timespec *start)
+{
+	struct timespec now;
+	double latency;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	latency = hbsdcontrol_timespec_ns(&now, start);
+
+	pthread_mutex_lock(&hbsdcontrol_ratelimit.mtx);
+	/* The limit may have been changed since the call was timed. */
+	if (!hbsdcontrol_ratelimit.enabled || !hbsdcontrol_ratelimit.adaptive) {
+		pthread_mutex_unlock(&hbsdcontrol_ratelimit.mtx);
+		return;
+	}
+	if (hbsdcontrol_ratelimit.latency == 0)
+		hbsdcontrol_ratelimit.latency = latency;
+	else
+		hbsdcontrol_ratelimit.latency = hbsdcontrol_ratelimit.latency * 0.9 + latency * 0.1;
+
+	/* Let the baseline drift up slowly, the workload may change. */
+	if (hbsdcontrol_ratelimit.baseline == 0 ||
+	    hbsdcontrol_ratelimit.latency < hbsdcontrol_ratelimit.baseline)
+		hbsdcontrol_ratelimit.baseline = hbsdcontrol_ratelimit.latency;
+	else
+		hbsdcontrol_ratelimit.baseline *= 1.0001;
+
+	/* Adjust the rate at most once per window. */
+	if (hbsdcontrol_timespec_ns(&now, &hbsdcontrol_ratelimit.adjusted) >= HBSDCONTROL_RATELIMIT_WINDOW_NS) {
+		if (hbsdcontrol_ratelimit.latency > hbsdcontrol_ratelimit.baseline * 2)
+			hbsdcontrol_ratelimit.rate = MAX(hbsdcontrol_ratelimit.rate / 2,
+			    HBSDCONTROL_RATELIMIT_MIN_RATE);
+		else if (hbsdcontrol_ratelimit.latency < hbsdcontrol_ratelimit.baseline * 1.5)
+			hbsdcontrol_ratelimit.rate = MIN(hbsdcontrol_ratelimit.rate +
+			    hbsdcontrol_ratelimit.max_rate / 20, hbsdcontrol_ratelimit.max_rate);
+		hbsdcontrol_ratelimit.burst = MAX(hbsdcontrol_ratelimit.rate / 10, 1);
+		hbsdcontrol_ratelimit.adjusted = now;
+
+		if (hbsdcontrol_debug_flag > 1)
+			printf("%s:\tlatency %.0f ns, baseline %.0f ns, rate %.0f ops/s\n",
+			    __func__, hbsdcontrol_ratelimit.latency,
+			    hbsdcontrol_ratelimit.baseline, hbsdcontrol_ratelimit.rate);
+	}
+	pthread_mutex_unlock(&hbsdcontrol_ratelimit.mtx);
+}
+
+/*
+ * The callers return the errno of the timed call after this, so it is
+ * preserved.
+ */
+static void
+hbsdcontrol_ratelimit_exit(const struct timespec *start)
+{
+	int saved_errno;
+
+	if (start->tv_sec == 0 && start->tv_nsec == 0)
+		return;
+
+	saved_errno = errno;
+	hbsdcontrol_ratelimit_adjust(start);
+	errno = saved_errno;
+}
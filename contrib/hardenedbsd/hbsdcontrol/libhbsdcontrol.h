@@ -29,6 +29,12 @@
 #ifndef __LIBHBSDCONTROL_H
 #define	__LIBHBSDCONTROL_H
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+
 enum feature_state {
 	conflict = -2,
 	sysdef = -1,
@@ -44,30 +50,372 @@ struct pax_feature_entry {
 };
 
 struct pax_feature_state {
-	char	*feature;
+	const char	*feature;
 	struct {
-		char	*extattr;
+		const char	*extattr;
 		pax_feature_state_t	 state;
 	} internal[2];
 	int	state;
 };
 
+/* The number of entries in pax_features[], without the terminating entry. */
+#define	HBSDCONTROL_NFEATURES	6
+
 extern const struct pax_feature_entry pax_features[];
 
+/*
+ * Packed state of a file: two bits per attribute, in the order of
+ * pax_features[], the disable attribute first.
+ */
+typedef uint32_t pax_state_word_t;
+
+#define	PAX_ATTR_ABSENT		0
+#define	PAX_ATTR_ZERO		1
+#define	PAX_ATTR_ONE		2
+#define	PAX_ATTR_INVALID	3
+
+#define	PAX_STATE_SHIFT(feature, attr)		(((feature) * 2 + (attr)) * 2)
+#define	PAX_STATE_ATTR(word, feature, attr)	\
+	(((word) >> PAX_STATE_SHIFT(feature, attr)) & 0x3)
+/* Every attribute of every feature. */
+#define	PAX_STATE_MASK	\
+	((pax_state_word_t)((1ULL << PAX_STATE_SHIFT(HBSDCONTROL_NFEATURES, 0)) - 1))
+
+/* Histogram index of a pax_feature_state_t, conflict is the first one. */
+#define	HBSDCONTROL_NSTATES		4
+#define	HBSDCONTROL_STATE_INDEX(state)	((state) - conflict)
+
+struct hbsdcontrol_state_histogram {
+	uint64_t	counts[HBSDCONTROL_NFEATURES][HBSDCONTROL_NSTATES];
+};
+
 int hbsdcontrol_extattr_get_attr(const char *file, const char *attr, int *val);
 int hbsdcontrol_extattr_set_attr(const char *file, const char *attr, const int val);
 int hbsdcontrol_extattr_rm_attr(const char *file, const char *attr);
 int hbsdcontrol_extattr_list_attrs(const char *file, char ***attrs);
+int hbsdcontrol_extattr_get_attr_fd(int fd, const char *attr, int *val);
+int hbsdcontrol_extattr_set_attr_fd(int fd, const char *attr, int val);
+int hbsdcontrol_extattr_rm_attr_fd(int fd, const char *attr);
 void hbsdcontrol_free_attrs(char ***attrs);
 
 int hbsdcontrol_get_feature_state(const char *file, const char *feature, pax_feature_state_t *state);
 int hbsdcontrol_set_feature_state(const char *file, const char *feature, pax_feature_state_t state);
 int hbsdcontrol_rm_feature_state(const char *file, const char *feature);
+int hbsdcontrol_get_feature_states(const char *file, pax_feature_state_t *states);
 int hbsdcontrol_list_features(const char *file, char **features);
 void hbsdcontrol_free_features(char **features);
 
+int hbsdcontrol_feature_index(const char *feature);
+const char *hbsdcontrol_state_to_string(pax_feature_state_t state);
+
+/*
+ * Attribute storage backend, with the semantics of extattr(2): the
+ * functions return -1 and set errno on error.
+ */
+struct hbsdcontrol_backend {
+	const char	*name;
+	ssize_t		(*list_file)(void *ctx, const char *file, int attrnamespace, void *data, size_t nbytes);
+	ssize_t		(*get_file)(void *ctx, const char *file, int attrnamespace, const char *attr, void *data, size_t nbytes);
+	ssize_t		(*set_file)(void *ctx, const char *file, int attrnamespace, const char *attr, const void *data, size_t nbytes);
+	int		(*delete_file)(void *ctx, const char *file, int attrnamespace, const char *attr);
+	ssize_t		(*list_fd)(void *ctx, int fd, int attrnamespace, void *data, size_t nbytes);
+	ssize_t		(*get_fd)(void *ctx, int fd, int attrnamespace, const char *attr, void *data, size_t nbytes);
+	ssize_t		(*set_fd)(void *ctx, int fd, int attrnamespace, const char *attr, const void *data, size_t nbytes);
+	int		(*delete_fd)(void *ctx, int fd, int attrnamespace, const char *attr);
+};
+
+extern const struct hbsdcontrol_backend hbsdcontrol_extattr_backend;
+extern const struct hbsdcontrol_backend hbsdcontrol_sidecar_backend;
+
+void hbsdcontrol_set_backend(const struct hbsdcontrol_backend *backend, void *ctx);
+const struct hbsdcontrol_backend *hbsdcontrol_get_backend(void);
+
+/*
+ * The number of backend calls made by the library, by operation.  The
+ * lookup counter counts the calls of the other counters, which resolve
+ * a path, the calls on file descriptors do not.
+ */
+struct hbsdcontrol_op_stats {
+	uint64_t	list;
+	uint64_t	get;
+	uint64_t	set;
+	uint64_t	delete;
+	uint64_t	lookup;
+};
+
+void hbsdcontrol_get_op_stats(struct hbsdcontrol_op_stats *stats);
+void hbsdcontrol_reset_op_stats(void);
+
 int hbsdcontrol_set_debug(const int level);
+int hbsdcontrol_get_debug(void);
+int hbsdcontrol_set_ratelimit(unsigned int max_rate, bool adaptive);
 
 const char *hbsdcontrol_get_version(void);
 
+/*
+ * Bulk engine: walks the paths, and hands the files in batches to
+ * a pool of worker threads, which call fn on each batch.  Walk errors
+ * are passed to fn in the entry's error member.
+ */
+#define	HBSDCONTROL_BULK_RECURSIVE	0x0001
+#define	HBSDCONTROL_BULK_KEEPGOING	0x0002
+#define	HBSDCONTROL_BULK_RESUME		0x0004
+#define	HBSDCONTROL_BULK_INODE_ORDER	0x0008
+#define	HBSDCONTROL_BULK_XDEV		0x0010
+
+#define	HBSDCONTROL_BULK_BATCH_SIZE	64
+#define	HBSDCONTROL_BULK_REMOTE_WORKERS	2
+#define	HBSDCONTROL_BULK_CHECKPOINT_INTERVAL	5
+
+struct hbsdcontrol_bulk_batch;
+
+struct hbsdcontrol_bulk_entry {
+	char		*path;
+	struct stat	 st;
+	int		 error;
+	/* The position of the entry in its batch, in walk order. */
+	size_t		 index;
+	/* Result of fn for emit, owned by the callbacks. */
+	void		*data;
+	/* The batch of the entry, for hbsdcontrol_bulk_alloc(). */
+	struct hbsdcontrol_bulk_batch	*batch;
+};
+
+typedef int (*hbsdcontrol_bulk_fn)(struct hbsdcontrol_bulk_entry *entries, size_t nentries, void *arg);
+typedef void (*hbsdcontrol_bulk_emit_fn)(struct hbsdcontrol_bulk_entry *entries, size_t nentries, void *arg);
+
+struct hbsdcontrol_bulk_args {
+	int			 flags;
+	/*
+	 * At most nworkers batches are processed at once.  Each file
+	 * system has its own workers, at most remote_nworkers for the
+	 * network file systems.
+	 */
+	unsigned int		 nworkers;
+	unsigned int		 remote_nworkers;
+	unsigned int		 batch_size;
+	hbsdcontrol_bulk_fn	 fn;
+	/*
+	 * With HBSDCONTROL_BULK_INODE_ORDER, fn gets the entries of a batch
+	 * sorted by (st_dev, st_ino).  emit is called after fn with the
+	 * entries in walk order, one batch at a time, in the order of the
+	 * walk, so the output of the batches is not mixed up.
+	 */
+	hbsdcontrol_bulk_emit_fn	 emit;
+	void			*arg;
+	/*
+	 * When state is set, the position of the run is saved in it every
+	 * checkpoint_interval seconds, and HBSDCONTROL_BULK_RESUME skips
+	 * the files which were completed by the saved run.  The NULL
+	 * terminated command, such as the action and its arguments, is
+	 * saved with the operands, and a run only resumes a state saved by
+	 * the same command and operands.
+	 */
+	const char		*state;
+	char * const		*command;
+	unsigned int		 checkpoint_interval;
+	/*
+	 * When maxbytes is set, the walker waits for the batches in flight,
+	 * instead of allocating more than maxbytes for the batches.
+	 */
+	size_t			 maxbytes;
+};
+
+int hbsdcontrol_bulk_run(const struct hbsdcontrol_bulk_args *args, char * const *paths);
+void *hbsdcontrol_bulk_alloc(struct hbsdcontrol_bulk_entry *entry, size_t size);
+int hbsdcontrol_path_cmp(const char *a, const char *b, bool *ancestor);
+
+int hbsdcontrol_get_state_word(const char *file, pax_state_word_t *word);
+int hbsdcontrol_get_state_word_fd(int fd, pax_state_word_t *word);
+int hbsdcontrol_get_legacy_state_word(const char *file, pax_state_word_t *word);
+int hbsdcontrol_get_legacy_state_word_fd(int fd, pax_state_word_t *word);
+int hbsdcontrol_get_masked_state_word_fd(int fd, pax_state_word_t mask, pax_state_word_t *word);
+int hbsdcontrol_get_attr_mask_fd(int fd, pax_state_word_t *mask, bool *flags);
+
+/*
+ * Consolidated flags attribute: the state word of a file in a single
+ * attribute, "<version>:<word in hex>".  The kernel only reads the
+ * per-feature attributes, so the flags attribute is a copy of them,
+ * which is read instead of them, and written after them, in the sync
+ * mode.  The readers fall back to the per-feature attributes, when the
+ * flags attribute is absent, or has an unknown version.
+ */
+#define	HBSDCONTROL_FLAGS_ATTR		"hbsd.pax.flags"
+#define	HBSDCONTROL_FLAGS_VERSION	1
+#define	HBSDCONTROL_FLAGS_LEN		8
+
+enum hbsdcontrol_flags_mode {
+	HBSDCONTROL_FLAGS_LEGACY = 0,
+	HBSDCONTROL_FLAGS_SYNC,
+};
+
+void hbsdcontrol_set_flags_mode(enum hbsdcontrol_flags_mode mode);
+enum hbsdcontrol_flags_mode hbsdcontrol_get_flags_mode(void);
+void hbsdcontrol_flags_encode(pax_state_word_t word, char *buf);
+int hbsdcontrol_flags_decode(const char *buf, size_t len, pax_state_word_t *word);
+int hbsdcontrol_get_flags(const char *file, pax_state_word_t *word);
+int hbsdcontrol_get_flags_fd(int fd, pax_state_word_t *word);
+int hbsdcontrol_set_flags(const char *file, pax_state_word_t word);
+int hbsdcontrol_set_flags_fd(int fd, pax_state_word_t word);
+int hbsdcontrol_flags_sync(const char *file);
+pax_feature_state_t hbsdcontrol_state_word_feature(pax_state_word_t word, int feature);
+void hbsdcontrol_state_word_decode(pax_state_word_t word, pax_feature_state_t *states);
+void hbsdcontrol_state_histogram(const pax_state_word_t *words, size_t nwords, struct hbsdcontrol_state_histogram *hist);
+
+/*
+ * Columnar results of a bulk run: a state word and a directory index
+ * per file.
+ */
+struct hbsdcontrol_state_column;
+
+int hbsdcontrol_state_column_new(struct hbsdcontrol_state_column **col);
+void hbsdcontrol_state_column_free(struct hbsdcontrol_state_column **col);
+int hbsdcontrol_state_column_add(struct hbsdcontrol_state_column *col, const struct hbsdcontrol_bulk_entry *entries, const pax_state_word_t *words, size_t nentries);
+void hbsdcontrol_state_column_histogram(const struct hbsdcontrol_state_column *col, struct hbsdcontrol_state_histogram *hist);
+int hbsdcontrol_state_column_dir_histograms(const struct hbsdcontrol_state_column *col, struct hbsdcontrol_state_histogram **hists, const char * const **dirs, size_t *ndirs);
+
+/*
+ * Write-ahead journal of the attribute changes, see hbsdcontrol(8)
+ * rollback.  The records of a batch are made durable with a single
+ * hbsdcontrol_journal_commit() call before the batch is applied.
+ */
+#define	HBSDCONTROL_ATTR_ABSENT		(-1)
+/* A value other than 0 and 1, which is not restored. */
+#define	HBSDCONTROL_ATTR_INVALID	(-2)
+
+struct hbsdcontrol_journal;
+
+int hbsdcontrol_journal_open(const char *path, struct hbsdcontrol_journal **journal);
+int hbsdcontrol_journal_log(struct hbsdcontrol_journal *journal, const char *file, const char *attr, int oldval, int newval, uint64_t *lsn);
+int hbsdcontrol_journal_commit(struct hbsdcontrol_journal *journal, uint64_t lsn);
+int hbsdcontrol_journal_close(struct hbsdcontrol_journal **journal);
+int hbsdcontrol_journal_rollback(const char *path);
+
+int hbsdcontrol_bulk_write_state(struct hbsdcontrol_journal *journal, struct hbsdcontrol_bulk_entry *entries, const int *fds, size_t nentries, pax_state_word_t mask, pax_state_word_t word);
+int hbsdcontrol_set_feature_state_fd(const char *file, int fd, const char *feature, pax_feature_state_t state);
+int hbsdcontrol_bulk_set_feature_state(struct hbsdcontrol_journal *journal, struct hbsdcontrol_bulk_entry *entries, size_t nentries, const char *feature, pax_feature_state_t state);
+int hbsdcontrol_bulk_reset_all(struct hbsdcontrol_journal *journal, struct hbsdcontrol_bulk_entry *entries, size_t nentries);
+int hbsdcontrol_bulk_migrate_flags(struct hbsdcontrol_bulk_entry *entries, size_t nentries, bool remove);
+
+/*
+ * Profiles: named sets of feature states, compiled to a write set over
+ * pax_features[], see hbsdcontrol(8) apply-profile.
+ */
+#define	HBSDCONTROL_PROFILES_PATH	"/etc/hbsdcontrol.profiles"
+#define	HBSDCONTROL_PROFILE_NAME_MAX	64
+
+struct hbsdcontrol_profile {
+	char			name[HBSDCONTROL_PROFILE_NAME_MAX];
+	/* The attributes written, and their new values. */
+	pax_state_word_t	mask;
+	pax_state_word_t	word;
+};
+
+int hbsdcontrol_profile_compile(const char *name, const char *spec, struct hbsdcontrol_profile *profile);
+int hbsdcontrol_profile_lookup(const char *path, const char *name, struct hbsdcontrol_profile *profile);
+int hbsdcontrol_profile_apply(struct hbsdcontrol_journal *journal, const struct hbsdcontrol_profile *profile, const char *file);
+int hbsdcontrol_bulk_apply_profile(struct hbsdcontrol_journal *journal, struct hbsdcontrol_bulk_entry *entries, size_t nentries, const struct hbsdcontrol_profile *profile);
+int hbsdcontrol_profile_from_file(const char *file, struct hbsdcontrol_profile *profile);
+int hbsdcontrol_clone_state(struct hbsdcontrol_journal *journal, const char *src, char * const *dsts, int flags);
+
+/*
+ * Content digests, to match the binaries by their identity instead of
+ * their path.  The cache keeps the digests by (dev, ino), as long as
+ * the mtime, the ctime and the size of the file do not change.
+ */
+#define	HBSDCONTROL_DIGEST_LEN		32
+#define	HBSDCONTROL_DIGEST_CACHE_PATH	"/var/db/hbsdcontrol.digests"
+
+struct hbsdcontrol_digest_cache;
+struct hbsdcontrol_rules;
+
+int hbsdcontrol_digest_parse(const char *hex, uint8_t *digest);
+void hbsdcontrol_digest_format(const uint8_t *digest, char *hex);
+int hbsdcontrol_digest_fd(struct hbsdcontrol_digest_cache *cache, int fd, uint8_t *digest);
+int hbsdcontrol_digest_file(struct hbsdcontrol_digest_cache *cache, const char *file, const struct stat *st, uint8_t *digest);
+int hbsdcontrol_digest_cache_open(const char *path, struct hbsdcontrol_digest_cache **cache);
+bool hbsdcontrol_digest_cache_lookup(struct hbsdcontrol_digest_cache *cache, const struct stat *st, uint8_t *digest);
+int hbsdcontrol_digest_cache_close(struct hbsdcontrol_digest_cache **cache);
+int hbsdcontrol_rules_load(const char *path, const char *profiles, struct hbsdcontrol_rules **rules);
+const struct hbsdcontrol_profile *hbsdcontrol_rules_match(const struct hbsdcontrol_rules *rules, const uint8_t *digest);
+void hbsdcontrol_rules_free(struct hbsdcontrol_rules **rules);
+
+/*
+ * Sidecar database: keeps the attributes of the files by (dev, ino)
+ * on the file systems without extattr(2) support, attach it with
+ * hbsdcontrol_set_backend(&hbsdcontrol_sidecar_backend, db).
+ */
+struct hbsdcontrol_sidecar;
+
+int hbsdcontrol_sidecar_open(const char *path, struct hbsdcontrol_sidecar **db);
+int hbsdcontrol_sidecar_close(struct hbsdcontrol_sidecar **db);
+bool hbsdcontrol_sidecar_lookup(struct hbsdcontrol_sidecar *db, const struct stat *st, pax_state_word_t *word);
+int hbsdcontrol_sidecar_export(struct hbsdcontrol_sidecar *db, struct hbsdcontrol_journal *journal, const struct hbsdcontrol_bulk_args *args, const char *src, const char *dst);
+
+/*
+ * Snapshots: the feature states of the regular files below a root,
+ * in walk order, with the paths relative to the root.  A snapshot is
+ * either read from a live tree, or from a file written by
+ * hbsdcontrol_snapshot_write().
+ */
+struct hbsdcontrol_snapshot;
+
+struct hbsdcontrol_snapshot_entry {
+	const char		*path;
+	int			 error;
+	pax_feature_state_t	 states[HBSDCONTROL_NFEATURES];
+};
+
+int hbsdcontrol_snapshot_open(const char *path, const char *prefix, struct hbsdcontrol_snapshot **snap);
+int hbsdcontrol_snapshot_next(struct hbsdcontrol_snapshot *snap, struct hbsdcontrol_snapshot_entry *entry);
+void hbsdcontrol_snapshot_close(struct hbsdcontrol_snapshot **snap);
+int hbsdcontrol_snapshot_write_header(FILE *fp);
+int hbsdcontrol_snapshot_write(FILE *fp, const struct hbsdcontrol_snapshot_entry *entry);
+
+/*
+ * Query/apply service, see hbsdcontrol(8) serve.
+ *
+ * Every message starts with a fixed header, followed by hm_len bytes
+ * of payload.  Request payloads are NUL terminated strings: the file
+ * name, followed by the feature name for the feature specific ops.
+ * The response echoes hm_seq and hm_op, carries the errno value in
+ * hm_arg, and the op specific result in the payload.
+ */
+#define	HBSDCONTROL_SOCKET_PATH	"/var/run/hbsdcontrol.sock"
+#define	HBSDCONTROL_MSG_MAX	4096
+
+enum hbsdcontrol_op {
+	HBSDCONTROL_OP_PING = 0,
+	HBSDCONTROL_OP_LIST = 1,
+	HBSDCONTROL_OP_SET = 2,
+	HBSDCONTROL_OP_RESET = 3,
+};
+
+struct hbsdcontrol_msg_hdr {
+	uint32_t	hm_len;
+	uint32_t	hm_seq;
+	uint16_t	hm_op;
+	int16_t		hm_arg;
+};
+
+struct hbsdcontrol_request {
+	enum hbsdcontrol_op	 op;
+	const char		*file;
+	const char		*feature;
+	pax_feature_state_t	 state;
+	/* Filled in by hbsdcontrol_client_batch(). */
+	int			 error;
+	char			*result;
+};
+
+struct hbsdcontrol_client;
+
+int hbsdcontrol_client_open(const char *path, struct hbsdcontrol_client **client);
+void hbsdcontrol_client_close(struct hbsdcontrol_client **client);
+int hbsdcontrol_client_batch(struct hbsdcontrol_client *client, struct hbsdcontrol_request *reqs, size_t nreqs);
+void hbsdcontrol_client_free_results(struct hbsdcontrol_request *reqs, size_t nreqs);
+int hbsdcontrol_client_list_features(struct hbsdcontrol_client *client, const char *file, char **features);
+int hbsdcontrol_client_set_feature_state(struct hbsdcontrol_client *client, const char *file, const char *feature, pax_feature_state_t state);
+int hbsdcontrol_client_rm_feature_state(struct hbsdcontrol_client *client, const char *file, const char *feature);
+
 #endif /* __LIBHBSDCONTROL_H */
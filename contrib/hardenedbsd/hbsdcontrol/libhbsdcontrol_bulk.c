@@ -0,0 +1,1457 @@
+/*-
+ * Copyright (c) 2015-2018 Oliver Pinter <oliver.pinter@HardenedBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <fts.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <vis.h>
+
+#include "libhbsdcontrol.h"
+
+#define	HBSDCONTROL_CHECKPOINT_MAGIC	"#hbsdcontrol checkpoint v2"
+#define	HBSDCONTROL_BULK_MAX_SHARDS	16
+#define	HBSDCONTROL_BULK_CHUNK_SIZE	(16 * 1024)
+
+/*
+ * The paths of a batch, and the results of its callbacks, are carved
+ * out of the chunks of its arena.  The batches are recycled with their
+ * first chunk, so a run does not allocate for each file.
+ */
+struct hbsdcontrol_bulk_chunk {
+	STAILQ_ENTRY(hbsdcontrol_bulk_chunk)	 link;
+	size_t					 size;
+	size_t					 used;
+	max_align_t				 data[];
+};
+
+struct hbsdcontrol_bulk_batch {
+	STAILQ_ENTRY(hbsdcontrol_bulk_batch)	 link;
+	struct hbsdcontrol_bulk			*bulk;
+	STAILQ_HEAD(, hbsdcontrol_bulk_chunk)	 chunks;
+	struct hbsdcontrol_bulk_chunk		*chunk;
+	uint64_t				 seq;
+	int					 root;
+	/* A batch never spans two file systems. */
+	dev_t					 dev;
+	size_t					 nentries;
+	struct hbsdcontrol_bulk_entry		 entries[];
+};
+
+/*
+ * The walk order is fixed, so the position of a run is described by
+ * the last file of the last batch, which was completed together with
+ * all of the batches before it.  A failed batch, with
+ * HBSDCONTROL_BULK_KEEPGOING, holds the cursor before it, so a resumed
+ * run retries it.
+ */
+struct hbsdcontrol_bulk_cursor {
+	uint64_t	 hash;
+	int		 root;
+	char		*path;
+};
+
+struct hbsdcontrol_bulk_slot {
+	bool		 done;
+	bool		 failed;
+	int		 root;
+	char		*path;
+};
+
+/*
+ * The files of each file system are queued to their own workers, so a
+ * slow file system only holds up its own workers, instead of taking
+ * over the workers of every file system.  The queue is protected by
+ * the mtx of the run.  The workers of every shard share the nworkers
+ * running slots of the run, so nworkers bounds the whole run.
+ */
+struct hbsdcontrol_bulk_shard {
+	struct hbsdcontrol_bulk			*bulk;
+	dev_t					 dev;
+	pthread_cond_t				 cv_work;
+	STAILQ_HEAD(, hbsdcontrol_bulk_batch)	 queue;
+	unsigned int				 nqueued;
+	unsigned int				 maxqueued;
+	unsigned int				 nworkers;
+	pthread_t				*workers;
+};
+
+struct hbsdcontrol_bulk {
+	const struct hbsdcontrol_bulk_args	*args;
+	pthread_mutex_t				 mtx;
+	pthread_cond_t				 cv_space;
+	pthread_cond_t				 cv_emit;
+	/* The shards are only added by the walker, under mtx. */
+	struct hbsdcontrol_bulk_shard		 shards[HBSDCONTROL_BULK_MAX_SHARDS];
+	unsigned int				 nshards;
+	unsigned int				 nworkers;
+	unsigned int				 remote_nworkers;
+	/* The workers running fn, at most nworkers, protected by mtx. */
+	unsigned int				 nrunning;
+	/* The recycled batches, and the memory of the batches. */
+	STAILQ_HEAD(, hbsdcontrol_bulk_batch)	 batches;
+	unsigned int				 nbatches;
+	size_t					 batch_size;
+	size_t					 nbytes;
+	size_t					 maxbytes;
+	bool					 done;
+	bool					 abort;
+	int					 error;
+	/* The next batch to emit, protected by mtx. */
+	uint64_t				 emitted;
+	/* Checkpointing, protected by mtx. */
+	uint64_t				 seq;
+	uint64_t				 watermark;
+	struct hbsdcontrol_bulk_slot		*slots;
+	unsigned int				 nslots;
+	struct hbsdcontrol_bulk_cursor		 cursor;
+	/* A failed batch was passed, the cursor does not move anymore. */
+	bool					 held;
+	time_t					 interval;
+	time_t					 checkpointed;
+	pthread_mutex_t				 checkpoint_mtx;
+};
+
+static struct hbsdcontrol_bulk_batch *hbsdcontrol_bulk_get_batch(struct hbsdcontrol_bulk *bulk);
+static void hbsdcontrol_bulk_release_batch(struct hbsdcontrol_bulk *bulk, struct hbsdcontrol_bulk_batch *batch);
+static void hbsdcontrol_bulk_free_batch(struct hbsdcontrol_bulk_batch *batch);
+static void *hbsdcontrol_bulk_arena_alloc(struct hbsdcontrol_bulk_batch *batch, size_t size, size_t align);
+static void hbsdcontrol_bulk_fail(struct hbsdcontrol_bulk *bulk, int error);
+static struct hbsdcontrol_bulk_shard *hbsdcontrol_bulk_shard(struct hbsdcontrol_bulk *bulk, const struct hbsdcontrol_bulk_batch *batch);
+static bool hbsdcontrol_bulk_submit(struct hbsdcontrol_bulk *bulk, struct hbsdcontrol_bulk_batch *batch);
+static void *hbsdcontrol_bulk_worker(void *arg);
+static void hbsdcontrol_bulk_emit(struct hbsdcontrol_bulk *bulk, struct hbsdcontrol_bulk_batch *batch, bool aborted);
+static int hbsdcontrol_bulk_inode_cmp(const void *a, const void *b);
+static int hbsdcontrol_bulk_index_cmp(const void *a, const void *b);
+static void hbsdcontrol_bulk_complete(struct hbsdcontrol_bulk *bulk, struct hbsdcontrol_bulk_batch *batch, bool failed);
+static int hbsdcontrol_bulk_checkpoint(struct hbsdcontrol_bulk *bulk);
+static int hbsdcontrol_bulk_load_cursor(const char *state, struct hbsdcontrol_bulk_cursor *cursor);
+static uint64_t hbsdcontrol_bulk_hash_words(uint64_t hash, char * const *words);
+static bool hbsdcontrol_bulk_resume_skip(FTS *fts, FTSENT *ent, int root, const struct hbsdcontrol_bulk_cursor *cursor);
+static int hbsdcontrol_bulk_walk(struct hbsdcontrol_bulk *bulk, char * const *paths, size_t batch_size, const struct hbsdcontrol_bulk_cursor *resume);
+static int hbsdcontrol_bulk_compar(const FTSENT * const *a, const FTSENT * const *b);
+static int hbsdcontrol_bulk_attr_val(pax_state_word_t code);
+static int hbsdcontrol_bulk_write_feature(struct hbsdcontrol_journal *journal, struct hbsdcontrol_bulk_entry *entries, const int *fds, size_t nentries, const char *feature, pax_feature_state_t state);
+
+
+/*
+ * Take a recycled batch, or allocate a new one, while the batches fit
+ * in maxbytes.  Otherwise the walker waits for a batch to be released.
+ */
+static struct hbsdcontrol_bulk_batch *
+hbsdcontrol_bulk_get_batch(struct hbsdcontrol_bulk *bulk)
+{
+	struct hbsdcontrol_bulk_batch *batch;
+	struct hbsdcontrol_bulk_chunk *chunk;
+	size_t size;
+
+	size = sizeof(*batch) + bulk->batch_size * sizeof(batch->entries[0]) +
+	    sizeof(*chunk) + HBSDCONTROL_BULK_CHUNK_SIZE;
+
+	pthread_mutex_lock(&bulk->mtx);
+	while ((batch = STAILQ_FIRST(&bulk->batches)) == NULL &&
+	    bulk->maxbytes > 0 && bulk->nbatches > 0 &&
+	    bulk->nbytes + size > bulk->maxbytes && !bulk->abort)
+		pthread_cond_wait(&bulk->cv_space, &bulk->mtx);
+	if (batch != NULL)
+		STAILQ_REMOVE_HEAD(&bulk->batches, link);
+	pthread_mutex_unlock(&bulk->mtx);
+
+	if (batch != NULL) {
+		memset(batch->entries, 0, batch->nentries * sizeof(batch->entries[0]));
+		batch->nentries = 0;
+		batch->chunk = STAILQ_FIRST(&batch->chunks);
+		batch->chunk->used = 0;
+		return (batch);
+	}
+
+	batch = calloc(1, sizeof(*batch) + bulk->batch_size * sizeof(batch->entries[0]));
+	chunk = malloc(sizeof(*chunk) + HBSDCONTROL_BULK_CHUNK_SIZE);
+	if (batch == NULL || chunk == NULL) {
+		free(batch);
+		free(chunk);
+		return (NULL);
+	}
+
+	chunk->size = HBSDCONTROL_BULK_CHUNK_SIZE;
+	chunk->used = 0;
+	batch->bulk = bulk;
+	STAILQ_INIT(&batch->chunks);
+	STAILQ_INSERT_HEAD(&batch->chunks, chunk, link);
+	batch->chunk = chunk;
+
+	pthread_mutex_lock(&bulk->mtx);
+	bulk->nbytes += size;
+	bulk->nbatches++;
+	pthread_mutex_unlock(&bulk->mtx);
+
+	return (batch);
+}
+
+
+/*
+ * Put the batch back for the walker, with only its first chunk, the
+ * others hold the rare large results.
+ */
+static void
+hbsdcontrol_bulk_release_batch(struct hbsdcontrol_bulk *bulk, struct hbsdcontrol_bulk_batch *batch)
+{
+	struct hbsdcontrol_bulk_chunk *first, *chunk;
+	size_t nbytes;
+
+	nbytes = 0;
+	first = STAILQ_FIRST(&batch->chunks);
+	while ((chunk = STAILQ_NEXT(first, link)) != NULL) {
+		STAILQ_REMOVE_AFTER(&batch->chunks, first, link);
+		nbytes += sizeof(*chunk) + chunk->size;
+		free(chunk);
+	}
+
+	pthread_mutex_lock(&bulk->mtx);
+	bulk->nbytes -= nbytes;
+	STAILQ_INSERT_HEAD(&bulk->batches, batch, link);
+	pthread_cond_signal(&bulk->cv_space);
+	pthread_mutex_unlock(&bulk->mtx);
+}
+
+
+static void
+hbsdcontrol_bulk_free_batch(struct hbsdcontrol_bulk_batch *batch)
+{
+	struct hbsdcontrol_bulk_chunk *chunk;
+
+	while ((chunk = STAILQ_FIRST(&batch->chunks)) != NULL) {
+		STAILQ_REMOVE_HEAD(&batch->chunks, link);
+		free(chunk);
+	}
+	free(batch);
+}
+
+
+/*
+ * Allocate from the current chunk of the batch, or from a new chunk,
+ * when it is full.  Only the thread owning the batch allocates from it.
+ */
+static void *
+hbsdcontrol_bulk_arena_alloc(struct hbsdcontrol_bulk_batch *batch, size_t size, size_t align)
+{
+	struct hbsdcontrol_bulk_chunk *chunk;
+	struct hbsdcontrol_bulk *bulk;
+	size_t used;
+	void *p;
+
+	bulk = batch->bulk;
+	chunk = batch->chunk;
+	used = roundup(chunk->used, align);
+
+	if (used > chunk->size || chunk->size - used < size) {
+		chunk = malloc(sizeof(*chunk) + MAX(size, HBSDCONTROL_BULK_CHUNK_SIZE));
+		if (chunk == NULL)
+			return (NULL);
+		chunk->size = MAX(size, HBSDCONTROL_BULK_CHUNK_SIZE);
+		STAILQ_INSERT_TAIL(&batch->chunks, chunk, link);
+		batch->chunk = chunk;
+		used = 0;
+
+		pthread_mutex_lock(&bulk->mtx);
+		bulk->nbytes += sizeof(*chunk) + chunk->size;
+		pthread_mutex_unlock(&bulk->mtx);
+	}
+
+	p = (char *)chunk->data + used;
+	chunk->used = used + size;
+
+	return (p);
+}
+
+
+/*
+ * Allocate from the arena of the entry's batch.  The entry carries its
+ * batch, so a copy of the entry, as the callbacks make to regroup the
+ * entries, allocates from the same arena.  The entries which were not
+ * made by the walk have no arena, and must not be passed.
+ */
+void *
+hbsdcontrol_bulk_alloc(struct hbsdcontrol_bulk_entry *entry, size_t size)
+{
+
+	assert(entry->batch != NULL);
+
+	return (hbsdcontrol_bulk_arena_alloc(entry->batch, size, sizeof(max_align_t)));
+}
+
+
+static void
+hbsdcontrol_bulk_fail(struct hbsdcontrol_bulk *bulk, int error)
+{
+
+	pthread_mutex_lock(&bulk->mtx);
+	if (bulk->error == 0)
+		bulk->error = error;
+	if ((bulk->args->flags & HBSDCONTROL_BULK_KEEPGOING) == 0) {
+		bulk->abort = true;
+		pthread_cond_broadcast(&bulk->cv_space);
+	}
+	pthread_mutex_unlock(&bulk->mtx);
+}
+
+
+/*
+ * Find the shard of the batch's file system, and start its workers, when
+ * the walk enters a new file system.  The file systems above the limit,
+ * or whose workers can not be started, share the first shard.
+ */
+static struct hbsdcontrol_bulk_shard *
+hbsdcontrol_bulk_shard(struct hbsdcontrol_bulk *bulk, const struct hbsdcontrol_bulk_batch *batch)
+{
+	struct hbsdcontrol_bulk_shard *shard;
+	struct statfs sfs;
+	unsigned int nworkers;
+
+	for (unsigned int idx = 0; idx < bulk->nshards; idx++) {
+		if (bulk->shards[idx].dev == batch->dev)
+			return (&bulk->shards[idx]);
+	}
+
+	if (bulk->nshards == HBSDCONTROL_BULK_MAX_SHARDS)
+		return (&bulk->shards[0]);
+
+	/*
+	 * Each shard can use every running slot.  The network file systems
+	 * are slow to answer, and their server is shared with the other
+	 * clients, a few workers keep them busy.
+	 */
+	nworkers = bulk->nworkers;
+	if (statfs(batch->entries[0].path, &sfs) == 0 &&
+	    (sfs.f_flags & MNT_LOCAL) == 0)
+		nworkers = MIN(nworkers, bulk->remote_nworkers);
+
+	shard = &bulk->shards[bulk->nshards];
+	shard->workers = calloc(nworkers, sizeof(pthread_t));
+	if (shard->workers == NULL)
+		return (bulk->nshards > 0 ? &bulk->shards[0] : NULL);
+
+	shard->bulk = bulk;
+	shard->dev = batch->dev;
+	shard->maxqueued = nworkers * 2;
+	STAILQ_INIT(&shard->queue);
+	pthread_cond_init(&shard->cv_work, NULL);
+
+	for (shard->nworkers = 0; shard->nworkers < nworkers; shard->nworkers++) {
+		if (pthread_create(&shard->workers[shard->nworkers], NULL,
+		    hbsdcontrol_bulk_worker, shard) != 0)
+			break;
+	}
+
+	if (shard->nworkers == 0) {
+		pthread_cond_destroy(&shard->cv_work);
+		free(shard->workers);
+		return (bulk->nshards > 0 ? &bulk->shards[0] : NULL);
+	}
+
+	/* The workers look for the queued batches of every shard. */
+	pthread_mutex_lock(&bulk->mtx);
+	bulk->nshards++;
+	pthread_mutex_unlock(&bulk->mtx);
+
+	return (shard);
+}
+
+
+/*
+ * Queue the batch for the workers of its file system, and block the
+ * walker while their queue is full.  Returns false, when the run was
+ * aborted.
+ */
+static bool
+hbsdcontrol_bulk_submit(struct hbsdcontrol_bulk *bulk, struct hbsdcontrol_bulk_batch *batch)
+{
+	struct hbsdcontrol_bulk_shard *shard;
+	bool aborted;
+
+	shard = hbsdcontrol_bulk_shard(bulk, batch);
+	if (shard == NULL) {
+		hbsdcontrol_bulk_fail(bulk, EAGAIN);
+		hbsdcontrol_bulk_release_batch(bulk, batch);
+		return (false);
+	}
+
+	pthread_mutex_lock(&bulk->mtx);
+	while ((shard->nqueued >= shard->maxqueued ||
+	    (bulk->nslots > 0 && bulk->seq - bulk->watermark >= bulk->nslots)) &&
+	    !bulk->abort)
+		pthread_cond_wait(&bulk->cv_space, &bulk->mtx);
+
+	aborted = bulk->abort;
+	if (!aborted) {
+		batch->seq = bulk->seq++;
+		STAILQ_INSERT_TAIL(&shard->queue, batch, link);
+		shard->nqueued++;
+		pthread_cond_signal(&shard->cv_work);
+	}
+	pthread_mutex_unlock(&bulk->mtx);
+
+	if (aborted)
+		hbsdcontrol_bulk_release_batch(bulk, batch);
+
+	return (!aborted);
+}
+
+
+static void *
+hbsdcontrol_bulk_worker(void *arg)
+{
+	struct hbsdcontrol_bulk_shard *shard;
+	struct hbsdcontrol_bulk *bulk;
+	struct hbsdcontrol_bulk_batch *batch;
+	bool aborted;
+	int error;
+
+	shard = arg;
+	bulk = shard->bulk;
+
+	for (;;) {
+		pthread_mutex_lock(&bulk->mtx);
+		while (STAILQ_EMPTY(&shard->queue) ? !bulk->done :
+		    bulk->nrunning >= bulk->nworkers)
+			pthread_cond_wait(&shard->cv_work, &bulk->mtx);
+
+		batch = STAILQ_FIRST(&shard->queue);
+		if (batch != NULL) {
+			STAILQ_REMOVE_HEAD(&shard->queue, link);
+			shard->nqueued--;
+			bulk->nrunning++;
+			pthread_cond_signal(&bulk->cv_space);
+		}
+		aborted = bulk->abort;
+		pthread_mutex_unlock(&bulk->mtx);
+
+		if (batch == NULL)
+			break;
+
+		error = 0;
+		if (!aborted) {
+			/*
+			 * The inode numbers approximate the on-disk order of
+			 * the metadata, so the batch's attribute I/O seeks less.
+			 */
+			if (bulk->args->flags & HBSDCONTROL_BULK_INODE_ORDER)
+				qsort(batch->entries, batch->nentries,
+				    sizeof(batch->entries[0]), hbsdcontrol_bulk_inode_cmp);
+			error = bulk->args->fn(batch->entries, batch->nentries, bulk->args->arg);
+			if (bulk->args->flags & HBSDCONTROL_BULK_INODE_ORDER)
+				qsort(batch->entries, batch->nentries,
+				    sizeof(batch->entries[0]), hbsdcontrol_bulk_index_cmp);
+			if (error)
+				hbsdcontrol_bulk_fail(bulk, error);
+		}
+
+		/*
+		 * Give up the slot before the emit, which waits for the
+		 * batches queued before this one.
+		 */
+		pthread_mutex_lock(&bulk->mtx);
+		bulk->nrunning--;
+		for (unsigned int idx = 0; idx < bulk->nshards; idx++) {
+			if (!STAILQ_EMPTY(&bulk->shards[idx].queue))
+				pthread_cond_signal(&bulk->shards[idx].cv_work);
+		}
+		pthread_mutex_unlock(&bulk->mtx);
+
+		if (bulk->args->emit != NULL)
+			hbsdcontrol_bulk_emit(bulk, batch, aborted);
+
+		if (!aborted)
+			hbsdcontrol_bulk_complete(bulk, batch, error != 0);
+
+		hbsdcontrol_bulk_release_batch(bulk, batch);
+	}
+
+	return (NULL);
+}
+
+
+/*
+ * Hand the batches to emit in walk order: the batches of each shard are
+ * dequeued in order, so the batch a worker waits for is either being
+ * processed by another worker, or queued to a shard whose workers do not
+ * wait for a later batch.  An aborted batch is not emitted, but it still passes
+ * its turn.
+ */
+static void
+hbsdcontrol_bulk_emit(struct hbsdcontrol_bulk *bulk, struct hbsdcontrol_bulk_batch *batch, bool aborted)
+{
+
+	pthread_mutex_lock(&bulk->mtx);
+	while (bulk->emitted != batch->seq)
+		pthread_cond_wait(&bulk->cv_emit, &bulk->mtx);
+	pthread_mutex_unlock(&bulk->mtx);
+
+	if (!aborted)
+		bulk->args->emit(batch->entries, batch->nentries, bulk->args->arg);
+
+	pthread_mutex_lock(&bulk->mtx);
+	bulk->emitted++;
+	pthread_cond_broadcast(&bulk->cv_emit);
+	pthread_mutex_unlock(&bulk->mtx);
+}
+
+
+static int
+hbsdcontrol_bulk_inode_cmp(const void *a, const void *b)
+{
+	const struct hbsdcontrol_bulk_entry *ea, *eb;
+
+	ea = a;
+	eb = b;
+
+	if (ea->st.st_dev != eb->st.st_dev)
+		return (ea->st.st_dev < eb->st.st_dev ? -1 : 1);
+	if (ea->st.st_ino != eb->st.st_ino)
+		return (ea->st.st_ino < eb->st.st_ino ? -1 : 1);
+
+	return (0);
+}
+
+
+static int
+hbsdcontrol_bulk_index_cmp(const void *a, const void *b)
+{
+	const struct hbsdcontrol_bulk_entry *ea, *eb;
+
+	ea = a;
+	eb = b;
+
+	return (ea->index < eb->index ? -1 : ea->index > eb->index);
+}
+
+
+/*
+ * Mark the batch done, and move the cursor forward over the batches
+ * which are done without a gap.  The batches complete out of order,
+ * the slots keep the last path of the batches above the cursor.  The
+ * watermark also moves over the failed batches, to free their slots,
+ * but the cursor stays before the first one.
+ */
+static void
+hbsdcontrol_bulk_complete(struct hbsdcontrol_bulk *bulk, struct hbsdcontrol_bulk_batch *batch,
+    bool failed)
+{
+	struct hbsdcontrol_bulk_slot *slot;
+	struct timespec now;
+	bool checkpoint;
+	char *path;
+
+	if (bulk->nslots == 0 || batch->nentries == 0)
+		return;
+
+	path = failed ? NULL : strdup(batch->entries[batch->nentries - 1].path);
+
+	pthread_mutex_lock(&bulk->mtx);
+	slot = &bulk->slots[batch->seq % bulk->nslots];
+	slot->done = true;
+	slot->failed = failed;
+	slot->root = batch->root;
+	slot->path = path;
+
+	while (bulk->watermark < bulk->seq) {
+		slot = &bulk->slots[bulk->watermark % bulk->nslots];
+		if (!slot->done)
+			break;
+
+		if (slot->failed)
+			bulk->held = true;
+		if (slot->path != NULL && !bulk->held) {
+			free(bulk->cursor.path);
+			bulk->cursor.path = slot->path;
+			bulk->cursor.root = slot->root;
+		} else
+			free(slot->path);
+		slot->path = NULL;
+		slot->done = false;
+		slot->failed = false;
+		bulk->watermark++;
+		pthread_cond_broadcast(&bulk->cv_space);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC_FAST, &now);
+	checkpoint = now.tv_sec - bulk->checkpointed >= bulk->interval;
+	if (checkpoint)
+		bulk->checkpointed = now.tv_sec;
+	pthread_mutex_unlock(&bulk->mtx);
+
+	/* A slow checkpoint should not hold up the other workers. */
+	if (checkpoint && pthread_mutex_trylock(&bulk->checkpoint_mtx) == 0) {
+		hbsdcontrol_bulk_checkpoint(bulk);
+		pthread_mutex_unlock(&bulk->checkpoint_mtx);
+	}
+}
+
+
+/*
+ * Write the cursor to a temporary file, and rename it over the state
+ * file, so the state file is always complete.
+ */
+static int
+hbsdcontrol_bulk_checkpoint(struct hbsdcontrol_bulk *bulk)
+{
+	char tmp[MAXPATHLEN];
+	char *vpath;
+	FILE *fp;
+	int root;
+	int error;
+
+	pthread_mutex_lock(&bulk->mtx);
+	root = bulk->cursor.root;
+	vpath = NULL;
+	if (bulk->cursor.path != NULL) {
+		vpath = calloc(sizeof(char), strlen(bulk->cursor.path) * 4 + 1);
+		if (vpath != NULL)
+			strvis(vpath, bulk->cursor.path, VIS_WHITE | VIS_CSTYLE | VIS_OCTAL);
+	}
+	pthread_mutex_unlock(&bulk->mtx);
+
+	if (vpath == NULL)
+		return (0);
+
+	if ((size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", bulk->args->state) >= sizeof(tmp)) {
+		free(vpath);
+		return (ENAMETOOLONG);
+	}
+
+	fp = fopen(tmp, "we");
+	if (fp == NULL) {
+		error = errno;
+		free(vpath);
+		return (error);
+	}
+
+	fprintf(fp, "%s\n", HBSDCONTROL_CHECKPOINT_MAGIC);
+	fprintf(fp, "hash %jx\n", (uintmax_t)bulk->cursor.hash);
+	fprintf(fp, "root %d\n", root);
+	fprintf(fp, "path %s\n", vpath);
+	free(vpath);
+
+	error = 0;
+	if (fflush(fp) != 0 || fsync(fileno(fp)) == -1)
+		error = errno;
+	if (fclose(fp) != 0 && error == 0)
+		error = errno;
+	if (error == 0 && rename(tmp, bulk->args->state) == -1)
+		error = errno;
+	if (error)
+		unlink(tmp);
+
+	return (error);
+}
+
+
+static int
+hbsdcontrol_bulk_load_cursor(const char *state, struct hbsdcontrol_bulk_cursor *cursor)
+{
+	char *line;
+	size_t linecap;
+	ssize_t len;
+	FILE *fp;
+	int error;
+	bool magic;
+
+	fp = fopen(state, "re");
+	if (fp == NULL)
+		return (errno);
+
+	line = NULL;
+	linecap = 0;
+	magic = false;
+	error = 0;
+
+	while ((len = getline(&line, &linecap, fp)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+
+		if (!magic) {
+			magic = strcmp(line, HBSDCONTROL_CHECKPOINT_MAGIC) == 0;
+			if (!magic)
+				break;
+		} else if (!strncmp(line, "hash ", 5))
+			cursor->hash = strtoull(line + 5, NULL, 16);
+		else if (!strncmp(line, "root ", 5))
+			cursor->root = strtol(line + 5, NULL, 10);
+		else if (!strncmp(line, "path ", 5)) {
+			free(cursor->path);
+			cursor->path = calloc(sizeof(char), len + 1);
+			if (cursor->path == NULL) {
+				error = ENOMEM;
+				break;
+			}
+			if (strunvis(cursor->path, line + 5) == -1) {
+				error = EFTYPE;
+				break;
+			}
+		}
+	}
+
+	if (error == 0 && (!magic || cursor->path == NULL))
+		error = EFTYPE;
+
+	free(line);
+	fclose(fp);
+
+	return (error);
+}
+
+
+/*
+ * FNV-1a over a NULL terminated list of words, preceded by their
+ * count, so the command and the operands hash apart however they are
+ * split.  A state file is only accepted for the same command and
+ * operands.
+ */
+static uint64_t
+hbsdcontrol_bulk_hash_words(uint64_t hash, char * const *words)
+{
+	uint64_t nwords;
+
+	for (nwords = 0; words != NULL && words[nwords] != NULL; nwords++)
+		continue;
+
+	for (size_t byte = 0; byte < sizeof(nwords); byte++) {
+		hash ^= (nwords >> (byte * 8)) & 0xff;
+		hash *= 0x100000001b3ULL;
+	}
+
+	for (uint64_t word = 0; word < nwords; word++) {
+		for (const char *p = words[word]; ; p++) {
+			hash ^= (unsigned char)*p;
+			hash *= 0x100000001b3ULL;
+			if (*p == '\0')
+				break;
+		}
+	}
+
+	return (hash);
+}
+
+
+/*
+ * Compare two paths under the same root in walk order: component by
+ * component, the same way as hbsdcontrol_bulk_compar() orders the
+ * entries of a directory, with the directories preceding their content.
+ */
+int
+hbsdcontrol_path_cmp(const char *a, const char *b, bool *ancestor)
+{
+	size_t alen, blen;
+	bool dummy;
+	int cmp;
+
+	if (ancestor == NULL)
+		ancestor = &dummy;
+	*ancestor = false;
+
+	for (;;) {
+		while (*a == '/')
+			a++;
+		while (*b == '/')
+			b++;
+
+		if (*a == '\0' && *b == '\0')
+			return (0);
+		if (*a == '\0') {
+			*ancestor = true;
+			return (-1);
+		}
+		if (*b == '\0')
+			return (1);
+
+		alen = strcspn(a, "/");
+		blen = strcspn(b, "/");
+		cmp = memcmp(a, b, MIN(alen, blen));
+		if (cmp == 0 && alen != blen)
+			cmp = alen < blen ? -1 : 1;
+		if (cmp != 0)
+			return (cmp);
+
+		a += alen;
+		b += blen;
+	}
+}
+
+
+/*
+ * Returns true, when the entry was completed by the resumed run.
+ * The completed directories are pruned, so their content is not even
+ * read again.
+ */
+static bool
+hbsdcontrol_bulk_resume_skip(FTS *fts, FTSENT *ent, int root, const struct hbsdcontrol_bulk_cursor *cursor)
+{
+	bool ancestor;
+	int cmp;
+
+	if (root > cursor->root)
+		return (false);
+
+	ancestor = false;
+
+	if (root < cursor->root)
+		cmp = -1;
+	else
+		cmp = hbsdcontrol_path_cmp(ent->fts_path, cursor->path, &ancestor);
+
+	if (cmp > 0)
+		return (false);
+
+	if (ent->fts_info == FTS_D) {
+		if (cmp < 0 && ancestor)
+			return (true);
+		fts_set(fts, ent, FTS_SKIP);
+	}
+
+	return (true);
+}
+
+
+/*
+ * Sort the directory entries by name, so the walk order, and the order
+ * of the batches, is the same on every run.
+ */
+static int
+hbsdcontrol_bulk_compar(const FTSENT * const *a, const FTSENT * const *b)
+{
+
+	return (strcmp((*a)->fts_name, (*b)->fts_name));
+}
+
+
+static int
+hbsdcontrol_bulk_walk(struct hbsdcontrol_bulk *bulk, char * const *paths,
+    size_t batch_size, const struct hbsdcontrol_bulk_cursor *resume)
+{
+	struct hbsdcontrol_bulk_batch *batch;
+	struct hbsdcontrol_bulk_entry *entry;
+	FTSENT *ent;
+	FTS *fts;
+	bool recursive;
+	bool resuming;
+	size_t pathlen;
+	dev_t dev;
+	int options;
+	int error;
+	int root;
+
+	recursive = (bulk->args->flags & HBSDCONTROL_BULK_RECURSIVE) != 0;
+	resuming = resume != NULL;
+	batch = NULL;
+	error = 0;
+	root = -1;
+	dev = 0;
+
+	options = FTS_PHYSICAL | FTS_NOCHDIR;
+	if (bulk->args->flags & HBSDCONTROL_BULK_XDEV)
+		options |= FTS_XDEV;
+
+	fts = fts_open(paths, options, hbsdcontrol_bulk_compar);
+	if (fts == NULL)
+		return (errno);
+
+	while ((ent = fts_read(fts)) != NULL) {
+		if (ent->fts_level == FTS_ROOTLEVEL && ent->fts_info != FTS_DP) {
+			root++;
+			/* A batch never spans two operands. */
+			if (batch != NULL && batch->nentries > 0) {
+				if (!hbsdcontrol_bulk_submit(bulk, batch)) {
+					batch = NULL;
+					break;
+				}
+				batch = NULL;
+			}
+		}
+
+		if (resuming && ent->fts_info != FTS_DP) {
+			if (hbsdcontrol_bulk_resume_skip(fts, ent, root, resume))
+				continue;
+			resuming = false;
+		}
+
+		switch (ent->fts_info) {
+		case FTS_D:
+			/*
+			 * Directories are only operands on their own, when
+			 * the walk is not recursive.
+			 */
+			if (recursive)
+				continue;
+			fts_set(fts, ent, FTS_SKIP);
+			break;
+		case FTS_DP:
+			continue;
+		case FTS_F:
+			break;
+		case FTS_DNR:
+		case FTS_ERR:
+		case FTS_NS:
+			break;
+		default:
+			/* Do not follow the symlinks found during the walk. */
+			if (ent->fts_level != FTS_ROOTLEVEL)
+				continue;
+			break;
+		}
+
+		/* The files which can not be stat'ed stay with their siblings. */
+		if (ent->fts_info != FTS_DNR && ent->fts_info != FTS_ERR &&
+		    ent->fts_info != FTS_NS)
+			dev = ent->fts_statp->st_dev;
+
+		/* The paths of a batch are kept in its first chunk. */
+		pathlen = ent->fts_pathlen + 1;
+		if (batch != NULL && (batch->dev != dev ||
+		    batch->chunk->size - batch->chunk->used < pathlen)) {
+			if (!hbsdcontrol_bulk_submit(bulk, batch)) {
+				batch = NULL;
+				break;
+			}
+			batch = NULL;
+		}
+
+		if (batch == NULL) {
+			batch = hbsdcontrol_bulk_get_batch(bulk);
+			if (batch == NULL) {
+				error = ENOMEM;
+				break;
+			}
+			batch->root = root;
+			batch->dev = dev;
+		}
+
+		entry = &batch->entries[batch->nentries];
+		entry->index = batch->nentries;
+		entry->batch = batch;
+		entry->path = hbsdcontrol_bulk_arena_alloc(batch, pathlen, 1);
+		if (entry->path == NULL) {
+			error = ENOMEM;
+			break;
+		}
+		memcpy(entry->path, ent->fts_path, pathlen);
+		batch->nentries++;
+
+		if (ent->fts_info == FTS_DNR || ent->fts_info == FTS_ERR ||
+		    ent->fts_info == FTS_NS)
+			entry->error = ent->fts_errno;
+		else
+			entry->st = *ent->fts_statp;
+
+		if (batch->nentries == batch_size) {
+			if (!hbsdcontrol_bulk_submit(bulk, batch)) {
+				batch = NULL;
+				break;
+			}
+			batch = NULL;
+		}
+	}
+
+	if (error == 0 && ent == NULL && errno != 0)
+		error = errno;
+
+	if (batch != NULL) {
+		if (error == 0 && batch->nentries > 0)
+			hbsdcontrol_bulk_submit(bulk, batch);
+		else
+			hbsdcontrol_bulk_release_batch(bulk, batch);
+	}
+
+	fts_close(fts);
+
+	return (error);
+}
+
+
+int
+hbsdcontrol_bulk_run(const struct hbsdcontrol_bulk_args *args, char * const *paths)
+{
+	struct hbsdcontrol_bulk_cursor resume;
+	struct hbsdcontrol_bulk bulk;
+	struct hbsdcontrol_bulk_shard *shard;
+	struct hbsdcontrol_bulk_batch *batch;
+	unsigned int nworkers;
+	size_t batch_size;
+	int error;
+
+	assert(args != NULL && args->fn != NULL);
+
+	if (paths == NULL || paths[0] == NULL)
+		return (EINVAL);
+
+	nworkers = args->nworkers;
+	if (nworkers == 0)
+		nworkers = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+
+	batch_size = args->batch_size;
+	if (batch_size == 0)
+		batch_size = HBSDCONTROL_BULK_BATCH_SIZE;
+
+	memset(&bulk, 0, sizeof(bulk));
+	memset(&resume, 0, sizeof(resume));
+	bulk.args = args;
+	bulk.nworkers = nworkers;
+	bulk.remote_nworkers = args->remote_nworkers;
+	if (bulk.remote_nworkers == 0)
+		bulk.remote_nworkers = HBSDCONTROL_BULK_REMOTE_WORKERS;
+	bulk.batch_size = batch_size;
+	bulk.maxbytes = args->maxbytes;
+	STAILQ_INIT(&bulk.batches);
+
+	if (args->state != NULL) {
+		bulk.cursor.hash = hbsdcontrol_bulk_hash_words(0xcbf29ce484222325ULL,
+		    args->command);
+		bulk.cursor.hash = hbsdcontrol_bulk_hash_words(bulk.cursor.hash, paths);
+		bulk.interval = args->checkpoint_interval;
+		if (bulk.interval == 0)
+			bulk.interval = HBSDCONTROL_BULK_CHECKPOINT_INTERVAL;
+
+		if (args->flags & HBSDCONTROL_BULK_RESUME) {
+			error = hbsdcontrol_bulk_load_cursor(args->state, &resume);
+			if (error == 0 && resume.hash != bulk.cursor.hash)
+				error = EINVAL;
+			if (error) {
+				free(resume.path);
+				return (error);
+			}
+			bulk.cursor.root = resume.root;
+			bulk.cursor.path = strdup(resume.path);
+		}
+
+		/* Enough slots for every batch, which can be in flight. */
+		bulk.nslots = nworkers * 3 * HBSDCONTROL_BULK_MAX_SHARDS;
+		bulk.slots = calloc(bulk.nslots, sizeof(*bulk.slots));
+		if (bulk.slots == NULL) {
+			free(resume.path);
+			free(bulk.cursor.path);
+			return (ENOMEM);
+		}
+	}
+
+	pthread_mutex_init(&bulk.mtx, NULL);
+	pthread_mutex_init(&bulk.checkpoint_mtx, NULL);
+	pthread_cond_init(&bulk.cv_space, NULL);
+	pthread_cond_init(&bulk.cv_emit, NULL);
+
+	/* The workers are started by the walker, for each file system. */
+	error = hbsdcontrol_bulk_walk(&bulk, paths, batch_size,
+	    resume.path != NULL ? &resume : NULL);
+
+	pthread_mutex_lock(&bulk.mtx);
+	bulk.done = true;
+	for (unsigned int idx = 0; idx < bulk.nshards; idx++)
+		pthread_cond_broadcast(&bulk.shards[idx].cv_work);
+	pthread_mutex_unlock(&bulk.mtx);
+
+	for (unsigned int idx = 0; idx < bulk.nshards; idx++) {
+		shard = &bulk.shards[idx];
+		for (unsigned int worker = 0; worker < shard->nworkers; worker++)
+			pthread_join(shard->workers[worker], NULL);
+		pthread_cond_destroy(&shard->cv_work);
+		free(shard->workers);
+	}
+
+	while ((batch = STAILQ_FIRST(&bulk.batches)) != NULL) {
+		STAILQ_REMOVE_HEAD(&bulk.batches, link);
+		hbsdcontrol_bulk_free_batch(batch);
+	}
+
+	if (bulk.error == 0)
+		bulk.error = error;
+
+	/* A finished run does not need its state anymore. */
+	if (args->state != NULL) {
+		if (bulk.error == 0)
+			unlink(args->state);
+		else
+			hbsdcontrol_bulk_checkpoint(&bulk);
+
+		for (unsigned int slot = 0; slot < bulk.nslots; slot++)
+			free(bulk.slots[slot].path);
+		free(bulk.slots);
+		free(bulk.cursor.path);
+		free(resume.path);
+	}
+
+	pthread_cond_destroy(&bulk.cv_emit);
+	pthread_cond_destroy(&bulk.cv_space);
+	pthread_mutex_destroy(&bulk.checkpoint_mtx);
+	pthread_mutex_destroy(&bulk.mtx);
+
+	return (bulk.error);
+}
+
+
+static int
+hbsdcontrol_bulk_attr_val(pax_state_word_t code)
+{
+
+	switch (code) {
+	case PAX_ATTR_ZERO:
+		return (0);
+	case PAX_ATTR_ONE:
+		return (1);
+	case PAX_ATTR_INVALID:
+		return (HBSDCONTROL_ATTR_INVALID);
+	}
+
+	return (HBSDCONTROL_ATTR_ABSENT);
+}
+
+/*
+ * Read the state word of an open file like hbsdcontrol_get_state_word_fd(),
+ * and whether the file has a flags attribute, so a write which leaves
+ * the word 0 removes it only when it is there.  With maskonly, only the
+ * present attributes are listed, with PAX_ATTR_INVALID in their place.
+ */
+static int
+hbsdcontrol_bulk_read_state(int fd, bool maskonly, pax_state_word_t *word,
+    bool *flags)
+{
+	pax_state_word_t mask;
+	int error;
+
+	if (!maskonly && hbsdcontrol_get_flags_mode() == HBSDCONTROL_FLAGS_SYNC) {
+		error = hbsdcontrol_get_flags_fd(fd, word);
+		if (error == 0)
+			*flags = true;
+		if (error != ENOATTR && error != EFTYPE)
+			return (error);
+	}
+
+	error = hbsdcontrol_get_attr_mask_fd(fd, &mask, flags);
+	if (error)
+		return (error);
+	if (maskonly) {
+		*word = mask;
+		return (0);
+	}
+
+	return (hbsdcontrol_get_masked_state_word_fd(fd, mask, word));
+}
+
+/*
+ * Write the attributes selected by mask to their value in word, in the
+ * state word format, on each entry, through a single open file
+ * descriptor per file.  The current state is read first, and only the
+ * attributes which differ are written, so a file which already matches
+ * costs no write.  With a journal, the changes of the whole batch are
+ * logged and committed before the first write.  When fds is not NULL,
+ * the files are accessed through the descriptors in it, which are left
+ * open, instead of their path.
+ */
+int
+hbsdcontrol_bulk_write_state(struct hbsdcontrol_journal *journal,
+    struct hbsdcontrol_bulk_entry *entries, const int *fds, size_t nentries,
+    pax_state_word_t mask, pax_state_word_t word)
+{
+	const char *attrname;
+	pax_state_word_t *dirty;
+	pax_state_word_t *next;
+	pax_state_word_t cur;
+	pax_state_word_t code;
+	pax_state_word_t flags;
+	uint64_t lsn;
+	bool *hasflags;
+	bool reset;
+	int *fdv;
+	int error;
+
+	mask &= PAX_STATE_MASK;
+	word &= mask;
+	/* Removing every attribute only needs to know which are present. */
+	reset = mask == PAX_STATE_MASK && word == 0;
+
+	fdv = calloc(nentries, sizeof(*fdv));
+	dirty = calloc(nentries, sizeof(*dirty));
+	next = calloc(nentries, sizeof(*next));
+	hasflags = calloc(nentries, sizeof(*hasflags));
+	if (fdv == NULL || dirty == NULL || next == NULL || hasflags == NULL) {
+		free(fdv);
+		free(dirty);
+		free(next);
+		free(hasflags);
+		return (ENOMEM);
+	}
+
+	for (size_t entry = 0; entry < nentries; entry++)
+		fdv[entry] = -1;
+
+	lsn = 0;
+	error = 0;
+	for (size_t entry = 0; entry < nentries; entry++) {
+		if (entries[entry].error)
+			continue;
+
+		if (fds != NULL)
+			fdv[entry] = fds[entry];
+		else
+			fdv[entry] = open(entries[entry].path,
+			    O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		if (fdv[entry] == -1) {
+			entries[entry].error = errno;
+			continue;
+		}
+
+		entries[entry].error = hbsdcontrol_bulk_read_state(fdv[entry],
+		    reset && journal == NULL, &cur, &hasflags[entry]);
+		if (entries[entry].error)
+			continue;
+
+		dirty[entry] = (cur ^ word) & mask;
+		next[entry] = (cur & ~mask) | word;
+		if (journal == NULL || dirty[entry] == 0)
+			continue;
+
+		for (int feature = 0; feature < HBSDCONTROL_NFEATURES; feature++) {
+			for (pax_feature_state_t attr = 0; attr < 2; attr++) {
+				if (PAX_STATE_ATTR(dirty[entry], feature, attr) == 0)
+					continue;
+
+				attrname = pax_features[feature].extattr[attr];
+				error = hbsdcontrol_journal_log(journal, entries[entry].path,
+				    attrname,
+				    hbsdcontrol_bulk_attr_val(PAX_STATE_ATTR(cur, feature, attr)),
+				    hbsdcontrol_bulk_attr_val(PAX_STATE_ATTR(word, feature, attr)),
+				    &lsn);
+				if (error)
+					goto fail;
+			}
+		}
+	}
+
+	/* Nothing is written, until the batch's records are durable. */
+	if (journal != NULL && lsn != 0) {
+		error = hbsdcontrol_journal_commit(journal, lsn);
+		if (error)
+			goto fail;
+	}
+
+	for (size_t entry = 0; entry < nentries; entry++) {
+		if (entries[entry].error ||
+		    (dirty[entry] == 0 && !(reset && hasflags[entry])))
+			continue;
+
+		for (int feature = 0; feature < HBSDCONTROL_NFEATURES; feature++) {
+			for (pax_feature_state_t attr = 0; attr < 2; attr++) {
+				if (PAX_STATE_ATTR(dirty[entry], feature, attr) == 0)
+					continue;
+
+				attrname = pax_features[feature].extattr[attr];
+				code = PAX_STATE_ATTR(word, feature, attr);
+
+				if (hbsdcontrol_get_debug())
+					printf("%s:\t%s %s on %s\n", __func__, attrname,
+					    code == PAX_ATTR_ABSENT ? "reset" : "set",
+					    entries[entry].path);
+
+				if (code == PAX_ATTR_ABSENT) {
+					error = hbsdcontrol_extattr_rm_attr_fd(fdv[entry], attrname);
+					if (error == ENOATTR)
+						error = 0;
+				} else
+					error = hbsdcontrol_extattr_set_attr_fd(fdv[entry], attrname,
+					    hbsdcontrol_bulk_attr_val(code));
+				if (error) {
+					entries[entry].error = error;
+					break;
+				}
+			}
+			if (entries[entry].error)
+				break;
+		}
+
+		/*
+		 * A partial write leaves the flags attribute stale, without it
+		 * the readers fall back to the per-feature attributes.
+		 */
+		if (entries[entry].error) {
+			if (hasflags[entry])
+				(void)hbsdcontrol_set_flags_fd(fdv[entry], 0);
+			continue;
+		}
+
+		/*
+		 * Refresh the flags attribute, or remove it outside of the
+		 * HBSDCONTROL_FLAGS_SYNC mode, see hbsdcontrol_flags_sync().
+		 * It is not listed in the mask of a reset, which removes it,
+		 * when it is present.
+		 */
+		flags = hbsdcontrol_get_flags_mode() == HBSDCONTROL_FLAGS_SYNC ?
+		    next[entry] : 0;
+		if (flags != 0 || hasflags[entry])
+			entries[entry].error = hbsdcontrol_set_flags_fd(fdv[entry], flags);
+	}
+
+	error = 0;
+	for (size_t entry = 0; entry < nentries && error == 0; entry++)
+		error = entries[entry].error;
+	goto out;
+
+fail:
+	/* The journal failed, so none of the files was written. */
+	for (size_t entry = 0; entry < nentries; entry++)
+		if (entries[entry].error == 0)
+			entries[entry].error = error;
+out:
+	for (size_t entry = 0; entry < nentries && fds == NULL; entry++)
+		if (fdv[entry] != -1)
+			close(fdv[entry]);
+	free(fdv);
+	free(dirty);
+	free(next);
+	free(hasflags);
+
+	return (error);
+}
+
+static int
+hbsdcontrol_bulk_write_feature(struct hbsdcontrol_journal *journal,
+    struct hbsdcontrol_bulk_entry *entries, const int *fds, size_t nentries,
+    const char *feature, pax_feature_state_t state)
+{
+	pax_state_word_t mask;
+	pax_state_word_t word;
+	int feature_idx;
+
+	feature_idx = hbsdcontrol_feature_index(feature);
+	if (feature_idx < 0)
+		return (EINVAL);
+
+	mask = (pax_state_word_t)PAX_ATTR_INVALID << PAX_STATE_SHIFT(feature_idx, disable) |
+	    (pax_state_word_t)PAX_ATTR_INVALID << PAX_STATE_SHIFT(feature_idx, enable);
+
+	if (state == sysdef)
+		word = 0;
+	else if (state == enable || state == disable)
+		word = (pax_state_word_t)(state ? PAX_ATTR_ZERO : PAX_ATTR_ONE) <<
+		    PAX_STATE_SHIFT(feature_idx, disable) |
+		    (pax_state_word_t)(state ? PAX_ATTR_ONE : PAX_ATTR_ZERO) <<
+		    PAX_STATE_SHIFT(feature_idx, enable);
+	else
+		return (EINVAL);
+
+	return (hbsdcontrol_bulk_write_state(journal, entries, fds, nentries, mask, word));
+}
+
+/*
+ * Set the feature state on each entry, the sysdef state removes
+ * the feature's attributes.
+ */
+int
+hbsdcontrol_bulk_set_feature_state(struct hbsdcontrol_journal *journal,
+    struct hbsdcontrol_bulk_entry *entries, size_t nentries,
+    const char *feature, pax_feature_state_t state)
+{
+
+	return (hbsdcontrol_bulk_write_feature(journal, entries, NULL, nentries,
+	    feature, state));
+}
+
+/*
+ * Set the feature state on the file open on fd, file is only used in
+ * the debug messages.
+ */
+int
+hbsdcontrol_set_feature_state_fd(const char *file, int fd, const char *feature,
+    pax_feature_state_t state)
+{
+	struct hbsdcontrol_bulk_entry entry;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.path = __DECONST(char *, file);
+
+	return (hbsdcontrol_bulk_write_feature(NULL, &entry, &fd, 1, feature, state));
+}
+
+/*
+ * Remove every pax attribute of each entry.  Without a journal, only
+ * the list of the present attributes is read.
+ */
+int
+hbsdcontrol_bulk_reset_all(struct hbsdcontrol_journal *journal,
+    struct hbsdcontrol_bulk_entry *entries, size_t nentries)
+{
+
+	return (hbsdcontrol_bulk_write_state(journal, entries, NULL, nentries, PAX_STATE_MASK, 0));
+}
+
+/*
+ * Write the flags attribute of each entry from its per-feature
+ * attributes, or remove it.  The flags attribute is not journaled, it
+ * is derived from the journaled attributes.
+ */
+int
+hbsdcontrol_bulk_migrate_flags(struct hbsdcontrol_bulk_entry *entries, size_t nentries,
+    bool remove)
+{
+	pax_state_word_t word;
+	int error;
+	int fd;
+
+	error = 0;
+	for (size_t entry = 0; entry < nentries; entry++) {
+		if (entries[entry].error == 0) {
+			fd = open(entries[entry].path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+			if (fd == -1)
+				entries[entry].error = errno;
+			else {
+				word = 0;
+				if (!remove)
+					entries[entry].error =
+					    hbsdcontrol_get_legacy_state_word_fd(fd, &word);
+				if (entries[entry].error == 0)
+					entries[entry].error = hbsdcontrol_set_flags_fd(fd, word);
+				close(fd);
+			}
+		}
+
+		if (entries[entry].error && error == 0)
+			error = entries[entry].error;
+	}
+
+	return (error);
+}
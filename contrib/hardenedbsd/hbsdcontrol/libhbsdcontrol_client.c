@@ -0,0 +1,344 @@
+/*-
+ * Copyright (c) 2015-2018 Oliver Pinter <oliver.pinter@HardenedBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#include <sys/param.h>
+#include <sys/sbuf.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+
+#include "libhbsdcontrol.h"
+
+/*
+ * Maximum number of requests in flight before the client starts to
+ * collect the responses.  This keeps both side's socket buffers from
+ * filling up with an unbounded pipeline.
+ */
+#define	HBSDCONTROL_CLIENT_WINDOW	64
+
+struct hbsdcontrol_client {
+	int		fd;
+	uint32_t	seq;
+};
+
+static int hbsdcontrol_client_send(struct hbsdcontrol_client *client, struct hbsdcontrol_request *reqs, size_t nreqs);
+static int hbsdcontrol_client_recv(struct hbsdcontrol_client *client, struct hbsdcontrol_request *reqs, size_t nreqs, uint32_t seq);
+static int hbsdcontrol_client_write(int fd, const char *buf, size_t len);
+static int hbsdcontrol_client_read(int fd, char *buf, size_t len);
+
+
+int
+hbsdcontrol_client_open(const char *path, struct hbsdcontrol_client **client)
+{
+	struct sockaddr_un sun;
+	int error;
+
+	if (client == NULL)
+		return (EINVAL);
+
+	if (path == NULL)
+		path = HBSDCONTROL_SOCKET_PATH;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >= sizeof(sun.sun_path))
+		return (ENAMETOOLONG);
+
+	*client = calloc(1, sizeof(**client));
+	if (*client == NULL)
+		return (ENOMEM);
+
+	(*client)->fd = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if ((*client)->fd == -1) {
+		error = errno;
+		free(*client);
+		*client = NULL;
+		return (error);
+	}
+
+	if (connect((*client)->fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		error = errno;
+		hbsdcontrol_client_close(client);
+		return (error);
+	}
+
+	return (0);
+}
+
+
+void
+hbsdcontrol_client_close(struct hbsdcontrol_client **client)
+{
+
+	if (*client == NULL)
+		return;
+
+	close((*client)->fd);
+	free(*client);
+	*client = NULL;
+}
+
+
+/*
+ * Send the requests in pipelined windows, and collect the responses
+ * in the order of the requests.  The per request status is returned
+ * in reqs[].error, the return value only signals transport errors.
+ */
+int
+hbsdcontrol_client_batch(struct hbsdcontrol_client *client, struct hbsdcontrol_request *reqs, size_t nreqs)
+{
+	size_t first, n;
+	uint32_t seq;
+	int error;
+
+	for (first = 0; first < nreqs; first += n) {
+		n = MIN(nreqs - first, HBSDCONTROL_CLIENT_WINDOW);
+
+		seq = client->seq;
+		error = hbsdcontrol_client_send(client, &reqs[first], n);
+		if (error)
+			return (error);
+
+		error = hbsdcontrol_client_recv(client, &reqs[first], n, seq);
+		if (error)
+			return (error);
+	}
+
+	return (0);
+}
+
+
+void
+hbsdcontrol_client_free_results(struct hbsdcontrol_request *reqs, size_t nreqs)
+{
+
+	for (size_t req = 0; req < nreqs; req++) {
+		free(reqs[req].result);
+		reqs[req].result = NULL;
+	}
+}
+
+
+int
+hbsdcontrol_client_list_features(struct hbsdcontrol_client *client, const char *file, char **features)
+{
+	struct hbsdcontrol_request req;
+	int error;
+
+	memset(&req, 0, sizeof(req));
+	req.op = HBSDCONTROL_OP_LIST;
+	req.file = file;
+
+	error = hbsdcontrol_client_batch(client, &req, 1);
+	if (error == 0)
+		error = req.error;
+
+	if (error == 0) {
+		*features = req.result;
+		req.result = NULL;
+	}
+	hbsdcontrol_client_free_results(&req, 1);
+
+	return (error);
+}
+
+
+int
+hbsdcontrol_client_set_feature_state(struct hbsdcontrol_client *client, const char *file, const char *feature, pax_feature_state_t state)
+{
+	struct hbsdcontrol_request req;
+	int error;
+
+	memset(&req, 0, sizeof(req));
+	req.op = HBSDCONTROL_OP_SET;
+	req.file = file;
+	req.feature = feature;
+	req.state = state;
+
+	error = hbsdcontrol_client_batch(client, &req, 1);
+	hbsdcontrol_client_free_results(&req, 1);
+
+	return (error ? error : req.error);
+}
+
+
+int
+hbsdcontrol_client_rm_feature_state(struct hbsdcontrol_client *client, const char *file, const char *feature)
+{
+	struct hbsdcontrol_request req;
+	int error;
+
+	memset(&req, 0, sizeof(req));
+	req.op = HBSDCONTROL_OP_RESET;
+	req.file = file;
+	req.feature = feature;
+
+	error = hbsdcontrol_client_batch(client, &req, 1);
+	hbsdcontrol_client_free_results(&req, 1);
+
+	return (error ? error : req.error);
+}
+
+
+static int
+hbsdcontrol_client_send(struct hbsdcontrol_client *client, struct hbsdcontrol_request *reqs, size_t nreqs)
+{
+	struct hbsdcontrol_msg_hdr hdr;
+	struct sbuf *msg;
+	size_t len;
+	int error;
+
+	msg = sbuf_new_auto();
+	if (msg == NULL)
+		return (ENOMEM);
+
+	error = 0;
+	for (size_t req = 0; req < nreqs; req++) {
+		/* The service reads the first string as the file. */
+		if (reqs[req].file == NULL && reqs[req].feature != NULL) {
+			error = EINVAL;
+			goto out;
+		}
+
+		len = 0;
+		if (reqs[req].file != NULL)
+			len += strlen(reqs[req].file) + 1;
+		if (reqs[req].feature != NULL)
+			len += strlen(reqs[req].feature) + 1;
+		if (len > HBSDCONTROL_MSG_MAX) {
+			error = ENAMETOOLONG;
+			goto out;
+		}
+
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.hm_len = len;
+		hdr.hm_seq = client->seq++;
+		hdr.hm_op = reqs[req].op;
+		hdr.hm_arg = reqs[req].state;
+
+		sbuf_bcat(msg, &hdr, sizeof(hdr));
+		if (reqs[req].file != NULL)
+			sbuf_bcat(msg, reqs[req].file, strlen(reqs[req].file) + 1);
+		if (reqs[req].feature != NULL)
+			sbuf_bcat(msg, reqs[req].feature, strlen(reqs[req].feature) + 1);
+	}
+
+	if (sbuf_finish(msg) != 0) {
+		error = ENOMEM;
+		goto out;
+	}
+
+	error = hbsdcontrol_client_write(client->fd, sbuf_data(msg), sbuf_len(msg));
+
+out:
+	sbuf_delete(msg);
+
+	return (error);
+}
+
+
+static int
+hbsdcontrol_client_recv(struct hbsdcontrol_client *client, struct hbsdcontrol_request *reqs, size_t nreqs, uint32_t seq)
+{
+	struct hbsdcontrol_msg_hdr hdr;
+	int error;
+
+	for (size_t req = 0; req < nreqs; req++, seq++) {
+		error = hbsdcontrol_client_read(client->fd, (char *)&hdr, sizeof(hdr));
+		if (error)
+			return (error);
+
+		if (hdr.hm_seq != seq || hdr.hm_len > HBSDCONTROL_MSG_MAX)
+			return (EPROTO);
+
+		reqs[req].error = hdr.hm_arg;
+		reqs[req].result = NULL;
+		if (hdr.hm_len == 0)
+			continue;
+
+		reqs[req].result = calloc(sizeof(char), hdr.hm_len + 1);
+		if (reqs[req].result == NULL)
+			return (ENOMEM);
+
+		error = hbsdcontrol_client_read(client->fd, reqs[req].result, hdr.hm_len);
+		if (error)
+			return (error);
+	}
+
+	return (0);
+}
+
+
+static int
+hbsdcontrol_client_write(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		/* A server which went away fails with EPIPE, without a SIGPIPE. */
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return (errno);
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return (0);
+}
+
+
+static int
+hbsdcontrol_client_read(int fd, char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return (errno);
+		}
+		if (n == 0)
+			return (ECONNRESET);
+		buf += n;
+		len -= n;
+	}
+
+	return (0);
+}
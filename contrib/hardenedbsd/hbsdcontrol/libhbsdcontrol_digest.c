@@ -0,0 +1,618 @@
+/*-
+ * Copyright (c) 2015-2018 Oliver Pinter <oliver.pinter@HardenedBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sha256.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+
+#include "libhbsdcontrol.h"
+
+/*
+ * The files are hashed with pread(2) into a buffer, a file truncated
+ * under a mapping would raise SIGBUS.
+ */
+#define	HBSDCONTROL_DIGEST_BUFSIZE	(128 * 1024)
+
+/*
+ * The digest cache is an open addressing hash table keyed by (dev, ino),
+ * an entry is only valid, when the mtime, the ctime and the size also
+ * match.  On disk, it is a text file with one line per entry:
+ *
+ *	dev ino mtime.nsec ctime.nsec size digest
+ *
+ * The v1 caches, without the ctime, are dropped.
+ */
+#define	HBSDCONTROL_DIGEST_CACHE_MAGIC	"#hbsdcontrol digests v2\n"
+#define	HBSDCONTROL_DIGEST_CACHE_MAGIC_V1	"#hbsdcontrol digests v1\n"
+#define	HBSDCONTROL_DIGEST_CACHE_INITIAL	4096
+
+struct hbsdcontrol_digest_entry {
+	bool		used;
+	dev_t		dev;
+	ino_t		ino;
+	struct timespec	mtime;
+	struct timespec	ctime;
+	off_t		size;
+	uint8_t		digest[HBSDCONTROL_DIGEST_LEN];
+};
+
+struct hbsdcontrol_digest_cache {
+	pthread_mutex_t			 mtx;
+	char				*path;
+	bool				 dirty;
+	struct hbsdcontrol_digest_entry	*table;
+	size_t				 size;
+	size_t				 count;
+};
+
+struct hbsdcontrol_rule {
+	uint8_t				digest[HBSDCONTROL_DIGEST_LEN];
+	struct hbsdcontrol_profile	profile;
+};
+
+struct hbsdcontrol_rules {
+	struct hbsdcontrol_rule	*rules;
+	size_t			 nrules;
+};
+
+static int hbsdcontrol_digest_read(int fd, uint8_t *digest);
+static bool hbsdcontrol_digest_same(const struct stat *a, const struct stat *b);
+static struct hbsdcontrol_digest_entry *hbsdcontrol_digest_cache_slot(struct hbsdcontrol_digest_entry *table, size_t size, dev_t dev, ino_t ino);
+static int hbsdcontrol_digest_cache_grow(struct hbsdcontrol_digest_cache *cache);
+static void hbsdcontrol_digest_cache_insert(struct hbsdcontrol_digest_cache *cache, const struct stat *st, const uint8_t *digest);
+static int hbsdcontrol_digest_cache_load(struct hbsdcontrol_digest_cache *cache, FILE *fp);
+static int hbsdcontrol_rule_cmp(const void *a, const void *b);
+
+int
+hbsdcontrol_digest_parse(const char *hex, uint8_t *digest)
+{
+	unsigned int byte;
+
+	for (int i = 0; i < HBSDCONTROL_DIGEST_LEN; i++) {
+		if (sscanf(&hex[i * 2], "%2x", &byte) != 1)
+			return (EINVAL);
+		digest[i] = byte;
+	}
+
+	return (hex[HBSDCONTROL_DIGEST_LEN * 2] == '\0' ? 0 : EINVAL);
+}
+
+void
+hbsdcontrol_digest_format(const uint8_t *digest, char *hex)
+{
+	static const char digits[] = "0123456789abcdef";
+
+	for (int i = 0; i < HBSDCONTROL_DIGEST_LEN; i++) {
+		hex[i * 2] = digits[digest[i] >> 4];
+		hex[i * 2 + 1] = digits[digest[i] & 0xf];
+	}
+	hex[HBSDCONTROL_DIGEST_LEN * 2] = '\0';
+}
+
+static int
+hbsdcontrol_digest_read(int fd, uint8_t *digest)
+{
+	SHA256_CTX ctx;
+	uint8_t *buf;
+	ssize_t len;
+	off_t off;
+	int error;
+
+	buf = malloc(HBSDCONTROL_DIGEST_BUFSIZE);
+	if (buf == NULL)
+		return (ENOMEM);
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	SHA256_Init(&ctx);
+
+	error = 0;
+	for (off = 0;; off += len) {
+		len = pread(fd, buf, HBSDCONTROL_DIGEST_BUFSIZE, off);
+		if (len == -1 && errno == EINTR) {
+			len = 0;
+			continue;
+		}
+		if (len == -1)
+			error = errno;
+		if (len <= 0)
+			break;
+		SHA256_Update(&ctx, buf, len);
+	}
+
+	free(buf);
+	if (error == 0)
+		SHA256_Final(digest, &ctx);
+
+	return (error);
+}
+
+static bool
+hbsdcontrol_digest_same(const struct stat *a, const struct stat *b)
+{
+
+	return (a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+	    a->st_size == b->st_size &&
+	    a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+	    a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+	    a->st_ctim.tv_sec == b->st_ctim.tv_sec &&
+	    a->st_ctim.tv_nsec == b->st_ctim.tv_nsec);
+}
+
+/*
+ * Hash the regular file open on fd with SHA-256.  When cache is not
+ * NULL, the digest is taken from, or stored in it, keyed by the fstat(2)
+ * of fd, so the digest is always the one of the file behind fd.  A file
+ * which changed while it was read is not cached.
+ */
+int
+hbsdcontrol_digest_fd(struct hbsdcontrol_digest_cache *cache, int fd,
+    uint8_t *digest)
+{
+	struct stat before;
+	struct stat after;
+	int error;
+
+	if (fstat(fd, &before) == -1)
+		return (errno);
+	if (!S_ISREG(before.st_mode))
+		return (EFTYPE);
+
+	if (cache != NULL && hbsdcontrol_digest_cache_lookup(cache, &before, digest))
+		return (0);
+
+	error = hbsdcontrol_digest_read(fd, digest);
+	if (error)
+		return (error);
+
+	if (cache != NULL && fstat(fd, &after) == 0 &&
+	    hbsdcontrol_digest_same(&before, &after))
+		hbsdcontrol_digest_cache_insert(cache, &before, digest);
+
+	return (0);
+}
+
+/*
+ * Hash a file with hbsdcontrol_digest_fd().  The st of a file, which
+ * is neither a regular file nor a symlink, as passed by the bulk
+ * engine, saves its open.
+ */
+int
+hbsdcontrol_digest_file(struct hbsdcontrol_digest_cache *cache, const char *file,
+    const struct stat *st, uint8_t *digest)
+{
+	int error;
+	int fd;
+
+	if (st != NULL && !S_ISREG(st->st_mode) && !S_ISLNK(st->st_mode))
+		return (EFTYPE);
+
+	fd = open(file, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1)
+		return (errno);
+
+	error = hbsdcontrol_digest_fd(cache, fd, digest);
+	close(fd);
+
+	return (error);
+}
+
+/*
+ * Open the digest cache at path, a missing file gives an empty cache.
+ * A NULL path gives a cache, which is not saved.
+ */
+int
+hbsdcontrol_digest_cache_open(const char *path, struct hbsdcontrol_digest_cache **cachep)
+{
+	struct hbsdcontrol_digest_cache *cache;
+	FILE *fp;
+	int error;
+
+	cache = calloc(1, sizeof(*cache));
+	if (cache == NULL)
+		return (ENOMEM);
+
+	cache->size = HBSDCONTROL_DIGEST_CACHE_INITIAL;
+	cache->table = calloc(cache->size, sizeof(*cache->table));
+	if (cache->table == NULL) {
+		free(cache);
+		return (ENOMEM);
+	}
+
+	error = 0;
+	if (path != NULL) {
+		cache->path = strdup(path);
+		if (cache->path == NULL)
+			error = ENOMEM;
+	}
+
+	if (error == 0 && path != NULL) {
+		fp = fopen(path, "re");
+		if (fp != NULL) {
+			error = hbsdcontrol_digest_cache_load(cache, fp);
+			fclose(fp);
+		} else if (errno != ENOENT)
+			error = errno;
+	}
+
+	if (error) {
+		free(cache->path);
+		free(cache->table);
+		free(cache);
+		return (error);
+	}
+
+	pthread_mutex_init(&cache->mtx, NULL);
+	*cachep = cache;
+
+	return (0);
+}
+
+static int
+hbsdcontrol_digest_cache_load(struct hbsdcontrol_digest_cache *cache, FILE *fp)
+{
+	struct stat st;
+	uint8_t digest[HBSDCONTROL_DIGEST_LEN];
+	char hex[HBSDCONTROL_DIGEST_LEN * 2 + 1];
+	char *line;
+	size_t linecap;
+	uintmax_t dev, ino;
+	intmax_t sec, csec, size;
+	long nsec, cnsec;
+	bool magic;
+	int error;
+
+	line = NULL;
+	linecap = 0;
+	magic = false;
+	error = 0;
+
+	while (getline(&line, &linecap, fp) > 0) {
+		if (!magic) {
+			magic = !strcmp(line, HBSDCONTROL_DIGEST_CACHE_MAGIC);
+			if (!magic && strcmp(line, HBSDCONTROL_DIGEST_CACHE_MAGIC_V1))
+				error = EFTYPE;
+			if (!magic)
+				break;
+			continue;
+		}
+
+		/* Skip the damaged lines, they are only a cache. */
+		if (sscanf(line, "%ju %ju %jd.%ld %jd.%ld %jd %64s", &dev, &ino,
+		    &sec, &nsec, &csec, &cnsec, &size, hex) != 8 ||
+		    hbsdcontrol_digest_parse(hex, digest) != 0)
+			continue;
+
+		memset(&st, 0, sizeof(st));
+		st.st_dev = dev;
+		st.st_ino = ino;
+		st.st_mtim.tv_sec = sec;
+		st.st_mtim.tv_nsec = nsec;
+		st.st_ctim.tv_sec = csec;
+		st.st_ctim.tv_nsec = cnsec;
+		st.st_size = size;
+		hbsdcontrol_digest_cache_insert(cache, &st, digest);
+	}
+
+	free(line);
+	cache->dirty = false;
+
+	return (error);
+}
+
+static struct hbsdcontrol_digest_entry *
+hbsdcontrol_digest_cache_slot(struct hbsdcontrol_digest_entry *table, size_t size,
+    dev_t dev, ino_t ino)
+{
+	size_t slot;
+	uint64_t hash;
+
+	hash = ((uint64_t)dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)ino;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+
+	for (slot = hash & (size - 1); table[slot].used; slot = (slot + 1) & (size - 1))
+		if (table[slot].dev == dev && table[slot].ino == ino)
+			break;
+
+	return (&table[slot]);
+}
+
+static int
+hbsdcontrol_digest_cache_grow(struct hbsdcontrol_digest_cache *cache)
+{
+	struct hbsdcontrol_digest_entry *table;
+	struct hbsdcontrol_digest_entry *entry;
+	size_t size;
+
+	size = cache->size * 2;
+	table = calloc(size, sizeof(*table));
+	if (table == NULL)
+		return (ENOMEM);
+
+	for (size_t slot = 0; slot < cache->size; slot++) {
+		if (!cache->table[slot].used)
+			continue;
+		entry = hbsdcontrol_digest_cache_slot(table, size,
+		    cache->table[slot].dev, cache->table[slot].ino);
+		*entry = cache->table[slot];
+	}
+
+	free(cache->table);
+	cache->table = table;
+	cache->size = size;
+
+	return (0);
+}
+
+/*
+ * Returns true, and the digest, when the file is in the cache, and it
+ * did not change since it was hashed.
+ */
+bool
+hbsdcontrol_digest_cache_lookup(struct hbsdcontrol_digest_cache *cache,
+    const struct stat *st, uint8_t *digest)
+{
+	struct hbsdcontrol_digest_entry *entry;
+	bool found;
+
+	pthread_mutex_lock(&cache->mtx);
+	entry = hbsdcontrol_digest_cache_slot(cache->table, cache->size,
+	    st->st_dev, st->st_ino);
+	found = entry->used && entry->size == st->st_size &&
+	    entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+	    entry->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+	    entry->ctime.tv_sec == st->st_ctim.tv_sec &&
+	    entry->ctime.tv_nsec == st->st_ctim.tv_nsec;
+	if (found)
+		memcpy(digest, entry->digest, HBSDCONTROL_DIGEST_LEN);
+	pthread_mutex_unlock(&cache->mtx);
+
+	return (found);
+}
+
+static void
+hbsdcontrol_digest_cache_insert(struct hbsdcontrol_digest_cache *cache,
+    const struct stat *st, const uint8_t *digest)
+{
+	struct hbsdcontrol_digest_entry *entry;
+
+	pthread_mutex_lock(&cache->mtx);
+	/* Keep the table at most half full, a failed grow only slows it down. */
+	if ((cache->count + 1) * 2 > cache->size &&
+	    hbsdcontrol_digest_cache_grow(cache) != 0 &&
+	    cache->count + 1 >= cache->size) {
+		pthread_mutex_unlock(&cache->mtx);
+		return;
+	}
+
+	entry = hbsdcontrol_digest_cache_slot(cache->table, cache->size,
+	    st->st_dev, st->st_ino);
+	if (!entry->used)
+		cache->count++;
+	entry->used = true;
+	entry->dev = st->st_dev;
+	entry->ino = st->st_ino;
+	entry->mtime = st->st_mtim;
+	entry->ctime = st->st_ctim;
+	entry->size = st->st_size;
+	memcpy(entry->digest, digest, HBSDCONTROL_DIGEST_LEN);
+	cache->dirty = true;
+	pthread_mutex_unlock(&cache->mtx);
+}
+
+/*
+ * Save the cache, when it changed, and free it.  The file is replaced
+ * with a rename, so a crash leaves the old cache in place.
+ */
+int
+hbsdcontrol_digest_cache_close(struct hbsdcontrol_digest_cache **cachep)
+{
+	struct hbsdcontrol_digest_cache *cache;
+	struct hbsdcontrol_digest_entry *entry;
+	char hex[HBSDCONTROL_DIGEST_LEN * 2 + 1];
+	char tmp[MAXPATHLEN];
+	FILE *fp;
+	int error;
+
+	cache = *cachep;
+	if (cache == NULL)
+		return (0);
+
+	error = 0;
+	if (cache->path != NULL && cache->dirty) {
+		if ((size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", cache->path) >= sizeof(tmp))
+			error = ENAMETOOLONG;
+		else if ((fp = fopen(tmp, "we")) == NULL)
+			error = errno;
+		else {
+			fprintf(fp, "%s", HBSDCONTROL_DIGEST_CACHE_MAGIC);
+			for (size_t slot = 0; slot < cache->size; slot++) {
+				entry = &cache->table[slot];
+				if (!entry->used)
+					continue;
+				hbsdcontrol_digest_format(entry->digest, hex);
+				fprintf(fp, "%ju %ju %jd.%09ld %jd.%09ld %jd %s\n",
+				    (uintmax_t)entry->dev, (uintmax_t)entry->ino,
+				    (intmax_t)entry->mtime.tv_sec, entry->mtime.tv_nsec,
+				    (intmax_t)entry->ctime.tv_sec, entry->ctime.tv_nsec,
+				    (intmax_t)entry->size, hex);
+			}
+			if (fflush(fp) != 0 || fsync(fileno(fp)) == -1)
+				error = errno;
+			if (fclose(fp) != 0 && error == 0)
+				error = errno;
+			if (error == 0 && rename(tmp, cache->path) == -1)
+				error = errno;
+			if (error)
+				unlink(tmp);
+		}
+	}
+
+	pthread_mutex_destroy(&cache->mtx);
+	free(cache->path);
+	free(cache->table);
+	free(cache);
+	*cachep = NULL;
+
+	return (error);
+}
+
+static int
+hbsdcontrol_rule_cmp(const void *a, const void *b)
+{
+
+	return (memcmp(a, b, HBSDCONTROL_DIGEST_LEN));
+}
+
+/*
+ * The rules file has one rule per line, the SHA-256 digest of the
+ * binary in hex, followed by a profile name, or by feature=state pairs,
+ * see hbsdcontrol_profile_compile():
+ *
+ *	3b2f...	jit
+ *	9a07...	mprotect=disable
+ */
+int
+hbsdcontrol_rules_load(const char *path, const char *profiles, struct hbsdcontrol_rules **rulesp)
+{
+	struct hbsdcontrol_rules *rules;
+	struct hbsdcontrol_rule *rule;
+	char *line;
+	char *hex;
+	char *spec;
+	size_t linecap;
+	size_t caprules;
+	ssize_t len;
+	FILE *fp;
+	int error;
+
+	fp = fopen(path, "re");
+	if (fp == NULL)
+		return (errno);
+
+	rules = calloc(1, sizeof(*rules));
+	if (rules == NULL) {
+		fclose(fp);
+		return (ENOMEM);
+	}
+
+	line = NULL;
+	linecap = 0;
+	caprules = 0;
+	error = 0;
+
+	while ((len = getline(&line, &linecap, fp)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+
+		spec = line;
+		hex = strsep(&spec, " \t");
+		if (*hex == '#' || *hex == '\0')
+			continue;
+		if (spec == NULL) {
+			error = EFTYPE;
+			break;
+		}
+		spec += strspn(spec, " \t");
+
+		if (rules->nrules == caprules) {
+			caprules = caprules ? caprules * 2 : 64;
+			rule = reallocarray(rules->rules, caprules, sizeof(*rule));
+			if (rule == NULL) {
+				error = ENOMEM;
+				break;
+			}
+			rules->rules = rule;
+		}
+
+		rule = &rules->rules[rules->nrules];
+		if (hbsdcontrol_digest_parse(hex, rule->digest) != 0) {
+			error = EFTYPE;
+			break;
+		}
+
+		if (strchr(spec, '=') != NULL)
+			error = hbsdcontrol_profile_compile("digest", spec, &rule->profile);
+		else
+			error = hbsdcontrol_profile_lookup(profiles, spec, &rule->profile);
+		if (error) {
+			error = EFTYPE;
+			break;
+		}
+
+		rules->nrules++;
+	}
+
+	free(line);
+	fclose(fp);
+
+	if (error) {
+		hbsdcontrol_rules_free(&rules);
+		return (error);
+	}
+
+	/* The digest is the first member of the rule. */
+	qsort(rules->rules, rules->nrules, sizeof(*rules->rules), hbsdcontrol_rule_cmp);
+	*rulesp = rules;
+
+	return (0);
+}
+
+const struct hbsdcontrol_profile *
+hbsdcontrol_rules_match(const struct hbsdcontrol_rules *rules, const uint8_t *digest)
+{
+	const struct hbsdcontrol_rule *rule;
+
+	rule = bsearch(digest, rules->rules, rules->nrules, sizeof(*rules->rules),
+	    hbsdcontrol_rule_cmp);
+
+	return (rule != NULL ? &rule->profile : NULL);
+}
+
+void
+hbsdcontrol_rules_free(struct hbsdcontrol_rules **rules)
+{
+
+	if (*rules == NULL)
+		return;
+
+	free((*rules)->rules);
+	free(*rules);
+	*rules = NULL;
+}
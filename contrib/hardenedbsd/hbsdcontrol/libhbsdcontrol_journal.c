@@ -0,0 +1,390 @@
+/*-
+ * Copyright (c) 2015-2018 Oliver Pinter <oliver.pinter@HardenedBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/sbuf.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <vis.h>
+
+#include "libhbsdcontrol.h"
+
+/*
+ * The journal is a text file, with one record per attribute change:
+ *
+ *	oldval newval attribute path
+ *
+ * where the values are 0, 1 or -1 for an absent attribute, and the
+ * path is encoded with strvis(3).  A record which is not terminated by
+ * a newline was torn by a crash, and is ignored.
+ */
+#define	HBSDCONTROL_JOURNAL_MAGIC	"#hbsdcontrol journal v1\n"
+
+struct hbsdcontrol_journal {
+	int		 fd;
+	int		 error;
+	/* Protects the records appended since the last commit. */
+	pthread_mutex_t	 log_mtx;
+	struct sbuf	*log;
+	uint64_t	 lsn;
+	/* Serializes the commits, the appenders are not blocked by fsync. */
+	pthread_mutex_t	 commit_mtx;
+	struct sbuf	*commit;
+	uint64_t	 committed;
+};
+
+static int hbsdcontrol_journal_write(int fd, const char *buf, size_t len);
+static int hbsdcontrol_journal_undo(const char *record, size_t len);
+
+
+int
+hbsdcontrol_journal_open(const char *path, struct hbsdcontrol_journal **journal)
+{
+	struct stat st;
+	int error;
+
+	if (journal == NULL)
+		return (EINVAL);
+
+	*journal = calloc(1, sizeof(**journal));
+	if (*journal == NULL)
+		return (ENOMEM);
+
+	(*journal)->fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	if ((*journal)->fd == -1) {
+		error = errno;
+		free(*journal);
+		*journal = NULL;
+		return (error);
+	}
+
+	pthread_mutex_init(&(*journal)->log_mtx, NULL);
+	pthread_mutex_init(&(*journal)->commit_mtx, NULL);
+	(*journal)->log = sbuf_new_auto();
+	(*journal)->commit = sbuf_new_auto();
+	if ((*journal)->log == NULL || (*journal)->commit == NULL) {
+		hbsdcontrol_journal_close(journal);
+		return (ENOMEM);
+	}
+
+	if (fstat((*journal)->fd, &st) == -1) {
+		error = errno;
+		hbsdcontrol_journal_close(journal);
+		return (error);
+	}
+
+	if (st.st_size == 0) {
+		error = hbsdcontrol_journal_write((*journal)->fd,
+		    HBSDCONTROL_JOURNAL_MAGIC, strlen(HBSDCONTROL_JOURNAL_MAGIC));
+		if (error == 0 && fsync((*journal)->fd) == -1)
+			error = errno;
+		if (error) {
+			hbsdcontrol_journal_close(journal);
+			return (error);
+		}
+	}
+
+	return (0);
+}
+
+
+/*
+ * Append a record to the in-memory log, and return its sequence number
+ * in lsn.  The record is durable after hbsdcontrol_journal_commit().
+ */
+int
+hbsdcontrol_journal_log(struct hbsdcontrol_journal *journal, const char *file,
+    const char *attr, int oldval, int newval, uint64_t *lsn)
+{
+	char *vfile;
+	int error;
+
+	vfile = calloc(sizeof(char), strlen(file) * 4 + 1);
+	if (vfile == NULL)
+		return (ENOMEM);
+
+	strvis(vfile, file, VIS_WHITE | VIS_CSTYLE | VIS_OCTAL);
+
+	pthread_mutex_lock(&journal->log_mtx);
+	error = journal->error;
+	if (error == 0) {
+		sbuf_printf(journal->log, "%d %d %s %s\n", oldval, newval, attr, vfile);
+		*lsn = ++journal->lsn;
+	}
+	pthread_mutex_unlock(&journal->log_mtx);
+
+	free(vfile);
+
+	return (error);
+}
+
+
+/*
+ * Group commit: the first committer writes and fsyncs every record
+ * appended so far, the concurrent committers whose records were covered
+ * by that fsync return without doing any I/O.
+ */
+int
+hbsdcontrol_journal_commit(struct hbsdcontrol_journal *journal, uint64_t lsn)
+{
+	struct sbuf *records;
+	uint64_t target;
+	int error;
+
+	pthread_mutex_lock(&journal->commit_mtx);
+	if (journal->committed >= lsn) {
+		pthread_mutex_unlock(&journal->commit_mtx);
+		return (journal->error);
+	}
+
+	pthread_mutex_lock(&journal->log_mtx);
+	records = journal->log;
+	journal->log = journal->commit;
+	journal->commit = records;
+	target = journal->lsn;
+	error = journal->error;
+	pthread_mutex_unlock(&journal->log_mtx);
+
+	if (error == 0 && sbuf_finish(records) != 0)
+		error = ENOMEM;
+	if (error == 0)
+		error = hbsdcontrol_journal_write(journal->fd, sbuf_data(records), sbuf_len(records));
+	if (error == 0 && fsync(journal->fd) == -1)
+		error = errno;
+	sbuf_clear(records);
+
+	if (error) {
+		pthread_mutex_lock(&journal->log_mtx);
+		journal->error = error;
+		pthread_mutex_unlock(&journal->log_mtx);
+	} else
+		journal->committed = target;
+	pthread_mutex_unlock(&journal->commit_mtx);
+
+	return (error);
+}
+
+
+int
+hbsdcontrol_journal_close(struct hbsdcontrol_journal **journal)
+{
+	int error;
+
+	if (*journal == NULL)
+		return (0);
+
+	error = 0;
+	if ((*journal)->log != NULL && (*journal)->commit != NULL)
+		error = hbsdcontrol_journal_commit(*journal, (*journal)->lsn);
+
+	if ((*journal)->log != NULL)
+		sbuf_delete((*journal)->log);
+	if ((*journal)->commit != NULL)
+		sbuf_delete((*journal)->commit);
+	pthread_mutex_destroy(&(*journal)->commit_mtx);
+	pthread_mutex_destroy(&(*journal)->log_mtx);
+	close((*journal)->fd);
+	free(*journal);
+	*journal = NULL;
+
+	return (error);
+}
+
+
+/*
+ * Restore the old values in reverse order, so when an attribute was
+ * changed more than once, the oldest value wins.  The journal is mapped
+ * and walked backwards, the memory usage does not depend on its size.
+ */
+int
+hbsdcontrol_journal_rollback(const char *path)
+{
+	struct stat st;
+	const char *base;
+	const char *line;
+	const char *p;
+	int error;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return (errno);
+
+	if (fstat(fd, &st) == -1) {
+		error = errno;
+		close(fd);
+		return (error);
+	}
+
+	if (st.st_size < (off_t)strlen(HBSDCONTROL_JOURNAL_MAGIC)) {
+		close(fd);
+		return (EFTYPE);
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return (errno);
+
+	if (memcmp(base, HBSDCONTROL_JOURNAL_MAGIC, strlen(HBSDCONTROL_JOURNAL_MAGIC))) {
+		munmap(__DECONST(char *, base), st.st_size);
+		return (EFTYPE);
+	}
+
+	error = 0;
+	p = base + st.st_size;
+
+	/* Skip the torn record at the end, if any. */
+	while (p > base && p[-1] != '\n')
+		p--;
+
+	while (p > base) {
+		line = p - 1;
+		while (line > base && line[-1] != '\n')
+			line--;
+
+		/* Skip the comments and the blank lines. */
+		if (line != p - 1 && *line != '#') {
+			if (hbsdcontrol_journal_undo(line, p - 1 - line) != 0 && error == 0)
+				error = errno;
+		}
+
+		p = line;
+	}
+
+	munmap(__DECONST(char *, base), st.st_size);
+
+	return (error);
+}
+
+
+static int
+hbsdcontrol_journal_undo(const char *record, size_t len)
+{
+	char buf[32 + MAXPATHLEN * 4];
+	char file[MAXPATHLEN];
+	const char *attr;
+	char *vfile;
+	char *p;
+	int oldval, newval;
+	bool known;
+
+	if (len >= sizeof(buf)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	memcpy(buf, record, len);
+	buf[len] = '\0';
+
+	oldval = strtol(buf, &p, 10);
+	if (*p++ != ' ')
+		goto invalid;
+	newval = strtol(p, &p, 10);
+	if (*p++ != ' ')
+		goto invalid;
+	attr = p;
+	p = strchr(p, ' ');
+	if (p == NULL)
+		goto invalid;
+	*p++ = '\0';
+	vfile = p;
+
+	if (oldval < HBSDCONTROL_ATTR_INVALID || oldval > 1 ||
+	    newval < HBSDCONTROL_ATTR_ABSENT || newval > 1)
+		goto invalid;
+
+	/* Never touch anything else, than the PaX attributes. */
+	known = false;
+	for (int feature = 0; pax_features[feature].feature != NULL && !known; feature++) {
+		for (pax_feature_state_t state = 0; state < 2; state++) {
+			if (!strcmp(pax_features[feature].extattr[state], attr))
+				known = true;
+		}
+	}
+	if (!known)
+		goto invalid;
+
+	if (strlen(vfile) >= sizeof(file) || strunvis(file, vfile) == -1)
+		goto invalid;
+
+	if (hbsdcontrol_get_debug())
+		printf("%s:\t%s %s: %d -> %d\n", __func__, file, attr, newval, oldval);
+
+	/* The old value was neither 0 nor 1, and is not known. */
+	if (oldval == HBSDCONTROL_ATTR_INVALID)
+		return (0);
+
+	if (oldval == HBSDCONTROL_ATTR_ABSENT) {
+		if (hbsdcontrol_extattr_rm_attr(file, attr) != 0 && errno != ENOATTR)
+			return (-1);
+	} else {
+		errno = hbsdcontrol_extattr_set_attr(file, attr, oldval);
+		if (errno)
+			return (-1);
+	}
+
+	errno = hbsdcontrol_flags_sync(file);
+	if (errno)
+		return (-1);
+
+	return (0);
+
+invalid:
+	errno = EFTYPE;
+	return (-1);
+}
+
+
+static int
+hbsdcontrol_journal_write(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return (errno);
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return (0);
+}
@@ -0,0 +1,294 @@
+/*-
+ * Copyright (c) 2015-2018 Oliver Pinter <oliver.pinter@HardenedBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#include <sys/param.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+
+#include "libhbsdcontrol.h"
+
+/*
+ * A profile sets several features at once.  It is compiled to a write
+ * set in the state word format: the mask has both bits set for each
+ * attribute the profile writes, and the word holds the new values, so
+ * the attributes to write on a file are (current ^ word) & mask.
+ */
+static const struct {
+	const char	*name;
+	const char	*spec;
+} hbsdcontrol_builtin_profiles[] = {
+	/* JIT compilers map their code writable and executable. */
+	{"jit",		"mprotect=disable pageexec=disable"},
+	/* Old Java releases use MAP_32BIT. */
+	{"java",	"disallow_map32bit=disable"},
+	{NULL,		NULL},
+};
+
+struct hbsdcontrol_clone_arg {
+	struct hbsdcontrol_journal	*journal;
+	struct hbsdcontrol_profile	 profile;
+};
+
+static int hbsdcontrol_profile_find(FILE *fp, const char *name, struct hbsdcontrol_profile *profile);
+
+int
+hbsdcontrol_profile_compile(const char *name, const char *spec, struct hbsdcontrol_profile *profile)
+{
+	char feature[64];
+	const char *eq;
+	size_t len;
+	pax_feature_state_t state;
+	pax_state_word_t val[2];
+	int idx;
+
+	memset(profile, 0, sizeof(*profile));
+	if (strlcpy(profile->name, name, sizeof(profile->name)) >= sizeof(profile->name))
+		return (ENAMETOOLONG);
+
+	for (;;) {
+		spec += strspn(spec, ", \t\n");
+		if (*spec == '\0')
+			break;
+
+		len = strcspn(spec, ", \t\n");
+		eq = memchr(spec, '=', len);
+		if (eq == NULL || (size_t)(eq - spec) >= sizeof(feature))
+			return (EINVAL);
+
+		memcpy(feature, spec, eq - spec);
+		feature[eq - spec] = '\0';
+		idx = hbsdcontrol_feature_index(feature);
+		if (idx < 0)
+			return (EINVAL);
+
+		eq++;
+		len -= eq - spec;
+		if (len == 6 && !strncmp(eq, "enable", len))
+			state = enable;
+		else if (len == 7 && !strncmp(eq, "disable", len))
+			state = disable;
+		else if (len == 6 && !strncmp(eq, "sysdef", len))
+			state = sysdef;
+		else
+			return (EINVAL);
+
+		if (state == sysdef) {
+			val[disable] = PAX_ATTR_ABSENT;
+			val[enable] = PAX_ATTR_ABSENT;
+		} else {
+			val[disable] = state == disable ? PAX_ATTR_ONE : PAX_ATTR_ZERO;
+			val[enable] = state == enable ? PAX_ATTR_ONE : PAX_ATTR_ZERO;
+		}
+
+		for (pax_feature_state_t attr = 0; attr < 2; attr++) {
+			profile->mask |= (pax_state_word_t)0x3 << PAX_STATE_SHIFT(idx, attr);
+			profile->word &= ~((pax_state_word_t)0x3 << PAX_STATE_SHIFT(idx, attr));
+			profile->word |= val[attr] << PAX_STATE_SHIFT(idx, attr);
+		}
+
+		spec = eq + len;
+	}
+
+	return (profile->mask == 0 ? EINVAL : 0);
+}
+
+/*
+ * The profiles file has one profile per line, the name followed by
+ * feature=state pairs, for example:
+ *
+ *	node	mprotect=disable pageexec=disable
+ */
+static int
+hbsdcontrol_profile_find(FILE *fp, const char *name, struct hbsdcontrol_profile *profile)
+{
+	char *line;
+	char *spec;
+	size_t linecap;
+	size_t len;
+	int error;
+
+	line = NULL;
+	linecap = 0;
+	error = ENOENT;
+
+	while (getline(&line, &linecap, fp) > 0) {
+		spec = line + strspn(line, " \t");
+		if (*spec == '#' || *spec == '\n' || *spec == '\0')
+			continue;
+
+		len = strcspn(spec, " \t\n");
+		if (strlen(name) != len || strncmp(spec, name, len))
+			continue;
+
+		error = hbsdcontrol_profile_compile(name, spec + len, profile);
+		if (error == EINVAL)
+			error = EFTYPE;
+		break;
+	}
+
+	free(line);
+
+	return (error);
+}
+
+/*
+ * Look up a profile in the profiles file, which overrides the built-in
+ * profiles.  Without a path, the missing default file is not an error.
+ */
+int
+hbsdcontrol_profile_lookup(const char *path, const char *name, struct hbsdcontrol_profile *profile)
+{
+	FILE *fp;
+	int error;
+
+	fp = fopen(path != NULL ? path : HBSDCONTROL_PROFILES_PATH, "re");
+	if (fp == NULL && (path != NULL || errno != ENOENT))
+		return (errno);
+
+	if (fp != NULL) {
+		error = hbsdcontrol_profile_find(fp, name, profile);
+		fclose(fp);
+		if (error != ENOENT)
+			return (error);
+	}
+
+	for (int i = 0; hbsdcontrol_builtin_profiles[i].name != NULL; i++) {
+		if (!strcmp(hbsdcontrol_builtin_profiles[i].name, name))
+			return (hbsdcontrol_profile_compile(name,
+			    hbsdcontrol_builtin_profiles[i].spec, profile));
+	}
+
+	return (ENOENT);
+}
+
+int
+hbsdcontrol_profile_apply(struct hbsdcontrol_journal *journal,
+    const struct hbsdcontrol_profile *profile, const char *file)
+{
+	struct hbsdcontrol_bulk_entry entry;
+	int error;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.path = __DECONST(char *, file);
+
+	error = hbsdcontrol_bulk_apply_profile(journal, &entry, 1, profile);
+	if (error == 0)
+		error = entry.error;
+
+	return (error);
+}
+
+/*
+ * Apply the profile on each entry, see hbsdcontrol_bulk_write_state().
+ */
+int
+hbsdcontrol_bulk_apply_profile(struct hbsdcontrol_journal *journal,
+    struct hbsdcontrol_bulk_entry *entries, size_t nentries,
+    const struct hbsdcontrol_profile *profile)
+{
+
+	return (hbsdcontrol_bulk_write_state(journal, entries, NULL, nentries,
+	    profile->mask, profile->word));
+}
+
+/*
+ * Capture every attribute of a file, the absent ones included, as a
+ * profile, which recreates the file's exact state on the targets.
+ * Values other than 0 and 1 can not be represented, and are refused.
+ */
+int
+hbsdcontrol_profile_from_file(const char *file, struct hbsdcontrol_profile *profile)
+{
+	pax_state_word_t word;
+	int error;
+	int fd;
+
+	memset(profile, 0, sizeof(*profile));
+	strlcpy(profile->name, file, sizeof(profile->name));
+
+	fd = open(file, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1)
+		return (errno);
+
+	error = hbsdcontrol_get_state_word_fd(fd, &word);
+	close(fd);
+	if (error)
+		return (error);
+
+	for (int feature = 0; feature < HBSDCONTROL_NFEATURES; feature++)
+		for (pax_feature_state_t attr = 0; attr < 2; attr++)
+			if (PAX_STATE_ATTR(word, feature, attr) == PAX_ATTR_INVALID)
+				return (EFTYPE);
+
+	profile->mask = PAX_STATE_MASK;
+	profile->word = word;
+
+	return (0);
+}
+
+static int
+hbsdcontrol_clone_fn(struct hbsdcontrol_bulk_entry *entries, size_t nentries, void *arg)
+{
+	struct hbsdcontrol_clone_arg *ca;
+
+	ca = arg;
+
+	return (hbsdcontrol_bulk_apply_profile(ca->journal, entries, nentries, &ca->profile));
+}
+
+/*
+ * Copy the state of src onto every file of dsts, in parallel, with
+ * the flags of hbsdcontrol_bulk_run().
+ */
+int
+hbsdcontrol_clone_state(struct hbsdcontrol_journal *journal, const char *src,
+    char * const *dsts, int flags)
+{
+	struct hbsdcontrol_bulk_args args;
+	struct hbsdcontrol_clone_arg ca;
+	int error;
+
+	error = hbsdcontrol_profile_from_file(src, &ca.profile);
+	if (error)
+		return (error);
+	ca.journal = journal;
+
+	memset(&args, 0, sizeof(args));
+	args.flags = flags;
+	args.fn = hbsdcontrol_clone_fn;
+	args.arg = &ca;
+
+	return (hbsdcontrol_bulk_run(&args, dsts));
+}
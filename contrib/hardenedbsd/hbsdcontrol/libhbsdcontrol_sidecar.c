@@ -0,0 +1,871 @@
+/*-
+ * Copyright (c) 2015-2018 Oliver Pinter <oliver.pinter@HardenedBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#include <sys/param.h>
+#include <sys/extattr.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+
+#include "libhbsdcontrol.h"
+
+/*
+ * The sidecar database keeps the pax attributes of the files on the
+ * file systems without extattr support.  It is an open addressing hash
+ * table, with linear probing, in a memory mapped file: a header page,
+ * followed by the slots.  A slot holds the state word of a file, keyed
+ * by its inode number, so the hard links share their attributes, as
+ * with the extended attributes.  The flags attribute is not listed, it
+ * is read and written as the whole word.
+ *
+ * The inode numbers are reused, so a slot also records a generation
+ * tag of the file, derived from its birth time and generation number.
+ * A slot with the same device and inode numbers, but another tag, was
+ * left by a removed file: it is ignored, and reused for the new file.
+ * The device number is only compared for the files without a tag, so
+ * the files keep their attributes when their file system is remounted
+ * under another device number.
+ *
+ * A new slot is filled in before it is marked used, and a slot never
+ * spans a disk sector, so a crash either loses the slot, or leaves it
+ * complete.  The table is grown into a new file, which is renamed over
+ * the old one, without the slots of the files without attributes.
+ */
+#define	HBSDCONTROL_SIDECAR_MAGIC	"HBSDSCDB"
+#define	HBSDCONTROL_SIDECAR_VERSION	2
+#define	HBSDCONTROL_SIDECAR_HDRSIZE	4096
+#define	HBSDCONTROL_SIDECAR_INITIAL	4096
+
+#define	HBSDCONTROL_SIDECAR_EMPTY	0
+#define	HBSDCONTROL_SIDECAR_USED	1
+
+struct hbsdcontrol_sidecar_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	nfeatures;
+	uint64_t	nslots;
+};
+
+struct hbsdcontrol_sidecar_slot {
+	uint64_t	dev;
+	uint64_t	ino;
+	uint32_t	word;
+	uint32_t	state;
+	uint64_t	gen;
+};
+
+struct hbsdcontrol_sidecar_key {
+	uint64_t	dev;
+	uint64_t	ino;
+	uint64_t	gen;
+};
+
+_Static_assert(sizeof(struct hbsdcontrol_sidecar_slot) == 32,
+    "a sidecar slot must not span a sector");
+
+struct hbsdcontrol_sidecar {
+	pthread_mutex_t				 mtx;
+	char					*path;
+	int					 fd;
+	void					*map;
+	size_t					 mapsize;
+	struct hbsdcontrol_sidecar_slot		*slots;
+	uint64_t				 nslots;
+	uint64_t				 count;
+};
+
+static int hbsdcontrol_sidecar_map(struct hbsdcontrol_sidecar *db, int fd, bool create, uint64_t nslots);
+static void hbsdcontrol_sidecar_stat_key(const struct stat *st, struct hbsdcontrol_sidecar_key *key);
+static bool hbsdcontrol_sidecar_match(const struct hbsdcontrol_sidecar_slot *slot, const struct hbsdcontrol_sidecar_key *key);
+static struct hbsdcontrol_sidecar_slot *hbsdcontrol_sidecar_slot(struct hbsdcontrol_sidecar_slot *slots, uint64_t nslots, const struct hbsdcontrol_sidecar_key *key);
+static int hbsdcontrol_sidecar_grow(struct hbsdcontrol_sidecar *db);
+static bool hbsdcontrol_sidecar_find(struct hbsdcontrol_sidecar *db, const struct hbsdcontrol_sidecar_key *key, pax_state_word_t *word);
+static int hbsdcontrol_sidecar_update(struct hbsdcontrol_sidecar *db, const struct hbsdcontrol_sidecar_key *key, pax_state_word_t mask, pax_state_word_t bits, bool remove);
+static int hbsdcontrol_sidecar_attr(const char *attr, int *feature, int *state);
+static int hbsdcontrol_sidecar_key(const char *file, int fd, int attrnamespace, struct hbsdcontrol_sidecar_key *key);
+static ssize_t hbsdcontrol_sidecar_list(struct hbsdcontrol_sidecar *db, const struct hbsdcontrol_sidecar_key *key, void *data, size_t nbytes);
+static ssize_t hbsdcontrol_sidecar_get(struct hbsdcontrol_sidecar *db, const struct hbsdcontrol_sidecar_key *key, const char *attr, void *data, size_t nbytes);
+static ssize_t hbsdcontrol_sidecar_set(struct hbsdcontrol_sidecar *db, const struct hbsdcontrol_sidecar_key *key, const char *attr, const void *data, size_t nbytes);
+static int hbsdcontrol_sidecar_delete(struct hbsdcontrol_sidecar *db, const struct hbsdcontrol_sidecar_key *key, const char *attr);
+
+static ssize_t hbsdcontrol_sidecar_list_file(void *ctx, const char *file, int attrnamespace, void *data, size_t nbytes);
+static ssize_t hbsdcontrol_sidecar_get_file(void *ctx, const char *file, int attrnamespace, const char *attr, void *data, size_t nbytes);
+static ssize_t hbsdcontrol_sidecar_set_file(void *ctx, const char *file, int attrnamespace, const char *attr, const void *data, size_t nbytes);
+static int hbsdcontrol_sidecar_delete_file(void *ctx, const char *file, int attrnamespace, const char *attr);
+static ssize_t hbsdcontrol_sidecar_list_fd(void *ctx, int fd, int attrnamespace, void *data, size_t nbytes);
+static ssize_t hbsdcontrol_sidecar_get_fd(void *ctx, int fd, int attrnamespace, const char *attr, void *data, size_t nbytes);
+static ssize_t hbsdcontrol_sidecar_set_fd(void *ctx, int fd, int attrnamespace, const char *attr, const void *data, size_t nbytes);
+static int hbsdcontrol_sidecar_delete_fd(void *ctx, int fd, int attrnamespace, const char *attr);
+
+const struct hbsdcontrol_backend hbsdcontrol_sidecar_backend = {
+	.name = "sidecar",
+	.list_file = hbsdcontrol_sidecar_list_file,
+	.get_file = hbsdcontrol_sidecar_get_file,
+	.set_file = hbsdcontrol_sidecar_set_file,
+	.delete_file = hbsdcontrol_sidecar_delete_file,
+	.list_fd = hbsdcontrol_sidecar_list_fd,
+	.get_fd = hbsdcontrol_sidecar_get_fd,
+	.set_fd = hbsdcontrol_sidecar_set_fd,
+	.delete_fd = hbsdcontrol_sidecar_delete_fd,
+};
+
+static int
+hbsdcontrol_sidecar_map(struct hbsdcontrol_sidecar *db, int fd, bool create, uint64_t nslots)
+{
+	struct hbsdcontrol_sidecar_header *hdr;
+	struct stat st;
+	size_t mapsize;
+	void *map;
+
+	if (create) {
+		mapsize = HBSDCONTROL_SIDECAR_HDRSIZE + nslots * sizeof(struct hbsdcontrol_sidecar_slot);
+		if (ftruncate(fd, mapsize) == -1)
+			return (errno);
+	} else {
+		if (fstat(fd, &st) == -1)
+			return (errno);
+		if (st.st_size < HBSDCONTROL_SIDECAR_HDRSIZE)
+			return (EFTYPE);
+		mapsize = st.st_size;
+	}
+
+	map = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return (errno);
+
+	hdr = map;
+	if (create) {
+		memcpy(hdr->magic, HBSDCONTROL_SIDECAR_MAGIC, sizeof(hdr->magic));
+		hdr->version = HBSDCONTROL_SIDECAR_VERSION;
+		hdr->nfeatures = HBSDCONTROL_NFEATURES;
+		hdr->nslots = nslots;
+	} else if (memcmp(hdr->magic, HBSDCONTROL_SIDECAR_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != HBSDCONTROL_SIDECAR_VERSION ||
+	    hdr->nfeatures != HBSDCONTROL_NFEATURES ||
+	    !powerof2(hdr->nslots) ||
+	    HBSDCONTROL_SIDECAR_HDRSIZE + hdr->nslots * sizeof(struct hbsdcontrol_sidecar_slot) != mapsize) {
+		munmap(map, mapsize);
+		return (EFTYPE);
+	}
+
+	db->map = map;
+	db->mapsize = mapsize;
+	db->slots = (struct hbsdcontrol_sidecar_slot *)((char *)map + HBSDCONTROL_SIDECAR_HDRSIZE);
+	db->nslots = hdr->nslots;
+	db->fd = fd;
+
+	db->count = 0;
+	for (uint64_t slot = 0; slot < db->nslots; slot++)
+		if (db->slots[slot].state == HBSDCONTROL_SIDECAR_USED)
+			db->count++;
+
+	return (0);
+}
+
+/*
+ * Open, or create the database at path.  The database is locked, the
+ * concurrent users are refused with EWOULDBLOCK.
+ */
+int
+hbsdcontrol_sidecar_open(const char *path, struct hbsdcontrol_sidecar **dbp)
+{
+	struct hbsdcontrol_sidecar *db;
+	struct stat st;
+	int error;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd == -1)
+		return (errno);
+
+	if (flock(fd, LOCK_EX | LOCK_NB) == -1 || fstat(fd, &st) == -1) {
+		error = errno;
+		close(fd);
+		return (error);
+	}
+
+	db = calloc(1, sizeof(*db));
+	if (db == NULL || (db->path = strdup(path)) == NULL) {
+		free(db);
+		close(fd);
+		return (ENOMEM);
+	}
+
+	error = hbsdcontrol_sidecar_map(db, fd, st.st_size == 0, HBSDCONTROL_SIDECAR_INITIAL);
+	if (error) {
+		free(db->path);
+		free(db);
+		close(fd);
+		return (error);
+	}
+
+	pthread_mutex_init(&db->mtx, NULL);
+	*dbp = db;
+
+	return (0);
+}
+
+int
+hbsdcontrol_sidecar_close(struct hbsdcontrol_sidecar **dbp)
+{
+	struct hbsdcontrol_sidecar *db;
+	int error;
+
+	db = *dbp;
+	if (db == NULL)
+		return (0);
+
+	error = 0;
+	if (msync(db->map, db->mapsize, MS_SYNC) == -1)
+		error = errno;
+	munmap(db->map, db->mapsize);
+	if (close(db->fd) == -1 && error == 0)
+		error = errno;
+
+	pthread_mutex_destroy(&db->mtx);
+	free(db->path);
+	free(db);
+	*dbp = NULL;
+
+	return (error);
+}
+
+static void
+hbsdcontrol_sidecar_stat_key(const struct stat *st, struct hbsdcontrol_sidecar_key *key)
+{
+
+	key->dev = st->st_dev;
+	key->ino = st->st_ino;
+	/* The birth time is -1, where the file system does not keep it. */
+	key->gen = st->st_birthtim.tv_sec == -1 ? 0 :
+	    (uint64_t)st->st_birthtim.tv_sec * 1000000000 + st->st_birthtim.tv_nsec;
+	key->gen ^= (uint64_t)st->st_gen * 0x9e3779b97f4a7c15ULL;
+}
+
+static bool
+hbsdcontrol_sidecar_match(const struct hbsdcontrol_sidecar_slot *slot,
+    const struct hbsdcontrol_sidecar_key *key)
+{
+
+	return (slot->state == HBSDCONTROL_SIDECAR_USED && slot->ino == key->ino &&
+	    slot->gen == key->gen && (key->gen != 0 || slot->dev == key->dev));
+}
+
+/*
+ * Find the slot of the file, or the slot to store it in: the stale slot
+ * of a removed file with the same device and inode numbers, or an empty
+ * one.
+ */
+static struct hbsdcontrol_sidecar_slot *
+hbsdcontrol_sidecar_slot(struct hbsdcontrol_sidecar_slot *slots, uint64_t nslots,
+    const struct hbsdcontrol_sidecar_key *key)
+{
+	struct hbsdcontrol_sidecar_slot *stale;
+	uint64_t hash;
+	uint64_t slot;
+
+	hash = key->ino * 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+
+	stale = NULL;
+	for (slot = hash & (nslots - 1); slots[slot].state == HBSDCONTROL_SIDECAR_USED;
+	    slot = (slot + 1) & (nslots - 1)) {
+		if (hbsdcontrol_sidecar_match(&slots[slot], key))
+			return (&slots[slot]);
+		if (stale == NULL && slots[slot].ino == key->ino &&
+		    slots[slot].dev == key->dev)
+			stale = &slots[slot];
+	}
+
+	return (stale != NULL ? stale : &slots[slot]);
+}
+
+/*
+ * Build the doubled table in a new file, and rename it over the old
+ * one, which stays complete until then.
+ */
+static int
+hbsdcontrol_sidecar_grow(struct hbsdcontrol_sidecar *db)
+{
+	struct hbsdcontrol_sidecar new;
+	struct hbsdcontrol_sidecar_key key;
+	struct hbsdcontrol_sidecar_slot *slot;
+	char tmp[MAXPATHLEN];
+	int error;
+	int fd;
+
+	if ((size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", db->path) >= sizeof(tmp))
+		return (ENAMETOOLONG);
+
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1)
+		return (errno);
+
+	memset(&new, 0, sizeof(new));
+	error = flock(fd, LOCK_EX | LOCK_NB) == -1 ? errno : 0;
+	if (error == 0)
+		error = hbsdcontrol_sidecar_map(&new, fd, true, db->nslots * 2);
+	if (error) {
+		close(fd);
+		unlink(tmp);
+		return (error);
+	}
+
+	for (uint64_t i = 0; i < db->nslots; i++) {
+		if (db->slots[i].state != HBSDCONTROL_SIDECAR_USED || db->slots[i].word == 0)
+			continue;
+		key.dev = db->slots[i].dev;
+		key.ino = db->slots[i].ino;
+		key.gen = db->slots[i].gen;
+		slot = hbsdcontrol_sidecar_slot(new.slots, new.nslots, &key);
+		*slot = db->slots[i];
+		new.count++;
+	}
+
+	if (msync(new.map, new.mapsize, MS_SYNC) == -1 || fsync(fd) == -1 ||
+	    rename(tmp, db->path) == -1) {
+		error = errno;
+		munmap(new.map, new.mapsize);
+		close(fd);
+		unlink(tmp);
+		return (error);
+	}
+
+	munmap(db->map, db->mapsize);
+	close(db->fd);
+	db->map = new.map;
+	db->mapsize = new.mapsize;
+	db->slots = new.slots;
+	db->nslots = new.nslots;
+	db->count = new.count;
+	db->fd = fd;
+
+	return (0);
+}
+
+/*
+ * Returns true and the state word of the file described by st, when it
+ * has a slot.
+ */
+bool
+hbsdcontrol_sidecar_lookup(struct hbsdcontrol_sidecar *db, const struct stat *st,
+    pax_state_word_t *word)
+{
+	struct hbsdcontrol_sidecar_key key;
+
+	hbsdcontrol_sidecar_stat_key(st, &key);
+
+	return (hbsdcontrol_sidecar_find(db, &key, word));
+}
+
+static bool
+hbsdcontrol_sidecar_find(struct hbsdcontrol_sidecar *db,
+    const struct hbsdcontrol_sidecar_key *key, pax_state_word_t *word)
+{
+	struct hbsdcontrol_sidecar_slot *slot;
+	bool found;
+
+	pthread_mutex_lock(&db->mtx);
+	slot = hbsdcontrol_sidecar_slot(db->slots, db->nslots, key);
+	found = hbsdcontrol_sidecar_match(slot, key);
+	*word = found ? slot->word : 0;
+	pthread_mutex_unlock(&db->mtx);
+
+	return (found);
+}
+
+/*
+ * Replace the bits of the word under mask, or clear them, which fails
+ * with ENOATTR when they are clear already, as the removal of an
+ * absent attribute does.
+ */
+static int
+hbsdcontrol_sidecar_update(struct hbsdcontrol_sidecar *db,
+    const struct hbsdcontrol_sidecar_key *key, pax_state_word_t mask,
+    pax_state_word_t bits, bool remove)
+{
+	struct hbsdcontrol_sidecar_slot *slot;
+	int error;
+
+	error = 0;
+
+	pthread_mutex_lock(&db->mtx);
+	slot = hbsdcontrol_sidecar_slot(db->slots, db->nslots, key);
+	if (!hbsdcontrol_sidecar_match(slot, key)) {
+		if (remove) {
+			error = ENOATTR;
+			goto out;
+		}
+
+		/* Keep the table at most half full. */
+		if (slot->state != HBSDCONTROL_SIDECAR_USED &&
+		    (db->count + 1) * 2 > db->nslots) {
+			error = hbsdcontrol_sidecar_grow(db);
+			if (error)
+				goto out;
+			slot = hbsdcontrol_sidecar_slot(db->slots, db->nslots, key);
+		}
+
+		/* A stale slot loses its word, before it changes hands. */
+		slot->word = 0;
+		slot->dev = key->dev;
+		slot->ino = key->ino;
+		slot->gen = key->gen;
+		/* The slot is complete, before it is marked used. */
+		if (slot->state != HBSDCONTROL_SIDECAR_USED) {
+			slot->state = HBSDCONTROL_SIDECAR_USED;
+			db->count++;
+		}
+	} else if (!remove)
+		slot->dev = key->dev;
+
+	if (remove && (slot->word & mask) == 0) {
+		error = ENOATTR;
+		goto out;
+	}
+
+	slot->word = (slot->word & ~mask) | (remove ? 0 : bits & mask);
+
+out:
+	pthread_mutex_unlock(&db->mtx);
+
+	return (error);
+}
+
+static int
+hbsdcontrol_sidecar_attr(const char *attr, int *feature, int *state)
+{
+
+	for (*feature = 0; pax_features[*feature].feature != NULL; (*feature)++)
+		for (*state = 0; *state < 2; (*state)++)
+			if (!strcmp(pax_features[*feature].extattr[*state], attr))
+				return (0);
+
+	return (ENOATTR);
+}
+
+static int
+hbsdcontrol_sidecar_key(const char *file, int fd, int attrnamespace,
+    struct hbsdcontrol_sidecar_key *key)
+{
+	struct stat st;
+
+	if (attrnamespace != EXTATTR_NAMESPACE_SYSTEM)
+		return (EOPNOTSUPP);
+
+	if ((file != NULL ? stat(file, &st) : fstat(fd, &st)) == -1)
+		return (errno);
+
+	hbsdcontrol_sidecar_stat_key(&st, key);
+
+	return (0);
+}
+
+/*
+ * The backend functions below have the semantics of extattr(2).
+ */
+static ssize_t
+hbsdcontrol_sidecar_list(struct hbsdcontrol_sidecar *db,
+    const struct hbsdcontrol_sidecar_key *key, void *data, size_t nbytes)
+{
+	pax_state_word_t word;
+	const char *name;
+	size_t len;
+	size_t pos;
+
+	hbsdcontrol_sidecar_find(db, key, &word);
+
+	pos = 0;
+	for (int feature = 0; feature < HBSDCONTROL_NFEATURES; feature++) {
+		for (int attr = 0; attr < 2; attr++) {
+			if (PAX_STATE_ATTR(word, feature, attr) == PAX_ATTR_ABSENT)
+				continue;
+
+			name = pax_features[feature].extattr[attr];
+			len = strlen(name);
+			if (data != NULL) {
+				/* Truncate the list as ffs does, into a full buffer. */
+				if (pos + 1 + len > nbytes) {
+					if (pos < nbytes) {
+						((char *)data)[pos] = len;
+						memcpy((char *)data + pos + 1, name,
+						    nbytes - pos - 1);
+					}
+					return (nbytes);
+				}
+				((char *)data)[pos] = len;
+				memcpy((char *)data + pos + 1, name, len);
+			}
+			pos += 1 + len;
+		}
+	}
+
+	return (pos);
+}
+
+static ssize_t
+hbsdcontrol_sidecar_get(struct hbsdcontrol_sidecar *db,
+    const struct hbsdcontrol_sidecar_key *key, const char *attr, void *data,
+    size_t nbytes)
+{
+	char buf[HBSDCONTROL_FLAGS_LEN + 1];
+	pax_state_word_t word;
+	pax_state_word_t code;
+	int feature, state;
+
+	/* The flags attribute is the word itself. */
+	if (!strcmp(attr, HBSDCONTROL_FLAGS_ATTR)) {
+		if (!hbsdcontrol_sidecar_find(db, key, &word) || word == 0) {
+			errno = ENOATTR;
+			return (-1);
+		}
+
+		hbsdcontrol_flags_encode(word, buf);
+		if (data != NULL)
+			memcpy(data, buf, MIN(nbytes, HBSDCONTROL_FLAGS_LEN));
+
+		return (data != NULL ? MIN(nbytes, HBSDCONTROL_FLAGS_LEN) : HBSDCONTROL_FLAGS_LEN);
+	}
+
+	if (hbsdcontrol_sidecar_attr(attr, &feature, &state) != 0) {
+		errno = ENOATTR;
+		return (-1);
+	}
+
+	hbsdcontrol_sidecar_find(db, key, &word);
+	code = PAX_STATE_ATTR(word, feature, state);
+	if (code == PAX_ATTR_ABSENT) {
+		errno = ENOATTR;
+		return (-1);
+	}
+
+	if (data != NULL && nbytes > 0)
+		*(char *)data = code == PAX_ATTR_ONE ? '1' : '0';
+
+	return (1);
+}
+
+static ssize_t
+hbsdcontrol_sidecar_set(struct hbsdcontrol_sidecar *db,
+    const struct hbsdcontrol_sidecar_key *key, const char *attr, const void *data,
+    size_t nbytes)
+{
+	pax_state_word_t word;
+	int feature, state;
+	int error;
+
+	if (!strcmp(attr, HBSDCONTROL_FLAGS_ATTR)) {
+		error = hbsdcontrol_flags_decode(data, nbytes, &word);
+		if (error == 0)
+			error = hbsdcontrol_sidecar_update(db, key, PAX_STATE_MASK,
+			    word, false);
+		if (error) {
+			errno = error == EFTYPE ? EINVAL : error;
+			return (-1);
+		}
+
+		return (nbytes);
+	}
+
+	/* Only the pax attributes, with a value of 0 or 1, are stored. */
+	if (hbsdcontrol_sidecar_attr(attr, &feature, &state) != 0 || nbytes != 1 ||
+	    (*(const char *)data != '0' && *(const char *)data != '1')) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	error = hbsdcontrol_sidecar_update(db, key,
+	    (pax_state_word_t)0x3 << PAX_STATE_SHIFT(feature, state),
+	    (pax_state_word_t)(*(const char *)data == '1' ? PAX_ATTR_ONE : PAX_ATTR_ZERO) <<
+	    PAX_STATE_SHIFT(feature, state), false);
+	if (error) {
+		errno = error;
+		return (-1);
+	}
+
+	return (nbytes);
+}
+
+static int
+hbsdcontrol_sidecar_delete(struct hbsdcontrol_sidecar *db,
+    const struct hbsdcontrol_sidecar_key *key, const char *attr)
+{
+	int feature, state;
+	int error;
+
+	/*
+	 * The flags attribute is the word itself, it can not go stale, and
+	 * removing it must not remove the per-feature attributes.
+	 */
+	if (!strcmp(attr, HBSDCONTROL_FLAGS_ATTR))
+		return (0);
+
+	error = hbsdcontrol_sidecar_attr(attr, &feature, &state);
+	if (error == 0)
+		error = hbsdcontrol_sidecar_update(db, key,
+		    (pax_state_word_t)0x3 << PAX_STATE_SHIFT(feature, state), 0, true);
+	if (error) {
+		errno = error;
+		return (-1);
+	}
+
+	return (0);
+}
+
+static ssize_t
+hbsdcontrol_sidecar_list_file(void *ctx, const char *file, int attrnamespace,
+    void *data, size_t nbytes)
+{
+	struct hbsdcontrol_sidecar_key key;
+	int error;
+
+	error = hbsdcontrol_sidecar_key(file, -1, attrnamespace, &key);
+	if (error) {
+		errno = error;
+		return (-1);
+	}
+
+	return (hbsdcontrol_sidecar_list(ctx, &key, data, nbytes));
+}
+
+static ssize_t
+hbsdcontrol_sidecar_get_file(void *ctx, const char *file, int attrnamespace,
+    const char *attr, void *data, size_t nbytes)
+{
+	struct hbsdcontrol_sidecar_key key;
+	int error;
+
+	error = hbsdcontrol_sidecar_key(file, -1, attrnamespace, &key);
+	if (error) {
+		errno = error;
+		return (-1);
+	}
+
+	return (hbsdcontrol_sidecar_get(ctx, &key, attr, data, nbytes));
+}
+
+static ssize_t
+hbsdcontrol_sidecar_set_file(void *ctx, const char *file, int attrnamespace,
+    const char *attr, const void *data, size_t nbytes)
+{
+	struct hbsdcontrol_sidecar_key key;
+	int error;
+
+	error = hbsdcontrol_sidecar_key(file, -1, attrnamespace, &key);
+	if (error) {
+		errno = error;
+		return (-1);
+	}
+
+	return (hbsdcontrol_sidecar_set(ctx, &key, attr, data, nbytes));
+}
+
+static int
+hbsdcontrol_sidecar_delete_file(void *ctx, const char *file, int attrnamespace,
+    const char *attr)
+{
+	struct hbsdcontrol_sidecar_key key;
+	int error;
+
+	error = hbsdcontrol_sidecar_key(file, -1, attrnamespace, &key);
+	if (error) {
+		errno = error;
+		return (-1);
+	}
+
+	return (hbsdcontrol_sidecar_delete(ctx, &key, attr));
+}
+
+static ssize_t
+hbsdcontrol_sidecar_list_fd(void *ctx, int fd, int attrnamespace,
+    void *data, size_t nbytes)
+{
+	struct hbsdcontrol_sidecar_key key;
+	int error;
+
+	error = hbsdcontrol_sidecar_key(NULL, fd, attrnamespace, &key);
+	if (error) {
+		errno = error;
+		return (-1);
+	}
+
+	return (hbsdcontrol_sidecar_list(ctx, &key, data, nbytes));
+}
+
+static ssize_t
+hbsdcontrol_sidecar_get_fd(void *ctx, int fd, int attrnamespace,
+    const char *attr, void *data, size_t nbytes)
+{
+	struct hbsdcontrol_sidecar_key key;
+	int error;
+
+	error = hbsdcontrol_sidecar_key(NULL, fd, attrnamespace, &key);
+	if (error) {
+		errno = error;
+		return (-1);
+	}
+
+	return (hbsdcontrol_sidecar_get(ctx, &key, attr, data, nbytes));
+}
+
+static ssize_t
+hbsdcontrol_sidecar_set_fd(void *ctx, int fd, int attrnamespace,
+    const char *attr, const void *data, size_t nbytes)
+{
+	struct hbsdcontrol_sidecar_key key;
+	int error;
+
+	error = hbsdcontrol_sidecar_key(NULL, fd, attrnamespace, &key);
+	if (error) {
+		errno = error;
+		return (-1);
+	}
+
+	return (hbsdcontrol_sidecar_set(ctx, &key, attr, data, nbytes));
+}
+
+static int
+hbsdcontrol_sidecar_delete_fd(void *ctx, int fd, int attrnamespace,
+    const char *attr)
+{
+	struct hbsdcontrol_sidecar_key key;
+	int error;
+
+	error = hbsdcontrol_sidecar_key(NULL, fd, attrnamespace, &key);
+	if (error) {
+		errno = error;
+		return (-1);
+	}
+
+	return (hbsdcontrol_sidecar_delete(ctx, &key, attr));
+}
+
+struct hbsdcontrol_sidecar_export_arg {
+	struct hbsdcontrol_sidecar	*db;
+	struct hbsdcontrol_journal	*journal;
+	/* The lengths, without the trailing slashes. */
+	size_t				 srclen;
+	const char			*dst;
+	size_t				 dstlen;
+};
+
+static int
+hbsdcontrol_sidecar_export_fn(struct hbsdcontrol_bulk_entry *entries, size_t nentries, void *arg)
+{
+	struct hbsdcontrol_sidecar_export_arg *ea;
+	struct hbsdcontrol_profile profile;
+	char path[MAXPATHLEN];
+	const char *rel;
+	size_t len;
+	int error;
+
+	ea = arg;
+	error = 0;
+
+	memset(&profile, 0, sizeof(profile));
+	strlcpy(profile.name, "sidecar", sizeof(profile.name));
+	profile.mask = PAX_STATE_MASK;
+
+	for (size_t entry = 0; entry < nentries; entry++) {
+		if (entries[entry].error == 0 && S_ISREG(entries[entry].st.st_mode) &&
+		    hbsdcontrol_sidecar_lookup(ea->db, &entries[entry].st, &profile.word)) {
+			/* The path below src, without its leading slashes. */
+			rel = entries[entry].path + ea->srclen;
+			while (*rel == '/')
+				rel++;
+
+			if (*rel == '\0')
+				len = snprintf(path, sizeof(path), "%.*s",
+				    (int)MAX(ea->dstlen, 1), ea->dst);
+			else
+				len = snprintf(path, sizeof(path), "%.*s/%s",
+				    (int)ea->dstlen, ea->dst, rel);
+			if (len >= sizeof(path))
+				entries[entry].error = ENAMETOOLONG;
+			else
+				entries[entry].error = hbsdcontrol_profile_apply(ea->journal,
+				    &profile, path);
+		}
+
+		if (entries[entry].error && error == 0)
+			error = entries[entry].error;
+	}
+
+	return (error);
+}
+
+/*
+ * Write the states recorded in the database for the files below src
+ * onto the same files below dst, or src itself when dst is NULL, with
+ * the current backend, which should be extattr(2).  Only the differing
+ * attributes are written.
+ */
+int
+hbsdcontrol_sidecar_export(struct hbsdcontrol_sidecar *db, struct hbsdcontrol_journal *journal,
+    const struct hbsdcontrol_bulk_args *bulk_args, const char *src, const char *dst)
+{
+	struct hbsdcontrol_sidecar_export_arg ea;
+	struct hbsdcontrol_bulk_args args;
+	char *paths[2];
+
+	if (hbsdcontrol_get_backend() == &hbsdcontrol_sidecar_backend)
+		return (EINVAL);
+
+	ea.db = db;
+	ea.journal = journal;
+	ea.dst = dst != NULL ? dst : src;
+	/* A root of "/" keeps no character, and joins to "/" + path. */
+	for (ea.srclen = strlen(src); ea.srclen > 0 && src[ea.srclen - 1] == '/';)
+		ea.srclen--;
+	for (ea.dstlen = strlen(ea.dst); ea.dstlen > 0 && ea.dst[ea.dstlen - 1] == '/';)
+		ea.dstlen--;
+
+	memset(&args, 0, sizeof(args));
+	if (bulk_args != NULL)
+		args = *bulk_args;
+	args.flags |= HBSDCONTROL_BULK_RECURSIVE;
+	args.fn = hbsdcontrol_sidecar_export_fn;
+	args.emit = NULL;
+	args.arg = &ea;
+
+	paths[0] = __DECONST(char *, src);
+	paths[1] = NULL;
+
+	return (hbsdcontrol_bulk_run(&args, paths));
+}
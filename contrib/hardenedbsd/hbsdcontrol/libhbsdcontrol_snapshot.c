@@ -0,0 +1,418 @@
+/*-
+ * Copyright (c) 2015-2018 Oliver Pinter <oliver.pinter@HardenedBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <fts.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <vis.h>
+
+#include "libhbsdcontrol.h"
+
+/*
+ * The exported snapshot is a text file, with a header, and with one
+ * line per file:
+ *
+ *	states path
+ *
+ * where states has one character per feature, in the order of the
+ * #features header line: 'e'nabled, 'd'isabled, 'c'onflict or '-' for
+ * sysdef, and the path is encoded with strvis(3).  The lines are in
+ * walk order, see hbsdcontrol_path_cmp().
+ */
+#define	HBSDCONTROL_SNAPSHOT_MAGIC	"#hbsdcontrol snapshot v1"
+#define	HBSDCONTROL_SNAPSHOT_FEATURES	"#features"
+
+struct hbsdcontrol_snapshot {
+	/* Live tree. */
+	FTS		*fts;
+	size_t		 rootlen;
+	/* Exported snapshot. */
+	FILE		*fp;
+	char		*line;
+	size_t		 linecap;
+	/* The current and the previous path, for the order check. */
+	char		*path[2];
+	size_t		 pathcap[2];
+	int		 cur;
+	bool		 first;
+	char		*prefix;
+	size_t		 prefixlen;
+};
+
+static int hbsdcontrol_snapshot_compar(const FTSENT * const *a, const FTSENT * const *b);
+static int hbsdcontrol_snapshot_read_header(struct hbsdcontrol_snapshot *snap);
+static int hbsdcontrol_snapshot_set_path(struct hbsdcontrol_snapshot *snap, const char *path, size_t len, bool vis);
+static int hbsdcontrol_snapshot_next_live(struct hbsdcontrol_snapshot *snap, struct hbsdcontrol_snapshot_entry *entry);
+static int hbsdcontrol_snapshot_next_file(struct hbsdcontrol_snapshot *snap, struct hbsdcontrol_snapshot_entry *entry);
+static char hbsdcontrol_snapshot_state_char(pax_feature_state_t state);
+
+
+static int
+hbsdcontrol_snapshot_compar(const FTSENT * const *a, const FTSENT * const *b)
+{
+
+	return (strcmp((*a)->fts_name, (*b)->fts_name));
+}
+
+
+/*
+ * Open a live tree when path is a directory, an exported snapshot
+ * otherwise.  Only the files whose relative path starts with prefix
+ * are returned, when prefix is not NULL.
+ */
+int
+hbsdcontrol_snapshot_open(const char *path, const char *prefix, struct hbsdcontrol_snapshot **snap)
+{
+	char *paths[2];
+	struct stat st;
+	int error;
+
+	if (snap == NULL)
+		return (EINVAL);
+
+	if (stat(path, &st) == -1)
+		return (errno);
+
+	*snap = calloc(1, sizeof(**snap));
+	if (*snap == NULL)
+		return (ENOMEM);
+
+	(*snap)->first = true;
+
+	if (prefix != NULL) {
+		while (*prefix == '/')
+			prefix++;
+		(*snap)->prefix = strdup(prefix);
+		if ((*snap)->prefix == NULL) {
+			hbsdcontrol_snapshot_close(snap);
+			return (ENOMEM);
+		}
+		(*snap)->prefixlen = strlen(prefix);
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		paths[0] = __DECONST(char *, path);
+		paths[1] = NULL;
+		(*snap)->rootlen = strlen(path);
+		(*snap)->fts = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR,
+		    hbsdcontrol_snapshot_compar);
+		if ((*snap)->fts == NULL) {
+			error = errno;
+			hbsdcontrol_snapshot_close(snap);
+			return (error);
+		}
+
+		return (0);
+	}
+
+	(*snap)->fp = fopen(path, "re");
+	if ((*snap)->fp == NULL) {
+		error = errno;
+		hbsdcontrol_snapshot_close(snap);
+		return (error);
+	}
+
+	error = hbsdcontrol_snapshot_read_header(*snap);
+	if (error)
+		hbsdcontrol_snapshot_close(snap);
+
+	return (error);
+}
+
+
+void
+hbsdcontrol_snapshot_close(struct hbsdcontrol_snapshot **snap)
+{
+
+	if (*snap == NULL)
+		return;
+
+	if ((*snap)->fts != NULL)
+		fts_close((*snap)->fts);
+	if ((*snap)->fp != NULL)
+		fclose((*snap)->fp);
+	free((*snap)->line);
+	free((*snap)->path[0]);
+	free((*snap)->path[1]);
+	free((*snap)->prefix);
+	free(*snap);
+	*snap = NULL;
+}
+
+
+/*
+ * Returns 1 and fills in entry, or 0 at the end of the snapshot, or -1
+ * and sets errno on error.  The entry's path is valid until the next
+ * call.  Per file errors are returned in the entry's error member.
+ */
+int
+hbsdcontrol_snapshot_next(struct hbsdcontrol_snapshot *snap, struct hbsdcontrol_snapshot_entry *entry)
+{
+
+	memset(entry, 0, sizeof(*entry));
+
+	if (snap->fts != NULL)
+		return (hbsdcontrol_snapshot_next_live(snap, entry));
+
+	return (hbsdcontrol_snapshot_next_file(snap, entry));
+}
+
+
+int
+hbsdcontrol_snapshot_write_header(FILE *fp)
+{
+
+	fprintf(fp, "%s\n%s", HBSDCONTROL_SNAPSHOT_MAGIC, HBSDCONTROL_SNAPSHOT_FEATURES);
+	for (int feature = 0; pax_features[feature].feature != NULL; feature++)
+		fprintf(fp, " %s", pax_features[feature].feature);
+	fprintf(fp, "\n");
+
+	return (ferror(fp) ? EIO : 0);
+}
+
+
+int
+hbsdcontrol_snapshot_write(FILE *fp, const struct hbsdcontrol_snapshot_entry *entry)
+{
+	char states[HBSDCONTROL_NFEATURES + 1];
+	char vpath[MAXPATHLEN * 4 + 1];
+
+	if (strlen(entry->path) >= MAXPATHLEN)
+		return (ENAMETOOLONG);
+
+	for (int feature = 0; feature < HBSDCONTROL_NFEATURES; feature++)
+		states[feature] = hbsdcontrol_snapshot_state_char(entry->states[feature]);
+	states[HBSDCONTROL_NFEATURES] = '\0';
+
+	strvis(vpath, entry->path, VIS_WHITE | VIS_CSTYLE | VIS_OCTAL);
+	fprintf(fp, "%s %s\n", states, vpath);
+
+	return (ferror(fp) ? EIO : 0);
+}
+
+
+static int
+hbsdcontrol_snapshot_read_header(struct hbsdcontrol_snapshot *snap)
+{
+	char features[256];
+	ssize_t len;
+
+	len = getline(&snap->line, &snap->linecap, snap->fp);
+	if (len <= 0 || strncmp(snap->line, HBSDCONTROL_SNAPSHOT_MAGIC,
+	    strlen(HBSDCONTROL_SNAPSHOT_MAGIC)))
+		return (EFTYPE);
+
+	/* The snapshot has to have the same features, in the same order. */
+	strlcpy(features, HBSDCONTROL_SNAPSHOT_FEATURES, sizeof(features));
+	for (int feature = 0; pax_features[feature].feature != NULL; feature++) {
+		strlcat(features, " ", sizeof(features));
+		strlcat(features, pax_features[feature].feature, sizeof(features));
+	}
+	strlcat(features, "\n", sizeof(features));
+
+	len = getline(&snap->line, &snap->linecap, snap->fp);
+	if (len <= 0 || strcmp(snap->line, features))
+		return (EFTYPE);
+
+	return (0);
+}
+
+
+static int
+hbsdcontrol_snapshot_set_path(struct hbsdcontrol_snapshot *snap, const char *path, size_t len, bool vis)
+{
+	char *buf;
+	int cur;
+
+	cur = snap->cur;
+
+	if (snap->pathcap[cur] < len + 1) {
+		buf = realloc(snap->path[cur], len + 1);
+		if (buf == NULL)
+			return (ENOMEM);
+		snap->path[cur] = buf;
+		snap->pathcap[cur] = len + 1;
+	}
+
+	if (!vis) {
+		memcpy(snap->path[cur], path, len);
+		snap->path[cur][len] = '\0';
+	} else if (strunvis(snap->path[cur], path) == -1)
+		return (EFTYPE);
+
+	return (0);
+}
+
+
+static int
+hbsdcontrol_snapshot_next_live(struct hbsdcontrol_snapshot *snap, struct hbsdcontrol_snapshot_entry *entry)
+{
+	const char *rel;
+	FTSENT *ent;
+	size_t len;
+	int error;
+
+	while ((ent = fts_read(snap->fts)) != NULL) {
+		if (ent->fts_level == FTS_ROOTLEVEL)
+			continue;
+
+		rel = ent->fts_path + snap->rootlen;
+		while (*rel == '/')
+			rel++;
+		len = strlen(rel);
+
+		switch (ent->fts_info) {
+		case FTS_D:
+			/* Prune the directories, which can not contain a match. */
+			if (snap->prefix != NULL &&
+			    strncmp(rel, snap->prefix, MIN(len, snap->prefixlen)))
+				fts_set(snap->fts, ent, FTS_SKIP);
+			continue;
+		case FTS_F:
+		case FTS_DNR:
+		case FTS_ERR:
+		case FTS_NS:
+			break;
+		default:
+			continue;
+		}
+
+		if (snap->prefix != NULL && strncmp(rel, snap->prefix, snap->prefixlen))
+			continue;
+
+		error = hbsdcontrol_snapshot_set_path(snap, rel, len, false);
+		if (error) {
+			errno = error;
+			return (-1);
+		}
+		entry->path = snap->path[snap->cur];
+
+		if (ent->fts_info == FTS_F)
+			entry->error = hbsdcontrol_get_feature_states(ent->fts_accpath, entry->states);
+		else
+			entry->error = ent->fts_errno;
+
+		return (1);
+	}
+
+	return (errno ? -1 : 0);
+}
+
+
+static int
+hbsdcontrol_snapshot_next_file(struct hbsdcontrol_snapshot *snap, struct hbsdcontrol_snapshot_entry *entry)
+{
+	ssize_t len;
+	int error;
+
+	while ((len = getline(&snap->line, &snap->linecap, snap->fp)) > 0) {
+		if (snap->line[len - 1] == '\n')
+			snap->line[--len] = '\0';
+
+		if (snap->line[0] == '#' || len == 0)
+			continue;
+
+		if (len < HBSDCONTROL_NFEATURES + 2 || snap->line[HBSDCONTROL_NFEATURES] != ' ') {
+			errno = EFTYPE;
+			return (-1);
+		}
+
+		for (int feature = 0; feature < HBSDCONTROL_NFEATURES; feature++) {
+			switch (snap->line[feature]) {
+			case 'e':
+				entry->states[feature] = enable;
+				break;
+			case 'd':
+				entry->states[feature] = disable;
+				break;
+			case 'c':
+				entry->states[feature] = conflict;
+				break;
+			case '-':
+				entry->states[feature] = sysdef;
+				break;
+			default:
+				errno = EFTYPE;
+				return (-1);
+			}
+		}
+
+		error = hbsdcontrol_snapshot_set_path(snap,
+		    &snap->line[HBSDCONTROL_NFEATURES + 1], len, true);
+		if (error) {
+			errno = error;
+			return (-1);
+		}
+
+		if (snap->prefix != NULL &&
+		    strncmp(snap->path[snap->cur], snap->prefix, snap->prefixlen))
+			continue;
+
+		/* The merge of two snapshots relies on the order. */
+		if (!snap->first &&
+		    hbsdcontrol_path_cmp(snap->path[!snap->cur], snap->path[snap->cur], NULL) >= 0) {
+			errno = EFTYPE;
+			return (-1);
+		}
+
+		entry->path = snap->path[snap->cur];
+		snap->first = false;
+		snap->cur = !snap->cur;
+
+		return (1);
+	}
+
+	return (ferror(snap->fp) ? -1 : 0);
+}
+
+
+static char
+hbsdcontrol_snapshot_state_char(pax_feature_state_t state)
+{
+
+	switch (state) {
+	case enable:
+		return ('e');
+	case disable:
+		return ('d');
+	case conflict:
+		return ('c');
+	case sysdef:
+		return ('-');
+	}
+
+	return ('?');
+}
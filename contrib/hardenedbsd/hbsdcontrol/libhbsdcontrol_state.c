@@ -0,0 +1,543 @@
+/*-
+ * Copyright (c) 2015-2018 Oliver Pinter <oliver.pinter@HardenedBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#include <sys/param.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <err.h>
+#include <errno.h>
+
+#include "libhbsdcontrol.h"
+
+/*
+ * Resolve a feature's nibble of the state word: the disable attribute
+ * is in the low two bits, the enable attribute in the high two bits.
+ * An absent attribute reads as 0 when the other one is present, as in
+ * hbsdcontrol_validate_state(), and a value other than 0 or 1 is a
+ * conflict.
+ */
+#define	N(noattr, attr)	((noattr) | ((attr) << 2))
+
+static const int8_t hbsdcontrol_state_lut[16] = {
+	[N(PAX_ATTR_ABSENT, PAX_ATTR_ABSENT)]	= sysdef,
+	[N(PAX_ATTR_ZERO, PAX_ATTR_ABSENT)]	= conflict,
+	[N(PAX_ATTR_ONE, PAX_ATTR_ABSENT)]	= disable,
+	[N(PAX_ATTR_INVALID, PAX_ATTR_ABSENT)]	= conflict,
+	[N(PAX_ATTR_ABSENT, PAX_ATTR_ZERO)]	= conflict,
+	[N(PAX_ATTR_ZERO, PAX_ATTR_ZERO)]	= conflict,
+	[N(PAX_ATTR_ONE, PAX_ATTR_ZERO)]	= disable,
+	[N(PAX_ATTR_INVALID, PAX_ATTR_ZERO)]	= conflict,
+	[N(PAX_ATTR_ABSENT, PAX_ATTR_ONE)]	= enable,
+	[N(PAX_ATTR_ZERO, PAX_ATTR_ONE)]	= enable,
+	[N(PAX_ATTR_ONE, PAX_ATTR_ONE)]		= conflict,
+	[N(PAX_ATTR_INVALID, PAX_ATTR_ONE)]	= conflict,
+	[N(PAX_ATTR_ABSENT, PAX_ATTR_INVALID)]	= conflict,
+	[N(PAX_ATTR_ZERO, PAX_ATTR_INVALID)]	= conflict,
+	[N(PAX_ATTR_ONE, PAX_ATTR_INVALID)]	= conflict,
+	[N(PAX_ATTR_INVALID, PAX_ATTR_INVALID)]	= conflict,
+};
+
+#undef	N
+
+_Static_assert(PAX_STATE_SHIFT(HBSDCONTROL_NFEATURES, 0) <= 32,
+    "the state word is too small for pax_features[]");
+
+/*
+ * Directory names are interned in an open addressing hash table,
+ * which holds the directory index + 1, and 0 in the empty slots.
+ */
+#define	HBSDCONTROL_COLUMN_INITIAL	1024
+
+struct hbsdcontrol_state_column {
+	pthread_mutex_t		 mtx;
+	pax_state_word_t	*words;
+	uint32_t		*dirs;
+	size_t			 nwords;
+	size_t			 capwords;
+	char			**dirnames;
+	size_t			 ndirs;
+	size_t			 capdirs;
+	uint32_t		*hash;
+	size_t			 hashcap;
+};
+
+static uint32_t hbsdcontrol_state_column_hash(const char *dir, size_t len);
+static int hbsdcontrol_state_column_intern(struct hbsdcontrol_state_column *col, const char *path, uint32_t *dir);
+static int hbsdcontrol_state_column_rehash(struct hbsdcontrol_state_column *col);
+
+static int
+hbsdcontrol_state_attr_code(int val)
+{
+
+	switch (val) {
+	case 0:
+		return (PAX_ATTR_ZERO);
+	case 1:
+		return (PAX_ATTR_ONE);
+	}
+
+	return (PAX_ATTR_INVALID);
+}
+
+/*
+ * Read the state word of a file, from the flags attribute in the sync
+ * mode, or from the per-feature attributes.
+ */
+int
+hbsdcontrol_get_state_word(const char *file, pax_state_word_t *word)
+{
+	int error;
+
+	if (hbsdcontrol_get_flags_mode() == HBSDCONTROL_FLAGS_SYNC) {
+		error = hbsdcontrol_get_flags(file, word);
+		if (error != ENOATTR && error != EFTYPE)
+			return (error);
+	}
+
+	return (hbsdcontrol_get_legacy_state_word(file, word));
+}
+
+/*
+ * Read the state word of a file, with one list, and one get for each
+ * of the pax attributes present on the file.
+ */
+int
+hbsdcontrol_get_legacy_state_word(const char *file, pax_state_word_t *word)
+{
+	char **attrs;
+	int error;
+	int val;
+
+	attrs = NULL;
+	*word = 0;
+
+	error = hbsdcontrol_extattr_list_attrs(file, &attrs);
+	if (error)
+		return (error);
+
+	for (int attr = 0; attrs[attr] != NULL; attr++) {
+		for (int feature = 0; pax_features[feature].feature != NULL; feature++) {
+			for (pax_feature_state_t state = 0; state < 2; state++) {
+				if (strcmp(pax_features[feature].extattr[state], attrs[attr]))
+					continue;
+
+				error = hbsdcontrol_extattr_get_attr(file, attrs[attr], &val);
+				/* Removed since it was listed. */
+				if (error == ENOATTR) {
+					error = 0;
+					continue;
+				}
+				if (error)
+					goto out;
+
+				*word |= (pax_state_word_t)hbsdcontrol_state_attr_code(val) <<
+				    PAX_STATE_SHIFT(feature, state);
+			}
+		}
+	}
+
+out:
+	hbsdcontrol_free_attrs(&attrs);
+
+	return (error);
+}
+
+/*
+ * Read the state of a single feature lazily: with the flags attribute
+ * in the sync mode, or with a get of each of the feature's attributes,
+ * without listing the attributes of the file.
+ */
+int
+hbsdcontrol_get_feature_state(const char *file, const char *feature,
+    pax_feature_state_t *state)
+{
+	pax_state_word_t word;
+	int feature_idx;
+	int error;
+	int val;
+
+	feature_idx = hbsdcontrol_feature_index(feature);
+	if (feature_idx < 0)
+		return (EINVAL);
+
+	if (hbsdcontrol_get_flags_mode() == HBSDCONTROL_FLAGS_SYNC) {
+		error = hbsdcontrol_get_flags(file, &word);
+		if (error == 0) {
+			*state = hbsdcontrol_state_word_feature(word, feature_idx);
+			return (0);
+		}
+		if (error != ENOATTR && error != EFTYPE)
+			return (error);
+	}
+
+	word = 0;
+	for (pax_feature_state_t attr = 0; attr < 2; attr++) {
+		error = hbsdcontrol_extattr_get_attr(file,
+		    pax_features[feature_idx].extattr[attr], &val);
+		if (error == ENOATTR)
+			continue;
+		if (error)
+			return (error);
+
+		word |= (pax_state_word_t)hbsdcontrol_state_attr_code(val) <<
+		    PAX_STATE_SHIFT(feature_idx, attr);
+	}
+
+	*state = hbsdcontrol_state_word_feature(word, feature_idx);
+
+	return (0);
+}
+
+pax_feature_state_t
+hbsdcontrol_state_word_feature(pax_state_word_t word, int feature)
+{
+
+	assert(feature >= 0 && feature < HBSDCONTROL_NFEATURES);
+
+	return (hbsdcontrol_state_lut[(word >> PAX_STATE_SHIFT(feature, 0)) & 0xf]);
+}
+
+void
+hbsdcontrol_state_word_decode(pax_state_word_t word, pax_feature_state_t *states)
+{
+
+	for (int feature = 0; feature < HBSDCONTROL_NFEATURES; feature++)
+		states[feature] = hbsdcontrol_state_lut[(word >> PAX_STATE_SHIFT(feature, 0)) & 0xf];
+}
+
+/*
+ * Count the states of each feature in an array of state words.  Each
+ * byte of a word holds two features, so the hot loop only counts the
+ * byte values, and the counts are resolved with the table at the end.
+ * Two sets of counters are used, to keep the increments of
+ * neighbouring words with the same value independent.
+ */
+void
+hbsdcontrol_state_histogram(const pax_state_word_t *words, size_t nwords,
+    struct hbsdcontrol_state_histogram *hist)
+{
+	uint64_t (*counts)[howmany(HBSDCONTROL_NFEATURES, 2)][256];
+	size_t i;
+	int byte;
+	int feature;
+
+	memset(hist, 0, sizeof(*hist));
+
+	counts = calloc(2, sizeof(*counts));
+	if (counts == NULL) {
+		/* Slow path. */
+		for (i = 0; i < nwords; i++)
+			for (feature = 0; feature < HBSDCONTROL_NFEATURES; feature++)
+				hist->counts[feature][HBSDCONTROL_STATE_INDEX(
+				    hbsdcontrol_state_word_feature(words[i], feature))]++;
+		return;
+	}
+
+	for (i = 0; i + 1 < nwords; i += 2) {
+		for (byte = 0; byte < howmany(HBSDCONTROL_NFEATURES, 2); byte++) {
+			counts[0][byte][(words[i] >> (byte * 8)) & 0xff]++;
+			counts[1][byte][(words[i + 1] >> (byte * 8)) & 0xff]++;
+		}
+	}
+	if (i < nwords)
+		for (byte = 0; byte < howmany(HBSDCONTROL_NFEATURES, 2); byte++)
+			counts[0][byte][(words[i] >> (byte * 8)) & 0xff]++;
+
+	for (byte = 0; byte < howmany(HBSDCONTROL_NFEATURES, 2); byte++) {
+		for (int val = 0; val < 256; val++) {
+			uint64_t n;
+
+			n = counts[0][byte][val] + counts[1][byte][val];
+			if (n == 0)
+				continue;
+
+			feature = byte * 2;
+			hist->counts[feature][HBSDCONTROL_STATE_INDEX(
+			    hbsdcontrol_state_lut[val & 0xf])] += n;
+			if (feature + 1 < HBSDCONTROL_NFEATURES)
+				hist->counts[feature + 1][HBSDCONTROL_STATE_INDEX(
+				    hbsdcontrol_state_lut[val >> 4])] += n;
+		}
+	}
+
+	free(counts);
+}
+
+/*
+ * Columnar result buffer of the bulk runs: one state word and one
+ * directory index per file, which is 8 bytes per file, and the
+ * interned directory names.
+ */
+int
+hbsdcontrol_state_column_new(struct hbsdcontrol_state_column **colp)
+{
+	struct hbsdcontrol_state_column *col;
+
+	col = calloc(1, sizeof(*col));
+	if (col == NULL)
+		return (ENOMEM);
+
+	col->hashcap = HBSDCONTROL_COLUMN_INITIAL;
+	col->hash = calloc(col->hashcap, sizeof(*col->hash));
+	if (col->hash == NULL) {
+		free(col);
+		return (ENOMEM);
+	}
+	pthread_mutex_init(&col->mtx, NULL);
+
+	*colp = col;
+
+	return (0);
+}
+
+void
+hbsdcontrol_state_column_free(struct hbsdcontrol_state_column **colp)
+{
+	struct hbsdcontrol_state_column *col;
+
+	col = *colp;
+	if (col == NULL)
+		return;
+
+	for (size_t dir = 0; dir < col->ndirs; dir++)
+		free(col->dirnames[dir]);
+	free(col->dirnames);
+	free(col->hash);
+	free(col->words);
+	free(col->dirs);
+	pthread_mutex_destroy(&col->mtx);
+	free(col);
+
+	*colp = NULL;
+}
+
+static uint32_t
+hbsdcontrol_state_column_hash(const char *dir, size_t len)
+{
+	uint32_t hash;
+
+	/* FNV-1a */
+	hash = 2166136261U;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char)dir[i];
+		hash *= 16777619U;
+	}
+
+	return (hash);
+}
+
+static int
+hbsdcontrol_state_column_rehash(struct hbsdcontrol_state_column *col)
+{
+	uint32_t *hash;
+	size_t hashcap;
+	size_t slot;
+
+	hashcap = col->hashcap * 2;
+	hash = calloc(hashcap, sizeof(*hash));
+	if (hash == NULL)
+		return (ENOMEM);
+
+	for (size_t dir = 0; dir < col->ndirs; dir++) {
+		slot = hbsdcontrol_state_column_hash(col->dirnames[dir],
+		    strlen(col->dirnames[dir])) & (hashcap - 1);
+		while (hash[slot] != 0)
+			slot = (slot + 1) & (hashcap - 1);
+		hash[slot] = dir + 1;
+	}
+
+	free(col->hash);
+	col->hash = hash;
+	col->hashcap = hashcap;
+
+	return (0);
+}
+
+/*
+ * Find or add the directory of path.  The callers hold the lock.
+ */
+static int
+hbsdcontrol_state_column_intern(struct hbsdcontrol_state_column *col,
+    const char *path, uint32_t *dir)
+{
+	const char *slash;
+	const char *name;
+	size_t len;
+	size_t slot;
+	uint32_t id;
+	int error;
+
+	slash = strrchr(path, '/');
+	if (slash == NULL) {
+		name = ".";
+		len = 1;
+	} else if (slash == path) {
+		name = "/";
+		len = 1;
+	} else {
+		name = path;
+		len = slash - path;
+	}
+
+	slot = hbsdcontrol_state_column_hash(name, len) & (col->hashcap - 1);
+	while ((id = col->hash[slot]) != 0) {
+		if (!strncmp(col->dirnames[id - 1], name, len) &&
+		    col->dirnames[id - 1][len] == '\0') {
+			*dir = id - 1;
+			return (0);
+		}
+		slot = (slot + 1) & (col->hashcap - 1);
+	}
+
+	if (col->ndirs == col->capdirs) {
+		char **dirnames;
+		size_t capdirs;
+
+		capdirs = col->capdirs ? col->capdirs * 2 : HBSDCONTROL_COLUMN_INITIAL;
+		dirnames = reallocarray(col->dirnames, capdirs, sizeof(*dirnames));
+		if (dirnames == NULL)
+			return (ENOMEM);
+		col->dirnames = dirnames;
+		col->capdirs = capdirs;
+	}
+
+	col->dirnames[col->ndirs] = strndup(name, len);
+	if (col->dirnames[col->ndirs] == NULL)
+		return (ENOMEM);
+	col->hash[slot] = col->ndirs + 1;
+	*dir = col->ndirs++;
+
+	/* Keep the table at most half full. */
+	if (col->ndirs * 2 > col->hashcap) {
+		error = hbsdcontrol_state_column_rehash(col);
+		if (error)
+			return (error);
+	}
+
+	return (0);
+}
+
+/*
+ * Append the state words of a batch, the entries with an error are
+ * skipped.  Safe to call from the bulk workers.
+ */
+int
+hbsdcontrol_state_column_add(struct hbsdcontrol_state_column *col,
+    const struct hbsdcontrol_bulk_entry *entries, const pax_state_word_t *words,
+    size_t nentries)
+{
+	uint32_t dir;
+	int error;
+
+	error = 0;
+
+	pthread_mutex_lock(&col->mtx);
+	if (col->nwords + nentries > col->capwords) {
+		pax_state_word_t *newwords;
+		uint32_t *newdirs;
+		size_t capwords;
+
+		capwords = MAX(col->capwords * 2, col->nwords + nentries);
+		capwords = MAX(capwords, HBSDCONTROL_COLUMN_INITIAL);
+		newwords = reallocarray(col->words, capwords, sizeof(*newwords));
+		if (newwords != NULL)
+			col->words = newwords;
+		newdirs = reallocarray(col->dirs, capwords, sizeof(*newdirs));
+		if (newdirs != NULL)
+			col->dirs = newdirs;
+		if (newwords == NULL || newdirs == NULL) {
+			error = ENOMEM;
+			goto out;
+		}
+		col->capwords = capwords;
+	}
+
+	for (size_t entry = 0; entry < nentries; entry++) {
+		if (entries[entry].error)
+			continue;
+
+		error = hbsdcontrol_state_column_intern(col, entries[entry].path, &dir);
+		if (error)
+			goto out;
+
+		col->words[col->nwords] = words[entry];
+		col->dirs[col->nwords] = dir;
+		col->nwords++;
+	}
+
+out:
+	pthread_mutex_unlock(&col->mtx);
+
+	return (error);
+}
+
+void
+hbsdcontrol_state_column_histogram(const struct hbsdcontrol_state_column *col,
+    struct hbsdcontrol_state_histogram *hist)
+{
+
+	hbsdcontrol_state_histogram(col->words, col->nwords, hist);
+}
+
+/*
+ * Build one histogram per directory, *hists is indexed by the
+ * directory index, and the names in *dirs are owned by the column.
+ */
+int
+hbsdcontrol_state_column_dir_histograms(const struct hbsdcontrol_state_column *col,
+    struct hbsdcontrol_state_histogram **hists, const char * const **dirs,
+    size_t *ndirs)
+{
+	struct hbsdcontrol_state_histogram *hist;
+	pax_state_word_t word;
+
+	*hists = calloc(MAX(col->ndirs, 1), sizeof(**hists));
+	if (*hists == NULL)
+		return (ENOMEM);
+
+	for (size_t i = 0; i < col->nwords; i++) {
+		hist = &(*hists)[col->dirs[i]];
+		word = col->words[i];
+		for (int feature = 0; feature < HBSDCONTROL_NFEATURES; feature++) {
+			hist->counts[feature][HBSDCONTROL_STATE_INDEX(
+			    hbsdcontrol_state_lut[word & 0xf])]++;
+			word >>= 4;
+		}
+	}
+
+	*dirs = (const char * const *)col->dirnames;
+	*ndirs = col->ndirs;
+
+	return (0);
+}
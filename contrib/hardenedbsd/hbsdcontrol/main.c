@@ -32,6 +32,7 @@
 
 #include <sys/types.h>
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,8 +40,14 @@
 #include <unistd.h>
 #include <err.h>
 #include <errno.h>
+#include <getopt.h>
+#include <limits.h>
 
+#include "cmd_diff.h"
+#include "cmd_journal.h"
 #include "cmd_pax.h"
+#include "cmd_serve.h"
+#include "cmd_sidecar.h"
 #include "hbsdcontrol.h"
 #include "libhbsdcontrol.h"
 
@@ -52,8 +59,48 @@ static bool flag_immutable = false;
 static bool flag_keepgoing = false;
 static bool flag_usage= false;
 static bool flag_version = false;
+static const char *journal_path = NULL;
+static unsigned int max_ops = 0;
+static bool flag_adaptive = false;
+static const char *sidecar_path = NULL;
+static struct hbsdcontrol_sidecar *sidecar;
+
+struct hbsdcontrol_bulk_args hbsdcontrol_bulk_defaults;
+struct hbsdcontrol_journal *hbsdcontrol_journal;
 
 static void usage(void);
+static void print_op_stats(void);
+
+enum {
+	OPT_CHECKPOINT = 256,
+	OPT_RESUME,
+	OPT_MAX_OPS,
+	OPT_MAX_CONCURRENCY,
+	OPT_REMOTE_CONCURRENCY,
+	OPT_MAX_MEMORY,
+	OPT_ADAPTIVE,
+	OPT_BATCH_SIZE,
+	OPT_INODE_ORDER,
+	OPT_SIDECAR,
+	OPT_FLAGS_SYNC,
+	OPT_OP_STATS,
+};
+
+static const struct option hbsdcontrol_longopts[] = {
+	{"checkpoint",		required_argument,	NULL,	OPT_CHECKPOINT},
+	{"resume",		required_argument,	NULL,	OPT_RESUME},
+	{"max-ops-per-sec",	required_argument,	NULL,	OPT_MAX_OPS},
+	{"max-concurrency",	required_argument,	NULL,	OPT_MAX_CONCURRENCY},
+	{"remote-concurrency",	required_argument,	NULL,	OPT_REMOTE_CONCURRENCY},
+	{"max-memory",		required_argument,	NULL,	OPT_MAX_MEMORY},
+	{"adaptive",		no_argument,		NULL,	OPT_ADAPTIVE},
+	{"batch-size",		required_argument,	NULL,	OPT_BATCH_SIZE},
+	{"inode-order",		no_argument,		NULL,	OPT_INODE_ORDER},
+	{"sidecar",		required_argument,	NULL,	OPT_SIDECAR},
+	{"flags-sync",		no_argument,		NULL,	OPT_FLAGS_SYNC},
+	{"op-stats",		no_argument,		NULL,	OPT_OP_STATS},
+	{NULL,			0,			NULL,	0},
+};
 
 struct hbsdcontrol_command_entry {
 	const char	*cmd;
@@ -64,6 +111,11 @@ struct hbsdcontrol_command_entry {
 
 static const struct hbsdcontrol_command_entry hbsdcontrol_commands[] = {
 	{"pax",		3,	pax_cmd,	pax_usage},
+	{"serve",	1,	serve_cmd,	serve_usage},
+	{"rollback",	2,	rollback_cmd,	rollback_usage},
+	{"snapshot",	2,	snapshot_cmd,	snapshot_usage},
+	{"diff",	3,	diff_cmd,	diff_usage},
+	{"export",	3,	export_cmd,	export_usage},
 	{NULL,		0,	NULL,		NULL},
 };
 
@@ -80,6 +132,20 @@ usage(void)
 	exit(-1);
 }
 
+/*
+ * Registered with atexit(3), as some actions exit with their result.
+ */
+static void
+print_op_stats(void)
+{
+	struct hbsdcontrol_op_stats stats;
+
+	hbsdcontrol_get_op_stats(&stats);
+	fprintf(stderr, "op-stats: list %ju get %ju set %ju delete %ju lookup %ju\n",
+	    (uintmax_t)stats.list, (uintmax_t)stats.get, (uintmax_t)stats.set,
+	    (uintmax_t)stats.delete, (uintmax_t)stats.lookup);
+}
+
 static void
 version(void)
 {
@@ -92,13 +158,15 @@ version(void)
 int
 main(int argc, char **argv)
 {
+	const char *errstr;
 	int i;
 	int ch;
+	int error;
 
 	if (argc == 1)
 		usage();
 
-	while ((ch = getopt(argc, argv, "dfhikv")) != -1) {
+	while ((ch = getopt_long(argc, argv, "+dfhij:kv", hbsdcontrol_longopts, NULL)) != -1) {
 		switch (ch) {
 		case 'd':
 			flag_debug++;
@@ -112,12 +180,62 @@ main(int argc, char **argv)
 		case 'i':
 			flag_immutable = true;
 			break;
+		case 'j':
+			journal_path = optarg;
+			break;
 		case 'k':
 			flag_keepgoing = true;
 			break;
 		case 'v':
 			flag_version = true;
 			break;
+		case OPT_CHECKPOINT:
+			hbsdcontrol_bulk_defaults.state = optarg;
+			break;
+		case OPT_RESUME:
+			hbsdcontrol_bulk_defaults.state = optarg;
+			hbsdcontrol_bulk_defaults.flags |= HBSDCONTROL_BULK_RESUME;
+			break;
+		case OPT_MAX_OPS:
+			max_ops = strtonum(optarg, 1, UINT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(-1, "--max-ops-per-sec is %s: %s", errstr, optarg);
+			break;
+		case OPT_MAX_CONCURRENCY:
+			hbsdcontrol_bulk_defaults.nworkers = strtonum(optarg, 1, 1024, &errstr);
+			if (errstr != NULL)
+				errx(-1, "--max-concurrency is %s: %s", errstr, optarg);
+			break;
+		case OPT_REMOTE_CONCURRENCY:
+			hbsdcontrol_bulk_defaults.remote_nworkers = strtonum(optarg, 1, 1024, &errstr);
+			if (errstr != NULL)
+				errx(-1, "--remote-concurrency is %s: %s", errstr, optarg);
+			break;
+		case OPT_MAX_MEMORY:
+			hbsdcontrol_bulk_defaults.maxbytes = strtonum(optarg, 1, 1024 * 1024, &errstr) << 20;
+			if (errstr != NULL)
+				errx(-1, "--max-memory is %s: %s", errstr, optarg);
+			break;
+		case OPT_ADAPTIVE:
+			flag_adaptive = true;
+			break;
+		case OPT_BATCH_SIZE:
+			hbsdcontrol_bulk_defaults.batch_size = strtonum(optarg, 1, 65536, &errstr);
+			if (errstr != NULL)
+				errx(-1, "--batch-size is %s: %s", errstr, optarg);
+			break;
+		case OPT_INODE_ORDER:
+			hbsdcontrol_bulk_defaults.flags |= HBSDCONTROL_BULK_INODE_ORDER;
+			break;
+		case OPT_SIDECAR:
+			sidecar_path = optarg;
+			break;
+		case OPT_FLAGS_SYNC:
+			hbsdcontrol_set_flags_mode(HBSDCONTROL_FLAGS_SYNC);
+			break;
+		case OPT_OP_STATS:
+			atexit(print_op_stats);
+			break;
 		default:
 			usage();
 		}
@@ -146,9 +264,30 @@ main(int argc, char **argv)
 		errx(-1, "Running this program requires root privileges.");
 	}
 
+	if (flag_keepgoing)
+		hbsdcontrol_bulk_defaults.flags |= HBSDCONTROL_BULK_KEEPGOING;
+
+	if (max_ops > 0 || flag_adaptive)
+		hbsdcontrol_set_ratelimit(max_ops, flag_adaptive);
+
+	if (sidecar_path != NULL) {
+		error = hbsdcontrol_sidecar_open(sidecar_path, &sidecar);
+		if (error)
+			errc(-1, error, "%s", sidecar_path);
+		hbsdcontrol_set_backend(&hbsdcontrol_sidecar_backend, sidecar);
+	}
+
+	if (journal_path != NULL) {
+		error = hbsdcontrol_journal_open(journal_path, &hbsdcontrol_journal);
+		if (error)
+			errc(-1, error, "%s", journal_path);
+	}
+
 	while (argc > 0) {
 		for (i = 0; hbsdcontrol_commands[i].cmd != NULL; i++) {
 			if (!strcmp(argv[0], hbsdcontrol_commands[i].cmd)) {
+				/* A checkpoint is only resumed by the same command. */
+				hbsdcontrol_bulk_defaults.command = argv;
 				argv++;
 				argc--;
 
@@ -166,6 +305,19 @@ main(int argc, char **argv)
 	if (flag_debug > 0)
 		printf("argc at the end: %i\n", argc);
 
+	if (hbsdcontrol_journal != NULL) {
+		error = hbsdcontrol_journal_close(&hbsdcontrol_journal);
+		if (error)
+			errc(-1, error, "%s", journal_path);
+	}
+
+	if (sidecar != NULL) {
+		hbsdcontrol_set_backend(NULL, NULL);
+		error = hbsdcontrol_sidecar_close(&sidecar);
+		if (error)
+			errc(-1, error, "%s", sidecar_path);
+	}
+
 	return (0);
 }
 
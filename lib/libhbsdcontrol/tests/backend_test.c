@@ -0,0 +1,591 @@
+/*-
+ * Copyright (c) 2015-2018 Oliver Pinter <oliver.pinter@HardenedBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * The system call budgets of the library, measured through a counting
+ * in-memory backend installed with hbsdcontrol_set_backend().
+ */
+
+#include <sys/param.h>
+#include <sys/extattr.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atf-c.h>
+
+#include "libhbsdcontrol.h"
+
+#define	FAKE_NATTRS	64
+
+struct fake_attr {
+	dev_t	dev;
+	ino_t	ino;
+	char	name[EXTATTR_MAXNAMELEN + 1];
+	char	value[16];
+	size_t	len;
+};
+
+static struct fake {
+	struct fake_attr	attrs[FAKE_NATTRS];
+	size_t			nattrs;
+	unsigned int		list;
+	unsigned int		get;
+	unsigned int		set;
+	unsigned int		delete;
+	/* Fail the set with this number with EIO, when not 0. */
+	unsigned int		fail_set;
+} fake;
+
+static int
+fake_key(const char *file, int fd, struct stat *st)
+{
+	int error;
+
+	if (file != NULL)
+		error = stat(file, st);
+	else
+		error = fstat(fd, st);
+
+	return (error);
+}
+
+static struct fake_attr *
+fake_find(const struct stat *st, const char *name)
+{
+
+	for (size_t i = 0; i < fake.nattrs; i++) {
+		if (fake.attrs[i].dev == st->st_dev &&
+		    fake.attrs[i].ino == st->st_ino &&
+		    !strcmp(fake.attrs[i].name, name))
+			return (&fake.attrs[i]);
+	}
+
+	return (NULL);
+}
+
+static ssize_t
+fake_list(const char *file, int fd, void *data, size_t nbytes)
+{
+	struct stat st;
+	size_t len;
+	size_t pos;
+
+	fake.list++;
+	if (fake_key(file, fd, &st) == -1)
+		return (-1);
+
+	pos = 0;
+	for (size_t i = 0; i < fake.nattrs; i++) {
+		if (fake.attrs[i].dev != st.st_dev || fake.attrs[i].ino != st.st_ino)
+			continue;
+
+		len = strlen(fake.attrs[i].name);
+		if (data != NULL) {
+			if (pos + 1 + len > nbytes)
+				return (pos);
+			((char *)data)[pos] = len;
+			memcpy((char *)data + pos + 1, fake.attrs[i].name, len);
+		}
+		pos += 1 + len;
+	}
+
+	return (pos);
+}
+
+static ssize_t
+fake_get(const char *file, int fd, const char *attr, void *data, size_t nbytes)
+{
+	struct fake_attr *fa;
+	struct stat st;
+
+	fake.get++;
+	if (fake_key(file, fd, &st) == -1)
+		return (-1);
+
+	fa = fake_find(&st, attr);
+	if (fa == NULL) {
+		errno = ENOATTR;
+		return (-1);
+	}
+
+	if (data == NULL)
+		return (fa->len);
+
+	memcpy(data, fa->value, MIN(nbytes, fa->len));
+
+	return (MIN(nbytes, fa->len));
+}
+
+static ssize_t
+fake_set(const char *file, int fd, const char *attr, const void *data, size_t nbytes)
+{
+	struct fake_attr *fa;
+	struct stat st;
+
+	fake.set++;
+	if (fake.set == fake.fail_set) {
+		errno = EIO;
+		return (-1);
+	}
+	if (fake_key(file, fd, &st) == -1)
+		return (-1);
+
+	if (nbytes > sizeof(fa->value)) {
+		errno = ENOSPC;
+		return (-1);
+	}
+
+	fa = fake_find(&st, attr);
+	if (fa == NULL) {
+		ATF_REQUIRE(fake.nattrs < FAKE_NATTRS);
+		fa = &fake.attrs[fake.nattrs++];
+		fa->dev = st.st_dev;
+		fa->ino = st.st_ino;
+		strlcpy(fa->name, attr, sizeof(fa->name));
+	}
+	memcpy(fa->value, data, nbytes);
+	fa->len = nbytes;
+
+	return (nbytes);
+}
+
+static int
+fake_delete(const char *file, int fd, const char *attr)
+{
+	struct fake_attr *fa;
+	struct stat st;
+
+	fake.delete++;
+	if (fake_key(file, fd, &st) == -1)
+		return (-1);
+
+	fa = fake_find(&st, attr);
+	if (fa == NULL) {
+		errno = ENOATTR;
+		return (-1);
+	}
+	*fa = fake.attrs[--fake.nattrs];
+
+	return (0);
+}
+
+static ssize_t
+fake_list_file(void *ctx __unused, const char *file, int attrnamespace __unused,
+    void *data, size_t nbytes)
+{
+
+	return (fake_list(file, -1, data, nbytes));
+}
+
+static ssize_t
+fake_get_file(void *ctx __unused, const char *file, int attrnamespace __unused,
+    const char *attr, void *data, size_t nbytes)
+{
+
+	return (fake_get(file, -1, attr, data, nbytes));
+}
+
+static ssize_t
+fake_set_file(void *ctx __unused, const char *file, int attrnamespace __unused,
+    const char *attr, const void *data, size_t nbytes)
+{
+
+	return (fake_set(file, -1, attr, data, nbytes));
+}
+
+static int
+fake_delete_file(void *ctx __unused, const char *file, int attrnamespace __unused,
+    const char *attr)
+{
+
+	return (fake_delete(file, -1, attr));
+}
+
+static ssize_t
+fake_list_fd(void *ctx __unused, int fd, int attrnamespace __unused,
+    void *data, size_t nbytes)
+{
+
+	return (fake_list(NULL, fd, data, nbytes));
+}
+
+static ssize_t
+fake_get_fd(void *ctx __unused, int fd, int attrnamespace __unused,
+    const char *attr, void *data, size_t nbytes)
+{
+
+	return (fake_get(NULL, fd, attr, data, nbytes));
+}
+
+static ssize_t
+fake_set_fd(void *ctx __unused, int fd, int attrnamespace __unused,
+    const char *attr, const void *data, size_t nbytes)
+{
+
+	return (fake_set(NULL, fd, attr, data, nbytes));
+}
+
+static int
+fake_delete_fd(void *ctx __unused, int fd, int attrnamespace __unused,
+    const char *attr)
+{
+
+	return (fake_delete(NULL, fd, attr));
+}
+
+static const struct hbsdcontrol_backend fake_backend = {
+	.name =		"fake",
+	.list_file =	fake_list_file,
+	.get_file =	fake_get_file,
+	.set_file =	fake_set_file,
+	.delete_file =	fake_delete_file,
+	.list_fd =	fake_list_fd,
+	.get_fd =	fake_get_fd,
+	.set_fd =	fake_set_fd,
+	.delete_fd =	fake_delete_fd,
+};
+
+/*
+ * Create the file on a clean backend, and reset the counters.
+ */
+static void
+setup(const char *file)
+{
+	int fd;
+
+	fd = open(file, O_RDWR | O_CREAT, 0644);
+	ATF_REQUIRE(fd != -1);
+	close(fd);
+
+	memset(&fake, 0, sizeof(fake));
+	hbsdcontrol_set_backend(&fake_backend, NULL);
+	hbsdcontrol_set_flags_mode(HBSDCONTROL_FLAGS_LEGACY);
+	hbsdcontrol_reset_op_stats();
+}
+
+static void
+reset_counters(void)
+{
+
+	fake.list = fake.get = fake.set = fake.delete = 0;
+	hbsdcontrol_reset_op_stats();
+}
+
+/*
+ * Check the budget, on both the fake and the library counters.
+ */
+static void
+require_ops(unsigned int list, unsigned int get, unsigned int set,
+    unsigned int delete)
+{
+	struct hbsdcontrol_op_stats stats;
+
+	hbsdcontrol_get_op_stats(&stats);
+
+	ATF_CHECK_EQ_MSG(fake.list, list, "list: %u != %u", fake.list, list);
+	ATF_CHECK_EQ_MSG(fake.get, get, "get: %u != %u", fake.get, get);
+	ATF_CHECK_EQ_MSG(fake.set, set, "set: %u != %u", fake.set, set);
+	ATF_CHECK_EQ_MSG(fake.delete, delete, "delete: %u != %u",
+	    fake.delete, delete);
+	ATF_CHECK_EQ(stats.list, list);
+	ATF_CHECK_EQ(stats.get, get);
+	ATF_CHECK_EQ(stats.set, set);
+	ATF_CHECK_EQ(stats.delete, delete);
+}
+
+static void
+bulk_set(const char *file, const char *feature, pax_feature_state_t state)
+{
+	struct hbsdcontrol_bulk_entry entry;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.path = __DECONST(char *, file);
+
+	ATF_REQUIRE_EQ(hbsdcontrol_bulk_set_feature_state(NULL, &entry, 1,
+	    feature, state), 0);
+	ATF_REQUIRE_EQ(entry.error, 0);
+}
+
+ATF_TC_WITHOUT_HEAD(list_sysdef);
+ATF_TC_BODY(list_sysdef, tc)
+{
+	char *features;
+
+	setup("file");
+
+	features = NULL;
+	ATF_REQUIRE_EQ(hbsdcontrol_list_features("file", &features), 0);
+	free(features);
+
+	/* A single list, and no get on a file without attributes. */
+	require_ops(1, 0, 0, 0);
+}
+
+ATF_TC_WITHOUT_HEAD(get_sysdef);
+ATF_TC_BODY(get_sysdef, tc)
+{
+	pax_feature_state_t state;
+
+	setup("file");
+
+	ATF_REQUIRE_EQ(hbsdcontrol_get_feature_state("file", "mprotect", &state), 0);
+	ATF_CHECK_EQ(state, sysdef);
+
+	/* The two attributes of the feature only. */
+	require_ops(0, 2, 0, 0);
+}
+
+ATF_TC_WITHOUT_HEAD(get_flags_sync);
+ATF_TC_BODY(get_flags_sync, tc)
+{
+	pax_feature_state_t state;
+
+	setup("file");
+	hbsdcontrol_set_flags_mode(HBSDCONTROL_FLAGS_SYNC);
+	bulk_set("file", "mprotect", disable);
+	reset_counters();
+
+	ATF_REQUIRE_EQ(hbsdcontrol_get_feature_state("file", "mprotect", &state), 0);
+	ATF_CHECK_EQ(state, disable);
+
+	/* The flags attribute holds every feature. */
+	require_ops(0, 1, 0, 0);
+}
+
+ATF_TC_WITHOUT_HEAD(set_sysdef);
+ATF_TC_BODY(set_sysdef, tc)
+{
+	pax_feature_state_t state;
+
+	setup("file");
+
+	bulk_set("file", "mprotect", enable);
+
+	/*
+	 * One list, and the two attributes of the feature.  The file has
+	 * no flags attribute to remove.
+	 */
+	require_ops(1, 0, 2, 0);
+
+	ATF_REQUIRE_EQ(hbsdcontrol_get_feature_state("file", "mprotect", &state), 0);
+	ATF_CHECK_EQ(state, enable);
+}
+
+ATF_TC_WITHOUT_HEAD(set_matching);
+ATF_TC_BODY(set_matching, tc)
+{
+
+	setup("file");
+	bulk_set("file", "mprotect", enable);
+	reset_counters();
+
+	bulk_set("file", "mprotect", enable);
+
+	/* An already matching file costs no write. */
+	require_ops(1, 2, 0, 0);
+}
+
+ATF_TC_WITHOUT_HEAD(set_matching_flags_sync);
+ATF_TC_BODY(set_matching_flags_sync, tc)
+{
+
+	setup("file");
+	hbsdcontrol_set_flags_mode(HBSDCONTROL_FLAGS_SYNC);
+	bulk_set("file", "mprotect", enable);
+	reset_counters();
+
+	bulk_set("file", "mprotect", enable);
+
+	require_ops(0, 1, 0, 0);
+}
+
+ATF_TC_WITHOUT_HEAD(reset_sysdef);
+ATF_TC_BODY(reset_sysdef, tc)
+{
+
+	setup("file");
+
+	bulk_set("file", "mprotect", sysdef);
+
+	/* Nothing to remove. */
+	require_ops(1, 0, 0, 0);
+}
+
+ATF_TC_WITHOUT_HEAD(reset_all_sysdef);
+ATF_TC_BODY(reset_all_sysdef, tc)
+{
+	struct hbsdcontrol_bulk_entry entry;
+
+	setup("file");
+
+	memset(&entry, 0, sizeof(entry));
+	entry.path = "file";
+	ATF_REQUIRE_EQ(hbsdcontrol_bulk_reset_all(NULL, &entry, 1), 0);
+	ATF_REQUIRE_EQ(entry.error, 0);
+
+	/* Neither the pax nor the flags attributes are there. */
+	require_ops(1, 0, 0, 0);
+}
+
+ATF_TC_WITHOUT_HEAD(reset_all_flags);
+ATF_TC_BODY(reset_all_flags, tc)
+{
+	struct hbsdcontrol_bulk_entry entry;
+	pax_state_word_t word;
+
+	setup("file");
+	hbsdcontrol_set_flags_mode(HBSDCONTROL_FLAGS_SYNC);
+	bulk_set("file", "mprotect", disable);
+	hbsdcontrol_set_flags_mode(HBSDCONTROL_FLAGS_LEGACY);
+	reset_counters();
+
+	memset(&entry, 0, sizeof(entry));
+	entry.path = "file";
+	ATF_REQUIRE_EQ(hbsdcontrol_bulk_reset_all(NULL, &entry, 1), 0);
+	ATF_REQUIRE_EQ(entry.error, 0);
+
+	/* The two attributes of the feature, and the flags attribute. */
+	require_ops(1, 0, 0, 3);
+	ATF_CHECK_EQ(hbsdcontrol_get_flags("file", &word), ENOATTR);
+}
+
+ATF_TC_WITHOUT_HEAD(apply_profile_matching);
+ATF_TC_BODY(apply_profile_matching, tc)
+{
+	struct hbsdcontrol_profile profile;
+
+	setup("file");
+	ATF_REQUIRE_EQ(hbsdcontrol_profile_compile("test",
+	    "mprotect=disable pageexec=disable", &profile), 0);
+	ATF_REQUIRE_EQ(hbsdcontrol_profile_apply(NULL, &profile, "file"), 0);
+	reset_counters();
+
+	ATF_REQUIRE_EQ(hbsdcontrol_profile_apply(NULL, &profile, "file"), 0);
+
+	require_ops(1, 4, 0, 0);
+}
+
+ATF_TC_WITHOUT_HEAD(stale_flags);
+ATF_TC_BODY(stale_flags, tc)
+{
+	pax_feature_state_t state;
+
+	setup("file");
+	hbsdcontrol_set_flags_mode(HBSDCONTROL_FLAGS_SYNC);
+	bulk_set("file", "mprotect", enable);
+
+	/* A change without --flags-sync must not leave the flags stale. */
+	hbsdcontrol_set_flags_mode(HBSDCONTROL_FLAGS_LEGACY);
+	bulk_set("file", "mprotect", disable);
+
+	hbsdcontrol_set_flags_mode(HBSDCONTROL_FLAGS_SYNC);
+	ATF_REQUIRE_EQ(hbsdcontrol_get_feature_state("file", "mprotect", &state), 0);
+	ATF_CHECK_EQ(state, disable);
+}
+
+ATF_TC_WITHOUT_HEAD(set_partial_flags_sync);
+ATF_TC_BODY(set_partial_flags_sync, tc)
+{
+	struct hbsdcontrol_bulk_entry entry;
+	struct hbsdcontrol_profile profile;
+	pax_feature_state_t state;
+	pax_state_word_t word;
+
+	setup("file");
+	hbsdcontrol_set_flags_mode(HBSDCONTROL_FLAGS_SYNC);
+	bulk_set("file", "mprotect", enable);
+	bulk_set("file", "pageexec", enable);
+	reset_counters();
+
+	/* The two sets of pageexec are done, the first one of mprotect fails. */
+	fake.fail_set = 3;
+	ATF_REQUIRE_EQ(hbsdcontrol_profile_compile("test",
+	    "mprotect=disable pageexec=disable", &profile), 0);
+	memset(&entry, 0, sizeof(entry));
+	entry.path = "file";
+	ATF_CHECK_EQ(hbsdcontrol_bulk_write_state(NULL, &entry, NULL, 1,
+	    profile.mask, profile.word), EIO);
+	ATF_CHECK_EQ(entry.error, EIO);
+	fake.fail_set = 0;
+
+	/* The flags attribute is gone, the attributes are read instead. */
+	ATF_CHECK_EQ(hbsdcontrol_get_flags("file", &word), ENOATTR);
+	ATF_REQUIRE_EQ(hbsdcontrol_get_feature_state("file", "pageexec", &state), 0);
+	ATF_CHECK_EQ(state, disable);
+	ATF_REQUIRE_EQ(hbsdcontrol_get_feature_state("file", "mprotect", &state), 0);
+	ATF_CHECK_EQ(state, enable);
+}
+
+ATF_TC_WITHOUT_HEAD(set_fd_replaced);
+ATF_TC_BODY(set_fd_replaced, tc)
+{
+	pax_feature_state_t state;
+	int fd;
+
+	setup("file");
+	setup("other");
+
+	fd = open("file", O_RDONLY);
+	ATF_REQUIRE(fd != -1);
+	ATF_REQUIRE(rename("other", "file") == 0);
+
+	/* The file open on fd is changed, not the one now at its path. */
+	ATF_REQUIRE_EQ(hbsdcontrol_set_feature_state_fd("file", fd, "mprotect",
+	    disable), 0);
+	close(fd);
+
+	ATF_REQUIRE_EQ(hbsdcontrol_get_feature_state("file", "mprotect", &state), 0);
+	ATF_CHECK_EQ(state, sysdef);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+
+	ATF_TP_ADD_TC(tp, list_sysdef);
+	ATF_TP_ADD_TC(tp, get_sysdef);
+	ATF_TP_ADD_TC(tp, get_flags_sync);
+	ATF_TP_ADD_TC(tp, set_sysdef);
+	ATF_TP_ADD_TC(tp, set_matching);
+	ATF_TP_ADD_TC(tp, set_matching_flags_sync);
+	ATF_TP_ADD_TC(tp, reset_sysdef);
+	ATF_TP_ADD_TC(tp, reset_all_sysdef);
+	ATF_TP_ADD_TC(tp, reset_all_flags);
+	ATF_TP_ADD_TC(tp, apply_profile_matching);
+	ATF_TP_ADD_TC(tp, stale_flags);
+	ATF_TP_ADD_TC(tp, set_partial_flags_sync);
+	ATF_TP_ADD_TC(tp, set_fd_replaced);
+
+	return (atf_no_error());
+}
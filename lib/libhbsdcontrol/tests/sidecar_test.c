@@ -0,0 +1,188 @@
+/*-
+ * Copyright (c) 2015-2018 Oliver Pinter <oliver.pinter@HardenedBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atf-c.h>
+
+#include "libhbsdcontrol.h"
+
+static struct hbsdcontrol_sidecar *db;
+
+static void
+create(const char *file)
+{
+	int fd;
+
+	fd = open(file, O_RDWR | O_CREAT, 0644);
+	ATF_REQUIRE(fd != -1);
+	close(fd);
+}
+
+/*
+ * Create the file, and keep its attributes in a new sidecar database.
+ */
+static void
+setup(const char *file)
+{
+
+	create(file);
+
+	ATF_REQUIRE_EQ(hbsdcontrol_sidecar_open("sidecar.db", &db), 0);
+	hbsdcontrol_set_backend(&hbsdcontrol_sidecar_backend, db);
+	hbsdcontrol_set_flags_mode(HBSDCONTROL_FLAGS_LEGACY);
+}
+
+static void
+teardown(void)
+{
+
+	hbsdcontrol_set_backend(NULL, NULL);
+	ATF_REQUIRE_EQ(hbsdcontrol_sidecar_close(&db), 0);
+}
+
+static void
+bulk_set(const char *file, const char *feature, pax_feature_state_t state)
+{
+	struct hbsdcontrol_bulk_entry entry;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.path = __DECONST(char *, file);
+
+	ATF_REQUIRE_EQ(hbsdcontrol_bulk_set_feature_state(NULL, &entry, 1,
+	    feature, state), 0);
+}
+
+static void
+migrate(const char *file, bool remove)
+{
+	struct hbsdcontrol_bulk_entry entry;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.path = __DECONST(char *, file);
+
+	ATF_REQUIRE_EQ(hbsdcontrol_bulk_migrate_flags(&entry, 1, remove), 0);
+	ATF_REQUIRE_EQ(entry.error, 0);
+}
+
+static void
+require_state(const char *file, const char *feature, pax_feature_state_t state)
+{
+	pax_feature_state_t cur;
+
+	ATF_REQUIRE_EQ(hbsdcontrol_get_feature_state(file, feature, &cur), 0);
+	ATF_CHECK_EQ_MSG(cur, state, "%s: %d != %d", feature, cur, state);
+}
+
+ATF_TC_WITHOUT_HEAD(migrate_remove);
+ATF_TC_BODY(migrate_remove, tc)
+{
+
+	setup("file");
+	bulk_set("file", "mprotect", enable);
+	bulk_set("file", "pageexec", disable);
+
+	migrate("file", false);
+	migrate("file", true);
+
+	/* The flags attribute is the stored state itself. */
+	require_state("file", "mprotect", enable);
+	require_state("file", "pageexec", disable);
+	require_state("file", "segvguard", sysdef);
+
+	teardown();
+}
+
+ATF_TC_WITHOUT_HEAD(inode_reuse);
+ATF_TC_BODY(inode_reuse, tc)
+{
+	struct stat old, new;
+
+	setup("old");
+	bulk_set("old", "mprotect", enable);
+	ATF_REQUIRE(stat("old", &old) == 0);
+	ATF_REQUIRE(unlink("old") == 0);
+
+	create("new");
+	ATF_REQUIRE(stat("new", &new) == 0);
+	if (old.st_ino != new.st_ino) {
+		teardown();
+		atf_tc_skip("the inode number was not reused");
+	}
+
+	/* The new file does not inherit the state of the removed one. */
+	require_state("new", "mprotect", sysdef);
+	bulk_set("new", "pageexec", disable);
+	require_state("new", "mprotect", sysdef);
+	require_state("new", "pageexec", disable);
+
+	teardown();
+}
+
+ATF_TC_WITHOUT_HEAD(export_trailing_slash);
+ATF_TC_BODY(export_trailing_slash, tc)
+{
+	struct hbsdcontrol_backend target;
+	struct hbsdcontrol_sidecar *dst;
+
+	ATF_REQUIRE(mkdir("src", 0755) == 0);
+	ATF_REQUIRE(mkdir("dst", 0755) == 0);
+	create("dst/file");
+	setup("src/file");
+	bulk_set("src/file", "mprotect", disable);
+
+	/* A second database stands for the extended attributes of dst. */
+	ATF_REQUIRE_EQ(hbsdcontrol_sidecar_open("dst.db", &dst), 0);
+	target = hbsdcontrol_sidecar_backend;
+	target.name = "target";
+	hbsdcontrol_set_backend(&target, dst);
+
+	ATF_REQUIRE_EQ(hbsdcontrol_sidecar_export(db, NULL, NULL, "src/", "dst"), 0);
+	require_state("dst/file", "mprotect", disable);
+
+	hbsdcontrol_set_backend(NULL, NULL);
+	ATF_REQUIRE_EQ(hbsdcontrol_sidecar_close(&dst), 0);
+	ATF_REQUIRE_EQ(hbsdcontrol_sidecar_close(&db), 0);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+
+	ATF_TP_ADD_TC(tp, migrate_remove);
+	ATF_TP_ADD_TC(tp, inode_reuse);
+	ATF_TP_ADD_TC(tp, export_trailing_slash);
+
+	return (atf_no_error());
+}
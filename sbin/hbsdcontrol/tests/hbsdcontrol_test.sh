@@ -0,0 +1,50 @@
+#
+# Copyright (c) 2015-2018 Oliver Pinter <oliver.pinter@HardenedBSD.org>
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+#
+# $FreeBSD$
+#
+
+atf_test_case command_flags
+command_flags_head()
+{
+	atf_set "descr" "The flags after the command name belong to the command"
+	atf_set "require.user" "root"
+}
+command_flags_body()
+{
+	mkdir a b
+
+	# -s is a diff flag, the global options would reject it.
+	atf_check -s exit:0 -o match:"^feature	added	removed	changed$" \
+	    hbsdcontrol diff -s a b
+	# -d is also a global flag, it must not turn on the debug output.
+	atf_check -s ignore -o not-match:"argc at the end" -e ignore \
+	    hbsdcontrol pax stats -d a
+}
+
+atf_init_test_cases()
+{
+	atf_add_test_case command_flags
+}